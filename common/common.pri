@@ -0,0 +1,11 @@
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += \
+    $$PWD/imagekernels.cpp \
+    $$PWD/scheduler.cpp
+
+HEADERS += \
+    $$PWD/imagekernels.h \
+    $$PWD/parallel.h \
+    $$PWD/scheduler.h
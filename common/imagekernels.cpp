@@ -0,0 +1,123 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "imagekernels.h"
+
+void luminanceRow(const QRgb *src, double *dst, int len)
+{
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128d red = _mm_set1_pd(RED_INTENSE);
+    const __m128d green = _mm_set1_pd(GREEN_INTENSE);
+    const __m128d blue = _mm_set1_pd(BLUE_INTENSE);
+    for (; x + 2 <= len; x += 2) {
+        __m128i p = _mm_loadl_epi64((const __m128i*)(src + x));
+        __m128d r = _mm_cvtepi32_pd(_mm_and_si128(_mm_srli_epi32(p, 16), mask));
+        __m128d g = _mm_cvtepi32_pd(_mm_and_si128(_mm_srli_epi32(p, 8), mask));
+        __m128d b = _mm_cvtepi32_pd(_mm_and_si128(p, mask));
+        _mm_storeu_pd(dst + x, _mm_add_pd(_mm_add_pd(_mm_mul_pd(r, red), _mm_mul_pd(g, green)), _mm_mul_pd(b, blue)));
+    }
+#endif
+    for (; x < len; x++)
+        dst[x] = luminance(src[x]);
+}
+
+void gradientRow(const double *above, const double *row, const double *below, int len,
+                 int begin, int end, double *gx, double *gy)
+{
+    int x = begin;
+
+    // the first and last column clamp, the ones between do not
+    if (x < end && x == 0) {
+        gx[0] = (row[check(1, 0, len)] - row[0]) / 2.;
+        x++;
+    }
+#ifdef __SSE2__
+    const __m128d half = _mm_set1_pd(0.5);
+    for (; x + 2 <= qMin(end, len - 1); x += 2)
+        _mm_storeu_pd(gx + x - begin, _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(row + x + 1), _mm_loadu_pd(row + x - 1)), half));
+#endif
+    for (; x < end; x++)
+        gx[x - begin] = (row[check(x + 1, 0, len)] - row[check(x - 1, 0, len)]) / 2.;
+
+    x = begin;
+#ifdef __SSE2__
+    for (; x + 2 <= end; x += 2)
+        _mm_storeu_pd(gy + x - begin, _mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(below + x), _mm_loadu_pd(above + x)), half));
+#endif
+    for (; x < end; x++)
+        gy[x - begin] = (below[x] - above[x]) / 2.;
+}
+
+static inline QRgb convolvePixel(const QRgb * const *rows, int height, const double *weights, int width,
+                                 int lo, int hi, int x)
+{
+    double rsum, gsum, bsum, w;
+    int k, l, n;
+    QRgb p;
+
+    rsum = gsum = bsum = 0.0;
+    for (l = 0; l < width; l++) {
+        n = check(x - l + width / 2, lo, hi);
+        for (k = 0; k < height; k++) {
+            p = rows[k][n];
+            w = weights[k * width + l];
+            rsum += w * qRed(p);
+            gsum += w * qGreen(p);
+            bsum += w * qBlue(p);
+        }
+    }
+    return qRgb(checkColor(rsum), checkColor(gsum), checkColor(bsum));
+}
+
+#ifdef __SSE2__
+// (blue, green) and (red, alpha) sums to an opaque pixel, the saturating
+// packs clamp like checkColor
+static inline QRgb packPixel(__m128d bg, __m128d ra)
+{
+    __m128i v = _mm_unpacklo_epi64(_mm_cvttpd_epi32(bg), _mm_cvttpd_epi32(ra));
+    v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    return QRgb(_mm_cvtsi128_si32(v)) | 0xff000000;
+}
+#endif
+
+void convolveRow(const QRgb * const *rows, int height, const double *weights, int width,
+                 int lo, int hi, QRgb *dst, int begin, int end)
+{
+    int x = begin;
+#ifdef __SSE2__
+    // pixels whose taps all fall inside [lo, hi) go two at a time
+    int first = qMax(begin, lo + width - 1 - width / 2);
+    int last = qMin(end, hi - width / 2);
+    int k, l, n;
+
+    for (; x < first && x < end; x++)
+        dst[x] = convolvePixel(rows, height, weights, width, lo, hi, x);
+
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 2 <= last; x += 2) {
+        __m128d bg0 = _mm_setzero_pd(), ra0 = _mm_setzero_pd();
+        __m128d bg1 = _mm_setzero_pd(), ra1 = _mm_setzero_pd();
+        for (l = 0; l < width; l++) {
+            n = x - l + width / 2;
+            for (k = 0; k < height; k++) {
+                __m128d w = _mm_set1_pd(weights[k * width + l]);
+                __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k] + n)), zero);
+                __m128i p0 = _mm_unpacklo_epi16(p, zero);
+                __m128i p1 = _mm_unpackhi_epi16(p, zero);
+                bg0 = _mm_add_pd(bg0, _mm_mul_pd(w, _mm_cvtepi32_pd(p0)));
+                ra0 = _mm_add_pd(ra0, _mm_mul_pd(w, _mm_cvtepi32_pd(_mm_srli_si128(p0, 8))));
+                bg1 = _mm_add_pd(bg1, _mm_mul_pd(w, _mm_cvtepi32_pd(p1)));
+                ra1 = _mm_add_pd(ra1, _mm_mul_pd(w, _mm_cvtepi32_pd(_mm_srli_si128(p1, 8))));
+            }
+        }
+        dst[x] = packPixel(bg0, ra0);
+        dst[x + 1] = packPixel(bg1, ra1);
+    }
+#endif
+    for (; x < end; x++)
+        dst[x] = convolvePixel(rows, height, weights, width, lo, hi, x);
+}
@@ -0,0 +1,55 @@
+#ifndef IMAGEKERNELS_H
+#define IMAGEKERNELS_H
+
+#include <QImage>
+
+const double RED_INTENSE = 0.2125;
+const double GREEN_INTENSE = 0.7154;
+const double BLUE_INTENSE = 0.0721;
+
+inline int checkColor(int i)
+{
+    if (i < 0)
+        return 0;
+    if (i > 255)
+        return 255;
+    return i;
+}
+
+// clamps x to [l, b)
+inline int check(int x, int l, int b)
+{
+    if (x < l)
+        return l;
+    if (x >= b)
+        return b - 1;
+    return x;
+}
+
+inline double luminance(QRgb p)
+{
+    return qRed(p) * RED_INTENSE +
+           qGreen(p) * GREEN_INTENSE +
+           qBlue(p) * BLUE_INTENSE;
+}
+
+// Row kernels for RGB32/ARGB32 scan lines. They accumulate in double in the
+// same order as the scalar loops they replace (two lanes at a time with
+// SSE2), so results do not depend on the instruction set.
+
+void luminanceRow(const QRgb *src, double *dst, int len);
+
+// Central differences (next - previous) / 2 of a row of len values with
+// the border replicated, for x in [begin, end) to gx[x - begin] and
+// gy[x - begin].
+void gradientRow(const double *above, const double *row, const double *below, int len,
+                 int begin, int end, double *gx, double *gy);
+
+// dst[x] = sum over l, then k, of weights[k * width + l] *
+// rows[k][check(x - l + width / 2, lo, hi)] for x in [begin, end), with
+// truncated and clamped channels and opaque alpha. rows[k] is the source
+// row for kernel row k, so the caller decides the vertical border.
+void convolveRow(const QRgb * const *rows, int height, const double *weights, int width,
+                 int lo, int hi, QRgb *dst, int begin, int end);
+
+#endif // IMAGEKERNELS_H
@@ -0,0 +1,84 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <QRect>
+
+#include "scheduler.h"
+
+template <class Body>
+class RangeTask : public Task {
+public:
+    RangeTask(const Body *body, int begin, int end) : body(body), begin(begin), end(end) {}
+
+    void run() { (*body)(begin, end); }
+
+private:
+    const Body *body;
+    int begin;
+    int end;
+};
+
+template <class Body>
+class TileTask : public Task {
+public:
+    TileTask(const Body *body, const QRect& tile) : body(body), tile(tile) {}
+
+    void run() { (*body)(tile); }
+
+private:
+    const Body *body;
+    QRect tile;
+};
+
+// Splits [begin, end) into chunks of at least grain items and runs
+// body(chunkBegin, chunkEnd) on the scheduler, blocking until done.
+template <class Body>
+void parallelFor(int begin, int end, const Body& body, int grain = 1)
+{
+    int threads = Scheduler::threadCount();
+    int n = end - begin;
+    int chunk, i;
+
+    if (n <= 0)
+        return;
+
+    chunk = (n + 4 * threads - 1) / (4 * threads);
+    if (chunk < grain)
+        chunk = grain;
+
+    if (threads == 1 || chunk >= n) {
+        body(begin, end);
+        return;
+    }
+
+    TaskGroup group;
+    for (i = begin; i < end; i += chunk)
+        group.spawn(new RangeTask<Body>(&body, i, qMin(i + chunk, end)));
+    group.wait();
+}
+
+// Cuts area into tiles of tileWidth x tileHeight (smaller at the right and
+// bottom edges) and runs body(tile) on the scheduler, blocking until done.
+template <class Body>
+void parallelForTiles(const QRect& area, int tileWidth, int tileHeight, const Body& body)
+{
+    int x, y;
+    QRect tile;
+
+    if (area.isEmpty())
+        return;
+
+    TaskGroup group;
+    for (y = area.top(); y <= area.bottom(); y += tileHeight) {
+        for (x = area.left(); x <= area.right(); x += tileWidth) {
+            tile = QRect(x, y, qMin(tileWidth, area.right() + 1 - x), qMin(tileHeight, area.bottom() + 1 - y));
+            if (Scheduler::threadCount() == 1)
+                body(tile);
+            else
+                group.spawn(new TileTask<Body>(&body, tile));
+        }
+    }
+    group.wait();
+}
+
+#endif // PARALLEL_H
@@ -0,0 +1,282 @@
+#include <QThread>
+#include <QThreadStorage>
+#include <QtAlgorithms>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "scheduler.h"
+
+struct TaskQueue {
+    QMutex mutex;
+    QList<Task*> tasks;
+};
+
+// queue index of a worker thread (-1 on other threads) and the group of the
+// task running on the thread
+struct ThreadState {
+    int index;
+    TaskGroup *group;
+
+    ThreadState() : index(-1), group(0) {}
+};
+
+static QThreadStorage<ThreadState*> states;
+
+static ThreadState* state()
+{
+    if (!states.hasLocalData())
+        states.setLocalData(new ThreadState);
+    return states.localData();
+}
+
+class Worker : public QThread {
+public:
+    Worker(int index) : index(index) {}
+
+protected:
+    void run() { Scheduler::work(index); }
+
+private:
+    int index;
+};
+
+// queues[i] belongs to worker i, the last queue is shared by the other
+// threads. Idle threads sleep on wake; sleeping counts them so that
+// producers only take the mutex when somebody has to be woken. A waiting
+// thread only runs tasks of its group, so a new task wakes every sleeper.
+struct Pool {
+    QVector<TaskQueue*> queues;
+    QList<Worker*> workers;
+    QMutex mutex;
+    QWaitCondition wake;
+    QAtomicInt sleeping;
+    QAtomicInt stopping;
+
+    Pool() : sleeping(0), stopping(0)
+    {
+        int count = qMax(0, QThread::idealThreadCount() - 1);
+        int i;
+
+        for (i = 0; i <= count; i++)
+            queues.append(new TaskQueue);
+        for (i = 0; i < count; i++) {
+            workers.append(new Worker(i));
+            workers.last()->start();
+        }
+    }
+
+    ~Pool()
+    {
+        int i;
+
+        stopping = 1;
+        mutex.lock();
+        wake.wakeAll();
+        mutex.unlock();
+        for (i = 0; i < workers.size(); i++) {
+            workers[i]->wait();
+            delete workers[i];
+        }
+        for (i = 0; i < queues.size(); i++)
+            delete queues[i];
+    }
+
+};
+
+static Pool* pool()
+{
+    static Pool instance;
+    return &instance;
+}
+
+void Task::addDependency(Task *task)
+{
+    QMutexLocker locker(&task->mutex);
+    if (task->finished)
+        return;
+    task->successors.append(this);
+    blockers.ref();
+}
+
+TaskGroup::TaskGroup() : parent(state()->group), pending(0), cancelled(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::spawn(Task *task)
+{
+    task->group = this;
+    pending.ref();
+    mutex.lock();
+    tasks.append(task);
+    mutex.unlock();
+    if (!task->blockers.deref())
+        Scheduler::schedule(task);
+}
+
+void TaskGroup::wait()
+{
+    int self = state()->index;
+    Task *task;
+
+    while (pending != 0) {
+        if ((task = Scheduler::find(self, this)))
+            Scheduler::execute(task);
+        else
+            Scheduler::idle(this);
+    }
+
+    QMutexLocker locker(&mutex);
+    qDeleteAll(tasks);
+    tasks.clear();
+}
+
+bool TaskGroup::isCancelled() const
+{
+    return cancelled != 0 || (parent && parent->isCancelled());
+}
+
+int Scheduler::threadCount()
+{
+    return pool()->queues.size();
+}
+
+void Scheduler::schedule(Task *task)
+{
+    Pool *p = pool();
+    int self = state()->index;
+    TaskQueue *queue = p->queues[self >= 0 ? self : p->queues.size() - 1];
+
+    queue->mutex.lock();
+    queue->tasks.append(task);
+    queue->mutex.unlock();
+
+    if (p->sleeping.fetchAndAddOrdered(0) > 0) {
+        QMutexLocker locker(&p->mutex);
+        p->wake.wakeAll();
+    }
+}
+
+void Scheduler::execute(Task *task)
+{
+    ThreadState *s = state();
+    TaskGroup *outer = s->group;
+    TaskGroup *group = task->group;
+    QList<Task*> next;
+    int i;
+
+    if (!group->isCancelled()) {
+        s->group = group;
+        task->run();
+        s->group = outer;
+    }
+
+    task->mutex.lock();
+    task->finished = true;
+    next = task->successors;
+    task->successors.clear();
+    task->mutex.unlock();
+
+    for (i = 0; i < next.size(); i++) {
+        if (!next[i]->blockers.deref())
+            schedule(next[i]);
+    }
+
+    // the waiting thread may delete the task and the group from here on
+    if (!group->pending.deref() && pool()->sleeping.fetchAndAddOrdered(0) > 0) {
+        QMutexLocker locker(&pool()->mutex);
+        pool()->wake.wakeAll();
+    }
+}
+
+// whether task is in group or in a group nested in it; any task is in
+// group 0
+bool Scheduler::belongs(const Task *task, const TaskGroup *group)
+{
+    const TaskGroup *g;
+
+    if (!group)
+        return true;
+    for (g = task->group; g; g = g->parent) {
+        if (g == group)
+            return true;
+    }
+    return false;
+}
+
+// the newest or oldest task of tasks that belongs to group
+Task* Scheduler::take(QList<Task*>& tasks, const TaskGroup *group, bool newest)
+{
+    int n = tasks.size();
+    int i;
+
+    for (i = 0; i < n; i++) {
+        int k = newest ? n - 1 - i : i;
+        if (belongs(tasks[k], group))
+            return tasks.takeAt(k);
+    }
+    return 0;
+}
+
+// own queue from the back, then the others from the front; a thread
+// waiting for group only takes tasks that belong to it
+Task* Scheduler::find(int self, const TaskGroup *group)
+{
+    Pool *p = pool();
+    int n = p->queues.size();
+    int victims = self >= 0 ? n - 1 : n;
+    Task *task = 0;
+    TaskQueue *queue;
+
+    if (self >= 0) {
+        queue = p->queues[self];
+        QMutexLocker locker(&queue->mutex);
+        if ((task = take(queue->tasks, group, true)))
+            return task;
+    }
+
+    for (int i = 1; i <= victims && !task; i++) {
+        queue = p->queues[(self + i) % n];
+        QMutexLocker locker(&queue->mutex);
+        task = take(queue->tasks, group, false);
+    }
+    return task;
+}
+
+// sleeps until there is work for group, the group is done or the pool
+// stops
+void Scheduler::idle(const TaskGroup *group)
+{
+    Pool *p = pool();
+    QMutexLocker locker(&p->mutex);
+    bool work = false;
+    int i;
+
+    p->sleeping.ref();
+    for (i = 0; i < p->queues.size() && !work; i++) {
+        QMutexLocker queueLocker(&p->queues[i]->mutex);
+        for (int k = 0; k < p->queues[i]->tasks.size() && !work; k++)
+            work = belongs(p->queues[i]->tasks[k], group);
+    }
+    if (p->stopping == 0 && !(group && group->pending == 0) && !work)
+        p->wake.wait(&p->mutex);
+    p->sleeping.deref();
+}
+
+void Scheduler::work(int self)
+{
+    Pool *p = pool();
+    Task *task;
+
+    state()->index = self;
+    while (p->stopping == 0) {
+        if ((task = find(self, 0)))
+            execute(task);
+        else
+            idle(0);
+    }
+}
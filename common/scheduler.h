@@ -0,0 +1,93 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QMutex>
+
+class TaskGroup;
+
+// Unit of work for the scheduler. A task belongs to the group it is spawned
+// in, which deletes it once the group has been waited for.
+class Task {
+public:
+    Task() : group(0), blockers(1), finished(false) {}
+    virtual ~Task() {}
+
+    virtual void run() = 0;
+
+    // Starts this task only after task has finished. Must be called before
+    // this task is spawned; a task that already finished is no dependency.
+    void addDependency(Task *task);
+
+private:
+    Task(const Task&);
+    Task& operator=(const Task&);
+
+    friend class Scheduler;
+    friend class TaskGroup;
+
+    TaskGroup *group;
+    // unfinished dependencies, plus one until the task is spawned
+    QAtomicInt blockers;
+    QMutex mutex;
+    QList<Task*> successors;
+    bool finished;
+};
+
+// Set of tasks that are waited for and cancelled together. A group made
+// while a task runs is nested in the group of that task, so cancelling the
+// outer group cancels the inner one too. Tasks of a cancelled group that
+// have not started are skipped; running tasks may poll isCancelled().
+class TaskGroup {
+public:
+    TaskGroup();
+    ~TaskGroup();
+
+    void spawn(Task *task);
+    // runs queued tasks on the calling thread until every task of the group
+    // has finished or has been skipped
+    void wait();
+
+    void cancel() { cancelled = 1; }
+    bool isCancelled() const;
+
+private:
+    TaskGroup(const TaskGroup&);
+    TaskGroup& operator=(const TaskGroup&);
+
+    friend class Scheduler;
+
+    TaskGroup *parent;
+    QAtomicInt pending;
+    QAtomicInt cancelled;
+    QMutex mutex;
+    QList<Task*> tasks;
+};
+
+// Process-wide pool of idealThreadCount() - 1 workers, each with its own
+// task deque. A worker runs its newest task first and steals the oldest
+// task of another queue when its own is empty; other threads push to a
+// shared queue. A thread waiting for a group runs tasks of that group and
+// of the groups nested in it instead of blocking, so nested parallel loops
+// never use more threads than cores, and a task that waits never starts
+// unrelated work on its own stack.
+class Scheduler {
+public:
+    // the workers plus the calling thread
+    static int threadCount();
+
+private:
+    friend class TaskGroup;
+    friend class Worker;
+
+    static void schedule(Task *task);
+    static void execute(Task *task);
+    static bool belongs(const Task *task, const TaskGroup *group);
+    static Task* take(QList<Task*>& tasks, const TaskGroup *group, bool newest);
+    static Task* find(int self, const TaskGroup *group);
+    static void idle(const TaskGroup *group);
+    static void work(int self);
+};
+
+#endif // SCHEDULER_H
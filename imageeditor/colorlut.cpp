@@ -0,0 +1,285 @@
+#include <QFile>
+#include <QTextStream>
+#include <QStringList>
+
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "colorlut.h"
+#include "utils.h"
+
+ColorLUT::ColorLUT(int size)
+{
+    reset(size);
+}
+
+void ColorLUT::reset(int size)
+{
+    int r, g, b;
+    float *node;
+
+    if (size < 2)
+        size = 2;
+    if (size > LUT_MAX_SIZE)
+        size = LUT_MAX_SIZE;
+
+    n = size;
+    table.resize(4 * n * n * n);
+    node = table.data();
+
+    for (b = 0; b < n; b++) {
+        for (g = 0; g < n; g++) {
+            for (r = 0; r < n; r++) {
+                node[0] = b * 255.f / (n - 1);
+                node[1] = g * 255.f / (n - 1);
+                node[2] = r * 255.f / (n - 1);
+                node[3] = 255.f;
+                node += 4;
+            }
+        }
+    }
+
+    buildIndex();
+}
+
+void ColorLUT::buildIndex()
+{
+    double pos;
+
+    for (int i = 0; i < 256; i++) {
+        pos = i * (n - 1) / 255.;
+        index[i] = (int)pos;
+        if (index[i] > n - 2)
+            index[i] = n - 2;
+        fraction[i] = pos - index[i];
+    }
+}
+
+static inline int toByte(float v)
+{
+    return checkColor((int)floor(v + 0.5f));
+}
+
+void ColorLUT::transform(const ColorMapping& mapping)
+{
+    float *node = table.data();
+    QRgb p;
+
+    for (int i = 0; i < n * n * n; i++, node += 4) {
+        p = mapping.map(qRgb(toByte(node[2]), toByte(node[1]), toByte(node[0])));
+        node[0] = qBlue(p);
+        node[1] = qGreen(p);
+        node[2] = qRed(p);
+    }
+}
+
+// Picks the tetrahedron of the lattice cube containing (fr, fg, fb) and
+// returns its vertices 1 and 2 as offsets from the c000 node together with
+// the barycentric weights of all four vertices (c000, c1, c2, c111).
+static inline void tetrahedron(float fr, float fg, float fb, int dr, int dg, int db,
+                               int *o1, int *o2, float *w)
+{
+    if (fr > fg) {
+        if (fg > fb) {
+            *o1 = dr; *o2 = dr + dg;
+            w[0] = 1 - fr; w[1] = fr - fg; w[2] = fg - fb; w[3] = fb;
+        } else if (fr > fb) {
+            *o1 = dr; *o2 = dr + db;
+            w[0] = 1 - fr; w[1] = fr - fb; w[2] = fb - fg; w[3] = fg;
+        } else {
+            *o1 = db; *o2 = db + dr;
+            w[0] = 1 - fb; w[1] = fb - fr; w[2] = fr - fg; w[3] = fg;
+        }
+    } else {
+        if (fb > fg) {
+            *o1 = db; *o2 = db + dg;
+            w[0] = 1 - fb; w[1] = fb - fg; w[2] = fg - fr; w[3] = fr;
+        } else if (fb > fr) {
+            *o1 = dg; *o2 = dg + db;
+            w[0] = 1 - fg; w[1] = fg - fb; w[2] = fb - fr; w[3] = fr;
+        } else {
+            *o1 = dg; *o2 = dg + dr;
+            w[0] = 1 - fg; w[1] = fg - fr; w[2] = fr - fb; w[3] = fb;
+        }
+    }
+}
+
+QRgb ColorLUT::map(QRgb p) const
+{
+    QRgb res;
+    mapLine(&p, &res, 1);
+    return res;
+}
+
+void ColorLUT::mapLine(const QRgb *src, QRgb *dst, int count) const
+{
+    const int dr = 4, dg = 4 * n, db = 4 * n * n;
+    const float *lut = table.constData();
+    const float *c000, *c1, *c2, *c111;
+    int r, g, b, o1, o2;
+    float w[4];
+
+    for (int i = 0; i < count; i++) {
+        r = qRed(src[i]);
+        g = qGreen(src[i]);
+        b = qBlue(src[i]);
+
+        c000 = lut + index[r] * dr + index[g] * dg + index[b] * db;
+        tetrahedron(fraction[r], fraction[g], fraction[b], dr, dg, db, &o1, &o2, w);
+        c1 = c000 + o1;
+        c2 = c000 + o2;
+        c111 = c000 + dr + dg + db;
+
+#ifdef __SSE2__
+        __m128 acc = _mm_mul_ps(_mm_loadu_ps(c000), _mm_set1_ps(w[0]));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(c1), _mm_set1_ps(w[1])));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(c2), _mm_set1_ps(w[2])));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(c111), _mm_set1_ps(w[3])));
+
+        // rounds half up like toByte; below -0.5 both saturate to 0
+        __m128i v = _mm_cvttps_epi32(_mm_add_ps(acc, _mm_set1_ps(0.5f)));
+        v = _mm_packs_epi32(v, v);
+        v = _mm_packus_epi16(v, v);
+        dst[i] = _mm_cvtsi128_si32(v);
+#else
+        float c[3];
+        for (int k = 0; k < 3; k++)
+            c[k] = c000[k] * w[0] + c1[k] * w[1] + c2[k] * w[2] + c111[k] * w[3];
+        dst[i] = qRgb(toByte(c[2]), toByte(c[1]), toByte(c[0]));
+#endif
+    }
+}
+
+static inline void latticePosition(float v, int n, int *index, float *fraction)
+{
+    float pos = qBound(0.f, v, 255.f) * (n - 1) / 255.f;
+    *index = qMin((int)pos, n - 2);
+    *fraction = pos - *index;
+}
+
+// Unquantized inputs and outputs for planar float images.
+void ColorLUT::mapPlanar(float *red, float *green, float *blue, int count) const
+{
+    const int dr = 4, dg = 4 * n, db = 4 * n * n;
+    const float *lut = table.constData();
+    const float *c000, *c1, *c2, *c111;
+    int ir, ig, ib, o1, o2;
+    float fr, fg, fb, w[4];
+
+    for (int i = 0; i < count; i++) {
+        latticePosition(red[i], n, &ir, &fr);
+        latticePosition(green[i], n, &ig, &fg);
+        latticePosition(blue[i], n, &ib, &fb);
+
+        c000 = lut + ir * dr + ig * dg + ib * db;
+        tetrahedron(fr, fg, fb, dr, dg, db, &o1, &o2, w);
+        c1 = c000 + o1;
+        c2 = c000 + o2;
+        c111 = c000 + dr + dg + db;
+
+        blue[i] = c000[0] * w[0] + c1[0] * w[1] + c2[0] * w[2] + c111[0] * w[3];
+        green[i] = c000[1] * w[0] + c1[1] * w[1] + c2[1] * w[2] + c111[1] * w[3];
+        red[i] = c000[2] * w[0] + c1[2] * w[1] + c2[2] * w[2] + c111[2] * w[3];
+    }
+}
+
+bool ColorLUT::load(const QString& fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning("Cannot open LUT file");
+        return false;
+    }
+
+    QTextStream in(&file);
+    QString line;
+    QStringList tokens;
+    QVector<float> values;
+    int size = 0;
+    bool ok;
+
+    while (!in.atEnd()) {
+        line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith("#"))
+            continue;
+
+        tokens = line.split(' ', QString::SkipEmptyParts);
+        if (tokens[0] == "TITLE")
+            continue;
+        if (tokens[0] == "LUT_3D_SIZE" && tokens.size() == 2) {
+            size = tokens[1].toInt(&ok);
+            if (!ok || size < 2 || size > LUT_MAX_SIZE) {
+                qWarning("Unsupported LUT size");
+                return false;
+            }
+            continue;
+        }
+        if (tokens[0] == "DOMAIN_MIN" || tokens[0] == "DOMAIN_MAX") {
+            double bound = tokens[0] == "DOMAIN_MIN" ? 0.0 : 1.0;
+            for (int i = 1; i < tokens.size(); i++) {
+                if (fabs(tokens[i].toDouble() - bound) > eps) {
+                    qWarning("Only the [0, 1] LUT domain is supported");
+                    return false;
+                }
+            }
+            continue;
+        }
+        if (tokens.size() != 3) {
+            qWarning("Unsupported LUT entry: %s", qPrintable(line));
+            return false;
+        }
+        for (int i = 0; i < 3; i++) {
+            values.push_back(tokens[i].toFloat(&ok));
+            if (!ok) {
+                qWarning("Wrong LUT entry: %s", qPrintable(line));
+                return false;
+            }
+        }
+    }
+    file.close();
+
+    if (size == 0 || values.size() != 3 * size * size * size) {
+        qWarning("Wrong number of LUT entries");
+        return false;
+    }
+
+    reset(size);
+    float *node = table.data();
+    for (int i = 0; i < values.size(); i += 3, node += 4) {
+        node[0] = values[i + 2] * 255.f;
+        node[1] = values[i + 1] * 255.f;
+        node[2] = values[i] * 255.f;
+    }
+
+    return true;
+}
+
+bool ColorLUT::save(const QString& fileName, const QString& title) const
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        qWarning("Cannot create LUT file");
+        return false;
+    }
+
+    QTextStream out(&file);
+    const float *node = table.constData();
+
+    if (!title.isEmpty())
+        out << "TITLE \"" << title << "\"\n";
+    out << "LUT_3D_SIZE " << n << "\n";
+    out << "DOMAIN_MIN 0.0 0.0 0.0\n";
+    out << "DOMAIN_MAX 1.0 1.0 1.0\n";
+
+    out.setRealNumberNotation(QTextStream::FixedNotation);
+    out.setRealNumberPrecision(6);
+    for (int i = 0; i < n * n * n; i++, node += 4) {
+        out << node[2] / 255. << " " << node[1] / 255. << " " << node[0] / 255. << "\n";
+    }
+    file.close();
+
+    return true;
+}
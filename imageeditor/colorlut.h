@@ -0,0 +1,43 @@
+#ifndef COLORLUT_H
+#define COLORLUT_H
+
+#include <QImage>
+#include <QString>
+#include <QVector>
+
+const int LUT_DEFAULT_SIZE = 33;
+const int LUT_MAX_SIZE = 129;
+
+struct ColorMapping {
+    virtual ~ColorMapping() {}
+    virtual QRgb map(QRgb p) const = 0;
+};
+
+// 3-D lookup table with red changing fastest, as in .cube files.
+// Nodes are stored as 4 floats (blue, green, red, alpha) in 0..255 so that
+// an interpolated node packs straight into a QRgb.
+class ColorLUT {
+public:
+    ColorLUT(int size = LUT_DEFAULT_SIZE);
+
+    int size() const { return n; }
+    void reset(int size);
+    void transform(const ColorMapping& mapping);
+
+    QRgb map(QRgb p) const;
+    void mapLine(const QRgb *src, QRgb *dst, int count) const;
+    void mapPlanar(float *red, float *green, float *blue, int count) const;
+
+    bool load(const QString& fileName);
+    bool save(const QString& fileName, const QString& title = QString()) const;
+
+private:
+    void buildIndex();
+
+    QVector<float> table;
+    int index[256];
+    float fraction[256];
+    int n;
+};
+
+#endif // COLORLUT_H
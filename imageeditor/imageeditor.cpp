@@ -6,41 +6,50 @@
 
 #include "imageeditor.h"
 #include "logic.h"
+#include "pipeline.h"
+#include "profiler.h"
+#include "scratch.h"
 
 ImageEditor::ImageEditor()
 {
-    imageLabel = new QLabel;
-    imageLabel->setBackgroundRole(QPalette::NoRole);
-    imageLabel->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
-    imageLabel->setScaledContents(true);
-
-    scrollArea = new QScrollArea;
-    scrollArea->setBackgroundRole(QPalette::Dark);
-    scrollArea->setWidget(imageLabel);
-    setCentralWidget(scrollArea);
+    view = new ImageView;
+    setCentralWidget(view);
 
     createActions();
     createMenus();
+    statusBar()->showMessage(tr("Ready"));
 
     setWindowTitle(tr("Image Editor"));
     resize(600, 600);
 
     image = 0;
+    graded = false;
+    gradeKey = 0;
+    selectionTool = RectangleTool;
+
+    view->viewport()->installEventFilter(this);
+}
 
-    imageLabel->installEventFilter(this);
+ImageEditor::~ImageEditor()
+{
+    delete image;
 }
 
 void ImageEditor::open()
 {
     QString fileName = QFileDialog::getOpenFileName(this, tr("Open File"), QDir::currentPath());
     if (!fileName.isEmpty()) {
+        // buffers sized for the previous image
+        ScratchPool::trim();
+        Profiler::enter("QImage::load");
+        delete image;
         image = new ImageLogic(QImage(fileName));
+        Profiler::leave();
         if (image->isNull()) {
             QMessageBox::information(this, tr("Image Viewer"), tr("Cannot load %1.").arg(fileName));
             return;
         }
-        imageLabel->setPixmap(QPixmap::fromImage(*image));
-        imageLabel->adjustSize();
+        showImage();
     }
 }
 
@@ -57,26 +66,90 @@ void ImageEditor::save()
     }
 }
 
-void ImageEditor::autolevels()
+void ImageEditor::showImage()
+{
+    view->setImage(image);
+
+    statusBar()->showMessage(Profiler::summary());
+    Profiler::reset();
+}
+
+void ImageEditor::setZoom(double factor)
 {
     if (!image)
         return;
 
-    image->channelCorrection();
+    view->setZoom(factor);
+    zoomInAct->setEnabled(view->zoom() < IMAGEVIEW_MAX_ZOOM);
+    zoomOutAct->setEnabled(view->zoom() > IMAGEVIEW_MIN_ZOOM);
+}
 
-    imageLabel->setPixmap(QPixmap::fromImage(*image));
-    imageLabel->adjustSize();
+void ImageEditor::zoomIn()
+{
+    setZoom(view->zoom() * 1.25);
 }
 
-void ImageEditor::autocontrast()
+void ImageEditor::zoomOut()
+{
+    setZoom(view->zoom() * 0.8);
+}
+
+void ImageEditor::normalSize()
+{
+    setZoom(1.0);
+}
+
+void ImageEditor::processFile()
+{
+    QString input = QFileDialog::getOpenFileName(this, tr("Process File"), QDir::currentPath());
+    if (input.isEmpty())
+        return;
+    QString output = QFileDialog::getSaveFileName(this, tr("Save Result"), QDir::currentPath());
+    if (output.isEmpty())
+        return;
+
+    bool ok = false;
+    QString specs = QInputDialog::getText(this, tr("Adjust parameters:"),
+                                          tr("Operations:\n%1").arg(Pipeline::syntax()),
+                                          QLineEdit::Normal, "gaussian:1.0", &ok);
+    if (!ok)
+        return;
+
+    Pipeline pipeline;
+    QStringList steps = specs.split(' ', QString::SkipEmptyParts);
+    for (int i = 0; i < steps.size(); i++) {
+        if (!pipeline.addStep(steps[i])) {
+            QMessageBox::information(this, tr("Image Viewer"), tr("Wrong operation %1.").arg(steps[i]));
+            return;
+        }
+    }
+
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    Profiler::reset();
+    ok = pipeline.run(input, output);
+    ScratchPool::trim();
+    statusBar()->showMessage(Profiler::summary());
+    Profiler::reset();
+    QApplication::restoreOverrideCursor();
+
+    if (!ok)
+        QMessageBox::information(this, tr("Image Viewer"), tr("Cannot process %1.").arg(input));
+}
+
+void ImageEditor::autolevels()
 {
     if (!image)
         return;
 
-    image->linearCorrection();
+    pointOperation(ImageLogic::ChannelCorrection);
+}
 
-    imageLabel->setPixmap(QPixmap::fromImage(*image));
-    imageLabel->adjustSize();
+void ImageEditor::autocontrast()
+{
+    if (!image)
+        return;
+
+    pointOperation(ImageLogic::LinearCorrection);
 }
 
 void ImageEditor::autocontrastHSV()
@@ -84,10 +157,24 @@ void ImageEditor::autocontrastHSV()
     if (!image)
         return;
 
-    image->linearHSVCorrection();
+    pointOperation(ImageLogic::LinearHSVCorrection);
+}
 
-    imageLabel->setPixmap(QPixmap::fromImage(*image));
-    imageLabel->adjustSize();
+void ImageEditor::adaptiveContrast()
+{
+    if (!image)
+        return;
+
+    bool ok = false;
+    int tiles = QInputDialog::getInt(this, tr("Adjust parameters:"), tr("Tiles per side:"), CLAHE_DEFAULT_TILES, 1, 64, 1, &ok);
+    if (!ok)
+        return;
+    double clip = QInputDialog::getDouble(this, tr("Adjust parameters:"), tr("Clip limit:"), CLAHE_DEFAULT_CLIP, 1.0, 64.0, 1, &ok);
+    if (ok) {
+        image->clahe(tiles, tiles, clip);
+
+        showImage();
+    }
 }
 
 void ImageEditor::gaussian()
@@ -96,12 +183,11 @@ void ImageEditor::gaussian()
         return;
 
     bool ok = false;
-    double sigma = QInputDialog::getDouble(this, tr("Adjust parameters:"), tr("Sigma:"), 0.2, 0.2, 5.0, 1, &ok);
+    double sigma = QInputDialog::getDouble(this, tr("Adjust parameters:"), tr("Sigma:"), 0.2, 0.2, 200.0, 1, &ok);
     if (ok) {
         image->gaussianBlur(sigma);
 
-        imageLabel->setPixmap(QPixmap::fromImage(*image));
-        imageLabel->adjustSize();
+        showImage();
     }
 }
 
@@ -111,12 +197,11 @@ void ImageEditor::fastGaussian()
         return;
 
     bool ok = false;
-    double sigma = QInputDialog::getDouble(this, tr("Adjust parameters:"), tr("Sigma:"), 0.2, 0.2, 5.0, 1, &ok);
+    double sigma = QInputDialog::getDouble(this, tr("Adjust parameters:"), tr("Sigma:"), 0.2, 0.2, 200.0, 1, &ok);
     if (ok) {
         image->fastGaussianBlur(sigma);
 
-        imageLabel->setPixmap(QPixmap::fromImage(*image));
-        imageLabel->adjustSize();
+        showImage();
     }
 }
 
@@ -127,11 +212,16 @@ void ImageEditor::sharp()
 
     bool ok = false;
     double alpha = QInputDialog::getDouble(this, tr("Adjust parameters:"), tr("Alpha:"), 1.5, 0.0, 100.0, 1, &ok);
+    if (!ok)
+        return;
+    double sigma = QInputDialog::getDouble(this, tr("Adjust parameters:"), tr("Sigma (0 for 3x3 kernel):"), 0.0, 0.0, 200.0, 1, &ok);
     if (ok) {
-        image->unsharpMask(alpha);
+        if (sigma > 0)
+            image->unsharpMask(alpha, sigma);
+        else
+            image->unsharpMask(alpha);
 
-        imageLabel->setPixmap(QPixmap::fromImage(*image));
-        imageLabel->adjustSize();
+        showImage();
     }
 }
 
@@ -145,8 +235,7 @@ void ImageEditor::glass()
     if (ok) {
         image->glassEffect(radius);
 
-        imageLabel->setPixmap(QPixmap::fromImage(*image));
-        imageLabel->adjustSize();
+        showImage();
     }
 }
 
@@ -192,8 +281,7 @@ void ImageEditor::waves()
 
     image->wavesEffect(wl, amp);
 
-    imageLabel->setPixmap(QPixmap::fromImage(*image));
-    imageLabel->adjustSize();
+    showImage();
 }
 
 void ImageEditor::median()
@@ -206,8 +294,7 @@ void ImageEditor::median()
     if (ok) {
         image->medianFilter(radius);
 
-        imageLabel->setPixmap(QPixmap::fromImage(*image));
-        imageLabel->adjustSize();
+        showImage();
     }
 }
 
@@ -216,10 +303,101 @@ void ImageEditor::greyWorld()
     if (!image)
         return;
 
-    image->greyWorld();
+    pointOperation(ImageLogic::GreyWorld);
+}
 
-    imageLabel->setPixmap(QPixmap::fromImage(*image));
-    imageLabel->adjustSize();
+void ImageEditor::erosion()
+{
+    if (!image)
+        return;
+
+    int radiusX, radiusY;
+    if (getStructuringElement(&radiusX, &radiusY)) {
+        image->erosion(radiusX, radiusY);
+
+        showImage();
+    }
+}
+
+void ImageEditor::dilation()
+{
+    if (!image)
+        return;
+
+    int radiusX, radiusY;
+    if (getStructuringElement(&radiusX, &radiusY)) {
+        image->dilation(radiusX, radiusY);
+
+        showImage();
+    }
+}
+
+void ImageEditor::opening()
+{
+    if (!image)
+        return;
+
+    int radiusX, radiusY;
+    if (getStructuringElement(&radiusX, &radiusY)) {
+        image->opening(radiusX, radiusY);
+
+        showImage();
+    }
+}
+
+void ImageEditor::closing()
+{
+    if (!image)
+        return;
+
+    int radiusX, radiusY;
+    if (getStructuringElement(&radiusX, &radiusY)) {
+        image->closing(radiusX, radiusY);
+
+        showImage();
+    }
+}
+
+bool ImageEditor::getStructuringElement(int *radiusX, int *radiusY)
+{
+    QDialog *dialog = new QDialog(this);
+    QVBoxLayout *mainLayout = new QVBoxLayout;
+    QGridLayout *gridLayout = new QGridLayout;
+
+    QLabel *radiusXLabel = new QLabel(tr("Horizontal radius:"));
+    QLabel *radiusYLabel = new QLabel(tr("Vertical radius:"));
+
+    QSpinBox *radiusXBox = new QSpinBox;
+    QSpinBox *radiusYBox = new QSpinBox;
+
+    radiusXBox->setRange(0, 500);
+    radiusYBox->setRange(0, 500);
+    radiusXBox->setValue(1);
+    radiusYBox->setValue(1);
+
+    QDialogButtonBox *buttonBox = new QDialogButtonBox(dialog);
+    buttonBox->addButton(QDialogButtonBox::Ok);
+    buttonBox->addButton(QDialogButtonBox::Cancel);
+
+    gridLayout->addWidget(radiusXLabel, 0, 0);
+    gridLayout->addWidget(radiusXBox, 0, 1);
+    gridLayout->addWidget(radiusYLabel, 1, 0);
+    gridLayout->addWidget(radiusYBox, 1, 1);
+
+    mainLayout->addLayout(gridLayout);
+    mainLayout->addWidget(buttonBox);
+    dialog->setLayout(mainLayout);
+
+    connect(buttonBox, SIGNAL(accepted()), dialog, SLOT(accept()));
+    connect(buttonBox, SIGNAL(rejected()), dialog, SLOT(reject()));
+
+    int code = dialog->exec();
+    if (code == QDialog::Rejected)
+        return false;
+
+    *radiusX = radiusXBox->value();
+    *radiusY = radiusYBox->value();
+    return true;
 }
 
 void ImageEditor::userFilter()
@@ -286,8 +464,7 @@ void ImageEditor::userFilter()
 
     image->userFilter(ker);
 
-    imageLabel->setPixmap(QPixmap::fromImage(*image));
-    imageLabel->adjustSize();
+    showImage();
 }
 
 void ImageEditor::scaling()
@@ -300,8 +477,7 @@ void ImageEditor::scaling()
     if (ok) {
         image->scaling(scale);
 
-        imageLabel->setPixmap(QPixmap::fromImage(*image));
-        imageLabel->adjustSize();
+        showImage();
     }
 }
 
@@ -315,41 +491,183 @@ void ImageEditor::rotate()
     if (ok) {
         image->rotate(alpha / 180.0 * M_PI);
 
-        imageLabel->setPixmap(QPixmap::fromImage(*image));
-        imageLabel->adjustSize();
+        showImage();
+    }
+}
+
+void ImageEditor::shearRotate()
+{
+    if (!image)
+        return;
+
+    bool ok = false;
+    int alpha = QInputDialog::getInt(this, tr("Adjust parameters:"), tr("Angle(in degrees from -180 to 180):"), 0, -180, 180, 1, &ok);
+    if (ok) {
+        image->rotate(alpha / 180.0 * M_PI, ImageLogic::ThreeShear);
+
+        showImage();
+    }
+}
+
+void ImageEditor::rotateClockwise()
+{
+    if (!image)
+        return;
+
+    image->rotate(M_PI / 2);
+
+    showImage();
+}
+
+void ImageEditor::rotateCounterclockwise()
+{
+    if (!image)
+        return;
+
+    image->rotate(-M_PI / 2);
+
+    showImage();
+}
+
+void ImageEditor::rotateHalfTurn()
+{
+    if (!image)
+        return;
+
+    image->rotate(M_PI);
+
+    showImage();
+}
+
+void ImageEditor::flipHorizontal()
+{
+    if (!image)
+        return;
+
+    image->flipHorizontal();
+
+    showImage();
+}
+
+void ImageEditor::flipVertical()
+{
+    if (!image)
+        return;
+
+    image->flipVertical();
+
+    showImage();
+}
+
+void ImageEditor::pointOperation(ImageLogic::PointOperation op)
+{
+    if (!graded || image->cacheKey() != gradeKey) {
+        gradeLUT = ColorLUT();
+        graded = true;
+    }
+
+    image->pointOperation(op, &gradeLUT);
+    gradeKey = image->cacheKey();
+
+    showImage();
+}
+
+void ImageEditor::saveLUT()
+{
+    if (!image)
+        return;
+
+    if (!graded || image->cacheKey() != gradeKey) {
+        QMessageBox::information(this, tr("Image Viewer"), tr("Apply one or more color corrections first."));
+        return;
+    }
+
+    QString fileName = QFileDialog::getSaveFileName(this, tr("Save Color LUT"), QDir::currentPath(), tr("cube LUTs (*.cube)"));
+    if (!fileName.isEmpty()) {
+        if (!gradeLUT.save(fileName, QFileInfo(fileName).baseName())) {
+            QMessageBox::information(this, tr("Image Viewer"), tr("Cannot save %1.").arg(fileName));
+            return;
+        }
+    }
+}
+
+void ImageEditor::applyLUT()
+{
+    if (!image)
+        return;
+
+    QString fileName = QFileDialog::getOpenFileName(this, tr("Open Color LUT"), QDir::currentPath(), tr("cube LUTs (*.cube)"));
+    if (!fileName.isEmpty()) {
+        ColorLUT lut;
+        if (!lut.load(fileName)) {
+            QMessageBox::information(this, tr("Image Viewer"), tr("Cannot load %1.").arg(fileName));
+            return;
+        }
+        image->applyColorLUT(lut);
+
+        showImage();
     }
 }
 
 bool ImageEditor::eventFilter(QObject *someOb, QEvent *ev)
 {
-    if(someOb == imageLabel) {
+    if(someOb == view->viewport()) {
         if (!image)
             return true;
         QMouseEvent *mEv = static_cast<QMouseEvent*>(ev);
+        QPoint pos = view->mapToImage(mEv->pos());
         if (ev->type() == QEvent::MouseButtonPress) {
-            imageLabel->setPixmap(QPixmap::fromImage(*image));
-            x1 = mEv->x();
-            y1 = mEv->y();
-            pixmap = imageLabel->pixmap()->copy();
+            view->setOverlay(QPainterPath());
+            x1 = x2 = pos.x();
+            y1 = y2 = pos.y();
+            if (mEv->modifiers() & Qt::ShiftModifier) {
+                selectionTool = LassoTool;
+                lasso.clear();
+                lasso.push_back(pos);
+            } else if (mEv->modifiers() & Qt::ControlModifier) {
+                selectionTool = BrushTool;
+                brushMask = QImage(image->size(), QImage::Format_ARGB32);
+                brushMask.fill(0);
+                brushPath = QPainterPath();
+                brushPath.setFillRule(Qt::WindingFill);
+                drawBrush(pos);
+            } else {
+                selectionTool = RectangleTool;
+            }
             return true;
         }
         if (ev->type() == QEvent::MouseButtonRelease) {
-            x2 = mEv->x();
-            y2 = mEv->y();
-            if (x2 == x1 && y2 == y1) {
+            x2 = pos.x();
+            y2 = pos.y();
+            if (selectionTool == RectangleTool && x2 == x1 && y2 == y1) {
                 image->resetSelection();
-                imageLabel->setPixmap(pixmap);
+                view->setOverlay(QPainterPath());
                 return true;
             }
             captured = true;
-            drawRectangle();
-            image->setSelection(x1, y1, x2, y2);
+            if (selectionTool == LassoTool) {
+                lasso.push_back(pos);
+                drawLasso(true);
+                image->setSelection(lasso);
+            } else if (selectionTool == BrushTool) {
+                image->setSelection(brushMask);
+            } else {
+                drawRectangle();
+                image->setSelection(x1, y1, x2, y2);
+            }
             return true;
         }
         if (ev->type() == QEvent::MouseMove) {
-            x2 = mEv->x();
-            y2 = mEv->y();
-            drawRectangle();
+            x2 = pos.x();
+            y2 = pos.y();
+            if (selectionTool == LassoTool) {
+                lasso.push_back(pos);
+                drawLasso(false);
+            } else if (selectionTool == BrushTool) {
+                drawBrush(pos);
+            } else {
+                drawRectangle();
+            }
             return true;
         }
     }
@@ -357,15 +675,33 @@ bool ImageEditor::eventFilter(QObject *someOb, QEvent *ev)
 }
 
 void ImageEditor::drawRectangle()
+{
+    QPainterPath path;
+    path.addRect(x1, y1, x2 - x1, y2 - y1);
+    view->setOverlay(path);
+}
+
+void ImageEditor::drawLasso(bool closed)
+{
+    QPainterPath path;
+    path.addPolygon(lasso);
+    if (closed)
+        path.closeSubpath();
+    view->setOverlay(path);
+}
+
+void ImageEditor::drawBrush(const QPoint& pos)
 {
     QPainter painter;
-    QPixmap pix = pixmap.copy();
-//    QPixmap *pix = const_cast<QPixmap*>(imageLabel->pixmap());
-    painter.begin(&pix);
-//    painter.begin(pix);
-    painter.drawRect(x1, y1, x2 - x1, y2 - y1);
+
+    painter.begin(&brushMask);
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(QColor(255, 255, 255, 255));
+    painter.drawEllipse(pos, BRUSH_RADIUS, BRUSH_RADIUS);
     painter.end();
-    imageLabel->setPixmap(pix);
+
+    brushPath.addEllipse(pos, BRUSH_RADIUS, BRUSH_RADIUS);
+    view->setOverlay(brushPath, true);
 }
 
 void ImageEditor::createActions()
@@ -382,6 +718,9 @@ void ImageEditor::createActions()
     saveAct->setShortcut(tr("Ctrl+S"));
     connect(saveAct, SIGNAL(triggered()), this, SLOT(save()));
 
+    processAct = new QAction(tr("&Process Large File..."), this);
+    connect(processAct, SIGNAL(triggered()), this, SLOT(processFile()));
+
     autocontrastAct = new QAction(tr("Autocontrast"), this);
     autocontrastAct->setShortcut(tr("Ctrl+A"));
     connect(autocontrastAct, SIGNAL(triggered()), this, SLOT(autocontrast()));
@@ -389,6 +728,9 @@ void ImageEditor::createActions()
     autocontrastHSVAct = new QAction(tr("Autocontrast in HSV color space"), this);
     connect(autocontrastHSVAct, SIGNAL(triggered()), this, SLOT(autocontrastHSV()));
 
+    adaptiveContrastAct = new QAction(tr("Adaptive contrast (CLAHE)..."), this);
+    connect(adaptiveContrastAct, SIGNAL(triggered()), this, SLOT(adaptiveContrast()));
+
     autolevelsAct = new QAction(tr("Autolevels"), this);
     autolevelsAct->setShortcut(tr("Ctrl+L"));
     connect(autolevelsAct, SIGNAL(triggered()), this, SLOT(autolevels()));
@@ -418,6 +760,18 @@ void ImageEditor::createActions()
     greyWorldAct = new QAction(tr("Grey World"), this);
     connect(greyWorldAct, SIGNAL(triggered()), this, SLOT(greyWorld()));
 
+    erosionAct = new QAction(tr("Erosion"), this);
+    connect(erosionAct, SIGNAL(triggered()), this, SLOT(erosion()));
+
+    dilationAct = new QAction(tr("Dilation"), this);
+    connect(dilationAct, SIGNAL(triggered()), this, SLOT(dilation()));
+
+    openingAct = new QAction(tr("Opening"), this);
+    connect(openingAct, SIGNAL(triggered()), this, SLOT(opening()));
+
+    closingAct = new QAction(tr("Closing"), this);
+    connect(closingAct, SIGNAL(triggered()), this, SLOT(closing()));
+
     userFilterAct = new QAction(tr("User Defined Filter"), this);
     connect(userFilterAct, SIGNAL(triggered()), this, SLOT(userFilter()));
 
@@ -426,6 +780,44 @@ void ImageEditor::createActions()
 
     rotationAct = new QAction(tr("Rotate Image"), this);
     connect(rotationAct, SIGNAL(triggered()), this, SLOT(rotate()));
+
+    shearRotationAct = new QAction(tr("Rotate Image (Three-Shear)"), this);
+    connect(shearRotationAct, SIGNAL(triggered()), this, SLOT(shearRotate()));
+
+    rotateClockwiseAct = new QAction(tr("Rotate 90 Degrees Clockwise"), this);
+    rotateClockwiseAct->setShortcut(tr("Ctrl+R"));
+    connect(rotateClockwiseAct, SIGNAL(triggered()), this, SLOT(rotateClockwise()));
+
+    rotateCounterclockwiseAct = new QAction(tr("Rotate 90 Degrees Counterclockwise"), this);
+    rotateCounterclockwiseAct->setShortcut(tr("Ctrl+Shift+R"));
+    connect(rotateCounterclockwiseAct, SIGNAL(triggered()), this, SLOT(rotateCounterclockwise()));
+
+    rotateHalfTurnAct = new QAction(tr("Rotate 180 Degrees"), this);
+    connect(rotateHalfTurnAct, SIGNAL(triggered()), this, SLOT(rotateHalfTurn()));
+
+    flipHorizontalAct = new QAction(tr("Flip Horizontal"), this);
+    connect(flipHorizontalAct, SIGNAL(triggered()), this, SLOT(flipHorizontal()));
+
+    flipVerticalAct = new QAction(tr("Flip Vertical"), this);
+    connect(flipVerticalAct, SIGNAL(triggered()), this, SLOT(flipVertical()));
+
+    saveLUTAct = new QAction(tr("Save Color Corrections as LUT..."), this);
+    connect(saveLUTAct, SIGNAL(triggered()), this, SLOT(saveLUT()));
+
+    applyLUTAct = new QAction(tr("Apply LUT..."), this);
+    connect(applyLUTAct, SIGNAL(triggered()), this, SLOT(applyLUT()));
+
+    zoomInAct = new QAction(tr("Zoom &In (25%)"), this);
+    zoomInAct->setShortcut(tr("Ctrl++"));
+    connect(zoomInAct, SIGNAL(triggered()), this, SLOT(zoomIn()));
+
+    zoomOutAct = new QAction(tr("Zoom &Out (25%)"), this);
+    zoomOutAct->setShortcut(tr("Ctrl+-"));
+    connect(zoomOutAct, SIGNAL(triggered()), this, SLOT(zoomOut()));
+
+    normalSizeAct = new QAction(tr("&Normal Size"), this);
+    normalSizeAct->setShortcut(tr("Ctrl+0"));
+    connect(normalSizeAct, SIGNAL(triggered()), this, SLOT(normalSize()));
 }
 
 void ImageEditor::createMenus()
@@ -433,12 +825,24 @@ void ImageEditor::createMenus()
     fileMenu = new QMenu(tr("&File"), this);
     fileMenu->addAction(openAct);
     fileMenu->addAction(saveAct);
+    fileMenu->addAction(processAct);
     fileMenu->addSeparator();
     fileMenu->addAction(exitAct);
 
     viewMenu = new QMenu(tr("&View"), this);
+    viewMenu->addAction(zoomInAct);
+    viewMenu->addAction(zoomOutAct);
+    viewMenu->addAction(normalSizeAct);
+    viewMenu->addSeparator();
     viewMenu->addAction(scalingAct);
     viewMenu->addAction(rotationAct);
+    viewMenu->addAction(shearRotationAct);
+    viewMenu->addSeparator();
+    viewMenu->addAction(rotateClockwiseAct);
+    viewMenu->addAction(rotateCounterclockwiseAct);
+    viewMenu->addAction(rotateHalfTurnAct);
+    viewMenu->addAction(flipHorizontalAct);
+    viewMenu->addAction(flipVerticalAct);
 
     filtersMenu = new QMenu(tr("F&ilters"), this);
     filtersMenu->addAction(gaussianAct);
@@ -447,11 +851,22 @@ void ImageEditor::createMenus()
     filtersMenu->addAction(medianAct);
     filtersMenu->addAction(userFilterAct);
 
+    morphologyMenu = new QMenu(tr("&Morphology"), this);
+    morphologyMenu->addAction(erosionAct);
+    morphologyMenu->addAction(dilationAct);
+    morphologyMenu->addAction(openingAct);
+    morphologyMenu->addAction(closingAct);
+    filtersMenu->addMenu(morphologyMenu);
+
     toolsMenu = new QMenu(tr("&Tools"), this);
     toolsMenu->addAction(autocontrastAct);
     toolsMenu->addAction(autocontrastHSVAct);
+    toolsMenu->addAction(adaptiveContrastAct);
     toolsMenu->addAction(autolevelsAct);
     toolsMenu->addAction(greyWorldAct);
+    toolsMenu->addSeparator();
+    toolsMenu->addAction(saveLUTAct);
+    toolsMenu->addAction(applyLUTAct);
 
     effectsMenu = new QMenu(tr("&Effects"), this);
     effectsMenu->addAction(wavesAct);
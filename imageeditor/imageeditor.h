@@ -2,26 +2,30 @@
 #define IMAGEEDITOR_H
 
 #include <QMainWindow>
-#include <QScrollArea>
-#include <QLabel>
 #include <QMenu>
 #include <QAction>
 
+#include "imageview.h"
 #include "logic.h"
 
+const int BRUSH_RADIUS = 10;
+
 class ImageEditor : public QMainWindow
 {
     Q_OBJECT
 
 public:
     ImageEditor();
+    ~ImageEditor();
 
 private slots:
     void open();
     void save();
+    void processFile();
     void autolevels();
     void autocontrast();
     void autocontrastHSV();
+    void adaptiveContrast();
     void gaussian();
     void fastGaussian();
     void sharp();
@@ -29,9 +33,24 @@ private slots:
     void waves();
     void median();
     void greyWorld();
+    void erosion();
+    void dilation();
+    void opening();
+    void closing();
     void userFilter();
     void scaling();
     void rotate();
+    void shearRotate();
+    void rotateClockwise();
+    void rotateCounterclockwise();
+    void rotateHalfTurn();
+    void flipHorizontal();
+    void flipVertical();
+    void saveLUT();
+    void applyLUT();
+    void zoomIn();
+    void zoomOut();
+    void normalSize();
 
 protected:
     bool eventFilter(QObject *someOb, QEvent *ev);
@@ -39,18 +58,24 @@ protected:
 private:
     void createActions();
     void createMenus();
+    void showImage();
+    void setZoom(double factor);
     void drawRectangle();
+    void drawLasso(bool closed);
+    void drawBrush(const QPoint& pos);
+    void pointOperation(ImageLogic::PointOperation op);
+    bool getStructuringElement(int *radiusX, int *radiusY);
 
-    QLabel *imageLabel;
-    QScrollArea *scrollArea;
-    QPixmap pixmap;
+    ImageView *view;
 
     QAction *openAct;
     QAction *saveAct;
+    QAction *processAct;
     QAction *exitAct;
     QAction *autolevelsAct;
     QAction *autocontrastAct;
     QAction *autocontrastHSVAct;
+    QAction *adaptiveContrastAct;
     QAction *gaussianAct;
     QAction *fastGaussianAct;
     QAction *sharpAct;
@@ -58,20 +83,52 @@ private:
     QAction *wavesAct;
     QAction *medianAct;
     QAction *greyWorldAct;
+    QAction *erosionAct;
+    QAction *dilationAct;
+    QAction *openingAct;
+    QAction *closingAct;
     QAction *userFilterAct;
     QAction *scalingAct;
     QAction *rotationAct;
+    QAction *shearRotationAct;
+    QAction *rotateClockwiseAct;
+    QAction *rotateCounterclockwiseAct;
+    QAction *rotateHalfTurnAct;
+    QAction *flipHorizontalAct;
+    QAction *flipVerticalAct;
+    QAction *saveLUTAct;
+    QAction *applyLUTAct;
+    QAction *zoomInAct;
+    QAction *zoomOutAct;
+    QAction *normalSizeAct;
 
     QMenu *fileMenu;
     QMenu *viewMenu;
     QMenu *filtersMenu;
     QMenu *toolsMenu;
     QMenu *effectsMenu;
+    QMenu *morphologyMenu;
 
     ImageLogic *image;
 
+    // the color corrections applied since the image last changed otherwise
+    ColorLUT gradeLUT;
+    bool graded;
+    qint64 gradeKey;
+
     int x1, y1, x2, y2;
     bool captured;
+
+    enum SelectionTool {
+        RectangleTool,
+        LassoTool,
+        BrushTool
+    };
+
+    SelectionTool selectionTool;
+    QPolygon lasso;
+    QImage brushMask;
+    QPainterPath brushPath;
 };
 
 #endif // IMAGEEDITOR_H
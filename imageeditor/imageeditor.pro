@@ -2,9 +2,31 @@ SOURCES += \
     main.cpp \
     imageeditor.cpp \
     logic.cpp \
+    colorlut.cpp \
+    pipeline.cpp \
+    imageview.cpp \
+    planarimage.cpp \
+    pyramid.cpp \
+    profiler.cpp \
+    scratch.cpp \
+    sequence.cpp \
+    stripio.cpp \
     utils.cpp
 
 HEADERS += \
     imageeditor.h \
     logic.h \
+    colorlut.h \
+    pipeline.h \
+    imageview.h \
+    planarimage.h \
+    pyramid.h \
+    profiler.h \
+    scratch.h \
+    sequence.h \
+    stripio.h \
     utils.h
+
+LIBS += -lpng -ljpeg
+
+include(../common/common.pri)
@@ -0,0 +1,164 @@
+#include <QtGui>
+
+#include <cmath>
+
+#include "imageview.h"
+
+ImageView::ImageView(QWidget *parent) : QAbstractScrollArea(parent)
+{
+    image = 0;
+    scale = 1.0;
+    overlayFilled = false;
+    tiles.setMaxCost(IMAGEVIEW_CACHE_SIZE);
+
+    viewport()->setBackgroundRole(QPalette::Dark);
+    horizontalScrollBar()->setSingleStep(20);
+    verticalScrollBar()->setSingleStep(20);
+}
+
+void ImageView::setImage(const ImageLogic *image)
+{
+    this->image = image;
+    overlay = QPainterPath();
+    imageChanged();
+}
+
+void ImageView::imageChanged()
+{
+    tiles.clear();
+    updateScrollBars();
+    viewport()->update();
+}
+
+// Keeps the image point at the center of the viewport in place.
+void ImageView::setZoom(double factor)
+{
+    QPoint center = viewport()->rect().center();
+    QPoint o = origin();
+    double cx = (center.x() - o.x()) / scale;
+    double cy = (center.y() - o.y()) / scale;
+
+    scale = qBound(IMAGEVIEW_MIN_ZOOM, factor, IMAGEVIEW_MAX_ZOOM);
+    updateScrollBars();
+    horizontalScrollBar()->setValue(qRound(cx * scale - center.x()));
+    verticalScrollBar()->setValue(qRound(cy * scale - center.y()));
+    viewport()->update();
+}
+
+void ImageView::setOverlay(const QPainterPath& path, bool filled)
+{
+    overlay = path;
+    overlayFilled = filled;
+    viewport()->update();
+}
+
+QPoint ImageView::mapToImage(const QPoint& pos) const
+{
+    QPoint o = origin();
+    return QPoint(int(floor((pos.x() - o.x()) / scale)), int(floor((pos.y() - o.y()) / scale)));
+}
+
+// Position of the image corner in viewport coordinates; images smaller than
+// the viewport are centered.
+QPoint ImageView::origin() const
+{
+    if (!image)
+        return QPoint(0, 0);
+
+    int width = qRound(image->width() * scale);
+    int height = qRound(image->height() * scale);
+    int x = -horizontalScrollBar()->value();
+    int y = -verticalScrollBar()->value();
+
+    if (width < viewport()->width())
+        x = (viewport()->width() - width) / 2;
+    if (height < viewport()->height())
+        y = (viewport()->height() - height) / 2;
+    return QPoint(x, y);
+}
+
+void ImageView::updateScrollBars()
+{
+    int width = image ? qRound(image->width() * scale) : 0;
+    int height = image ? qRound(image->height() * scale) : 0;
+    QSize area = viewport()->size();
+
+    horizontalScrollBar()->setRange(0, qMax(0, width - area.width()));
+    horizontalScrollBar()->setPageStep(area.width());
+    verticalScrollBar()->setRange(0, qMax(0, height - area.height()));
+    verticalScrollBar()->setPageStep(area.height());
+}
+
+const QPixmap* ImageView::tile(const QImage& source, int level, int tx, int ty)
+{
+    qint64 key = (qint64(level) << 48) | (qint64(ty) << 24) | tx;
+    QPixmap *pixmap = tiles.object(key);
+
+    if (!pixmap) {
+        QRect rect = QRect(tx * IMAGEVIEW_TILE_SIZE, ty * IMAGEVIEW_TILE_SIZE,
+                           IMAGEVIEW_TILE_SIZE, IMAGEVIEW_TILE_SIZE).intersected(source.rect());
+        pixmap = new QPixmap(QPixmap::fromImage(source.copy(rect)));
+        tiles.insert(key, pixmap, rect.width() * rect.height() * 4);
+    }
+    return pixmap;
+}
+
+void ImageView::paintEvent(QPaintEvent *event)
+{
+    if (!image || image->isNull())
+        return;
+
+    QPainter painter(viewport());
+    const QImage *source = image;
+    int level = 0;
+
+    if (scale < 1.0) {
+        const Pyramid& pyramid = image->pyramid();
+        level = pyramid.levelForScale(scale);
+        if (level > 0)
+            source = &pyramid.level(level);
+    }
+
+    // tile edges are rounded to whole pixels so neighbours do not leave seams
+    double sx = scale * image->width() / source->width();
+    double sy = scale * image->height() / source->height();
+    double step = IMAGEVIEW_TILE_SIZE;
+    QPoint o = origin();
+    QRect visible = event->rect().translated(-o);
+    int tx1 = qMax(0, int(floor(visible.left() / (sx * step))));
+    int ty1 = qMax(0, int(floor(visible.top() / (sy * step))));
+    int tx2 = qMin((source->width() - 1) / IMAGEVIEW_TILE_SIZE, int(floor(visible.right() / (sx * step))));
+    int ty2 = qMin((source->height() - 1) / IMAGEVIEW_TILE_SIZE, int(floor(visible.bottom() / (sy * step))));
+
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, scale < 1.0);
+    for (int ty = ty1; ty <= ty2; ty++) {
+        int top = o.y() + qRound(ty * step * sy);
+        int bottom = o.y() + qRound(qMin((ty + 1) * step, double(source->height())) * sy);
+        for (int tx = tx1; tx <= tx2; tx++) {
+            int left = o.x() + qRound(tx * step * sx);
+            int right = o.x() + qRound(qMin((tx + 1) * step, double(source->width())) * sx);
+            const QPixmap *pixmap = tile(*source, level, tx, ty);
+            painter.drawPixmap(QRect(left, top, right - left, bottom - top), *pixmap, pixmap->rect());
+        }
+    }
+
+    if (!overlay.isEmpty()) {
+        painter.translate(o);
+        painter.scale(scale, scale);
+        if (overlayFilled) {
+            painter.setPen(Qt::NoPen);
+            painter.setBrush(QColor(255, 255, 255, 96));
+        }
+        painter.drawPath(overlay);
+    }
+}
+
+void ImageView::resizeEvent(QResizeEvent *)
+{
+    updateScrollBars();
+}
+
+void ImageView::scrollContentsBy(int, int)
+{
+    viewport()->update();
+}
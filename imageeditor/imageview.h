@@ -0,0 +1,57 @@
+#ifndef IMAGEVIEW_H
+#define IMAGEVIEW_H
+
+#include <QAbstractScrollArea>
+#include <QCache>
+#include <QPainterPath>
+#include <QPixmap>
+
+#include "logic.h"
+
+const int IMAGEVIEW_TILE_SIZE = 256;
+const int IMAGEVIEW_CACHE_SIZE = 64 * 1024 * 1024;
+const double IMAGEVIEW_MIN_ZOOM = 1.0 / 64;
+const double IMAGEVIEW_MAX_ZOOM = 8.0;
+
+// Scrollable, zoomable view of an ImageLogic. The image is drawn as tiles
+// of IMAGEVIEW_TILE_SIZE pixels taken from the pyramid level that matches
+// the zoom; only visible tiles are converted to pixmaps and they are kept
+// in a cache bounded by IMAGEVIEW_CACHE_SIZE bytes, so memory and repaint
+// cost follow the window size rather than the image size.
+//
+// imageChanged() only drops the cache; tiles are converted again when they
+// are painted next. The overlay path is given in image coordinates.
+class ImageView : public QAbstractScrollArea
+{
+    Q_OBJECT
+
+public:
+    ImageView(QWidget *parent = 0);
+
+    void setImage(const ImageLogic *image);
+    void imageChanged();
+
+    double zoom() const { return scale; }
+    void setZoom(double factor);
+
+    void setOverlay(const QPainterPath& path, bool filled = false);
+    QPoint mapToImage(const QPoint& pos) const;
+
+protected:
+    void paintEvent(QPaintEvent *event);
+    void resizeEvent(QResizeEvent *event);
+    void scrollContentsBy(int dx, int dy);
+
+private:
+    void updateScrollBars();
+    QPoint origin() const;
+    const QPixmap* tile(const QImage& source, int level, int tx, int ty);
+
+    const ImageLogic *image;
+    double scale;
+    QCache<qint64, QPixmap> tiles;
+    QPainterPath overlay;
+    bool overlayFilled;
+};
+
+#endif // IMAGEVIEW_H
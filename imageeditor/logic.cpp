@@ -1,6 +1,8 @@
 #include <QColor>
+#include <QVector>
 
 #include <climits>
+#include <cstring>
 #include <cmath>
 
 #include <iostream>
@@ -8,32 +10,42 @@
 using std::cout;
 using std::sort;
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "logic.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "scratch.h"
 #include "utils.h"
 
-Kernel::Kernel(int width, int height) : width(width), height(height)
+// The row pointers and the rows share one pooled block.
+void Kernel::allocate()
 {
-    kernel = new double*[height];
+    kernel = (double**)ScratchPool::acquire(height * sizeof(double*) + qint64(height) * width * sizeof(double));
+    double *rows = (double*)(kernel + height);
     for (int i = 0; i < height; i++) {
-        kernel[i] = new double[width];
+        kernel[i] = rows + i * width;
     }
 }
 
+Kernel::Kernel(int width, int height) : width(width), height(height)
+{
+    allocate();
+}
+
 Kernel::~Kernel()
 {
-    for (int i = 0; i < height; i++) {
-        delete [] kernel[i];
-    }
-    delete [] kernel;
+    ScratchPool::release(kernel);
 }
 
 Kernel::Kernel(const Kernel& ker)
 {
     height = ker.height;
     width = ker.width;
-    kernel = new double*[height];
+    allocate();
     for (int i = 0; i < height; i++) {
-        kernel[i] = new double[width];
         for (int j = 0; j < width; j++) {
             kernel[i][j] = ker.kernel[i][j];
         }
@@ -45,16 +57,12 @@ Kernel& Kernel::operator=(const Kernel& ker)
     if (this == &ker)
         return *this;
 
-    for (int i = 0; i < height; i++) {
-        delete [] kernel[i];
-    }
-    delete [] kernel;
+    ScratchPool::release(kernel);
 
     height = ker.height;
     width = ker.width;
-    kernel = new double*[height];
+    allocate();
     for (int i = 0; i < height; i++) {
-        kernel[i] = new double[width];
         for (int j = 0; j < width; j++) {
             kernel[i][j] = ker.kernel[i][j];
         }
@@ -128,181 +136,563 @@ Kernel Kernel::id(int size)
     return tmp;
 }
 
+static inline int luminosity(int r, int g, int b)
+{
+    return r * RED_INTENSE + g * GREEN_INTENSE + b * BLUE_INTENSE;
+}
+
+struct LinearMapping : public ColorMapping {
+    int lmin, lmax;
+
+    LinearMapping(int lmin, int lmax) : lmin(lmin), lmax(lmax) {}
+
+    QRgb map(QRgb p) const
+    {
+        int r = checkColor((qRed(p) - lmin) * 255. / (lmax - lmin));
+        int g = checkColor((qGreen(p) - lmin) * 255. / (lmax - lmin));
+        int b = checkColor((qBlue(p) - lmin) * 255. / (lmax - lmin));
+
+        int l = luminosity(qRed(p), qGreen(p), qBlue(p));
+        if (l == lmin)
+            r = g = b = 0;
+        if (l == lmax)
+            r = g = b = 255;
+
+        return qRgb(r, g, b);
+    }
+};
+
+struct HSVMapping : public ColorMapping {
+    int cdf[LIGHT_MAX];
+    int n;
+
+    QRgb map(QRgb p) const
+    {
+        QColor c = QColor::fromRgb(p);
+        int value = (int)floor(255 * double(cdf[c.value()] - cdf[0]) / double(n - cdf[0]));
+        c.setHsv(c.hue(), c.saturation(), value);
+        return c.rgb();
+    }
+};
+
+struct ChannelMapping : public ColorMapping {
+    int rmin, rmax;
+    int gmin, gmax;
+    int bmin, bmax;
+
+    QRgb map(QRgb p) const
+    {
+        int r = qRed(p);
+        int g = qGreen(p);
+        int b = qBlue(p);
+
+        if (rmax > rmin)
+            r = checkColor((r - rmin) * 255 / (rmax - rmin));
+        if (gmax > gmin)
+            g = checkColor((g - gmin) * 255 / (gmax - gmin));
+        if (bmax > bmin)
+            b = checkColor((b - bmin) * 255 / (bmax - bmin));
+
+        return qRgb(r, g, b);
+    }
+};
+
+struct GreyWorldMapping : public ColorMapping {
+    double redAvg, greenAvg, blueAvg, avg;
+
+    QRgb map(QRgb p) const
+    {
+        int r = checkColor(qRed(p) * avg / redAvg);
+        int g = checkColor(qGreen(p) * avg / greenAvg);
+        int b = checkColor(qBlue(p) * avg / blueAvg);
+        return qRgb(r, g, b);
+    }
+};
+
 ImageLogic::ImageLogic(const QImage& image)
 {
-    *static_cast<QImage*>(this) = image;
-    selection = false;
-    x1 = y1 = 0;
-    x2 = width();
-    y2 = height();
+    if (image.format() == QImage::Format_RGB32 || image.format() == QImage::Format_ARGB32)
+        *static_cast<QImage*>(this) = image;
+    else
+        *static_cast<QImage*>(this) = image.convertToFormat(QImage::Format_ARGB32);
+    resetSelection();
 }
 
 int ImageLogic::getLuminosity(int r, int g, int b)
 {
-    return r * RED_INTENSE + g * GREEN_INTENSE + b * BLUE_INTENSE;
+    return luminosity(r, g, b);
 }
 
-void ImageLogic::linearCorrection()
+static void countPass(qint64 pixels)
 {
-    int lmax, lmin;
-    int luminosity[LIGHT_MAX];
-    int l, i;
-    int r, g, b;
-    int x, y;
+    Profiler::count(Profiler::Passes, 1);
+    Profiler::count(Profiler::Pixels, pixels);
+}
 
-    for (i = 0; i < LIGHT_MAX; i++)
-        luminosity[i] = 0;
+struct MapRows {
+    const ImageLogic *image;
+    const ColorMapping *mapping;
+    uchar *bits;
+    int bytesPerLine;
+
+    void operator()(int begin, int end) const
+    {
+        const Span *s;
+        QRgb *line;
+
+        for (int y = begin; y < end; y++) {
+            line = (QRgb*)(bits + y * bytesPerLine);
+            for (s = image->spanBegin(y); s != image->spanEnd(y); s++) {
+                for (int x = s->begin; x < s->end; x++) {
+                    line[x] = mapping->map(line[x]);
+                }
+            }
+        }
+    }
+};
+
+void ImageLogic::mapPixels(const ColorMapping& mapping)
+{
+    ScopedTimer timer("mapPixels");
+
+    countPass(selectedArea());
+
+    MapRows rows;
+    rows.image = this;
+    rows.mapping = &mapping;
+    // bits() detaches, so take the pointer once before going parallel
+    rows.bits = bits();
+    rows.bytesPerLine = bytesPerLine();
+    parallelFor(y1, y2, rows, 16);
+}
+
+ColorMapping* ImageLogic::pointMapping(PointOperation op)
+{
+    ScopedTimer timer("statistics");
+    const Span *s;
+    int x, y, i;
+    QRgb p;
+
+    countPass(selectedArea());
+
+    switch (op) {
+    case LinearCorrection: {
+        int luminosity[LIGHT_MAX];
+        int lmax, lmin;
+
+        for (i = 0; i < LIGHT_MAX; i++)
+            luminosity[i] = 0;
 
-    for (x = x1; x < x2; x++) {
         for (y = y1; y < y2; y++) {
-            QRgb p = pixel(x, y);
-            luminosity[(int)round(getLuminosity(qRed(p), qGreen(p), qBlue(p)))]++;
+            for (s = spanBegin(y); s != spanEnd(y); s++) {
+                for (x = s->begin; x < s->end; x++) {
+                    p = pixel(x, y);
+                    luminosity[(int)round(getLuminosity(qRed(p), qGreen(p), qBlue(p)))]++;
+                }
+            }
         }
+
+        for (lmin = 0; lmin < LIGHT_MAX; lmin++)
+            if (luminosity[lmin])
+                break;
+
+        for (lmax = LIGHT_MAX - 1; lmax >= 0; lmax--)
+            if (luminosity[lmax])
+                break;
+
+        if (lmax <= lmin)
+            return 0;
+
+        return new LinearMapping(lmin, lmax);
     }
+    case LinearHSVCorrection: {
+        int histogram[LIGHT_MAX];
+        HSVMapping *mapping = new HSVMapping;
+        QColor c;
 
-    for (lmin = 0; lmin < LIGHT_MAX; lmin++)
-        if (luminosity[lmin])
-            break;
+        for (i = 0; i < LIGHT_MAX; i++)
+            histogram[i] = 0;
 
-    for (lmax = LIGHT_MAX - 1; lmax >= 0; lmax--)
-        if (luminosity[lmax])
-            break;
+        for (y = y1; y < y2; y++) {
+            for (s = spanBegin(y); s != spanEnd(y); s++) {
+                for (x = s->begin; x < s->end; x++) {
+                    p = pixel(x, y);
+                    c = c.fromRgb(p);
+                    histogram[c.value()]++;
+                }
+            }
+        }
 
-    if (lmax <= lmin)
-        return;
+        mapping->n = selectedArea();
+        mapping->cdf[0] = histogram[0];
+        for (i = 1; i < LIGHT_MAX; i++)
+            mapping->cdf[i] = mapping->cdf[i - 1] + histogram[i];
+
+        return mapping;
+    }
+    case ChannelCorrection: {
+        ChannelMapping *mapping = new ChannelMapping;
+        int r, g, b;
+
+        mapping->rmax = mapping->gmax = mapping->bmax = 0;
+        mapping->rmin = mapping->gmin = mapping->bmin = INT_MAX;
 
-    for (x = x1; x < x2; x++) {
         for (y = y1; y < y2; y++) {
-            QRgb p = pixel(x, y);
+            for (s = spanBegin(y); s != spanEnd(y); s++) {
+                for (x = s->begin; x < s->end; x++) {
+                    p = pixel(x, y);
+
+                    r = qRed(p);
+                    g = qGreen(p);
+                    b = qBlue(p);
 
-            r = checkColor((qRed(p) - lmin) * 255. / (lmax - lmin));
-            g = checkColor((qGreen(p) - lmin) * 255. / (lmax - lmin));
-            b = checkColor((qBlue(p) - lmin) * 255. / (lmax - lmin));
+                    if (r > mapping->rmax) mapping->rmax = r;
+                    if (r < mapping->rmin) mapping->rmin = r;
 
-            l = getLuminosity(qRed(p), qGreen(p), qBlue(p));
-            if (l == lmin)
-                r = g = b = 0;
-            if (l == lmax)
-                r = g = b = 255;
+                    if (g > mapping->gmax) mapping->gmax = g;
+                    if (g < mapping->gmin) mapping->gmin = g;
 
-            setPixel(x, y, qRgb(r, g, b));
+                    if (b > mapping->bmax) mapping->bmax = b;
+                    if (b < mapping->bmin) mapping->bmin = b;
+                }
+            }
         }
+
+        return mapping;
     }
+    case GreyWorld: {
+        GreyWorldMapping *mapping = new GreyWorldMapping;
+        double n = width() * height();
+
+        mapping->redAvg = mapping->greenAvg = mapping->blueAvg = 0.0;
+        for (y = y1; y < y2; y++) {
+            for (s = spanBegin(y); s != spanEnd(y); s++) {
+                for (x = s->begin; x < s->end; x++) {
+                    p = pixel(x, y);
+                    mapping->redAvg += qRed(p);
+                    mapping->greenAvg += qGreen(p);
+                    mapping->blueAvg += qBlue(p);
+                }
+            }
+        }
+
+        mapping->redAvg /= n;
+        mapping->greenAvg /= n;
+        mapping->blueAvg /= n;
+        mapping->avg = (mapping->redAvg + mapping->greenAvg + mapping->blueAvg) / 3.;
+
+        return mapping;
+    }
+    }
+
+    return 0;
 }
 
-void ImageLogic::linearHSVCorrection()
+// lut, if given, is followed by the same mapping, so that it collects the
+// operations applied so far without a copy of the image
+void ImageLogic::pointOperation(PointOperation op, ColorLUT *lut)
 {
-    int histogram[LIGHT_MAX];
-    int cdf[LIGHT_MAX];
-    int x, y, value;
-    int i, n = (x2 - x1) * (y2 - y1);
-    QRgb p;
-    QColor c;
-
-    for (i = 0; i < LIGHT_MAX; i++)
-        histogram[i] = 0;
+    static const char *names[] = { "linearCorrection", "linearHSVCorrection", "channelCorrection", "greyWorld" };
+    ScopedTimer timer(names[op]);
+    ColorMapping *mapping = pointMapping(op);
+    if (!mapping)
+        return;
+    mapPixels(*mapping);
+    if (lut)
+        lut->transform(*mapping);
+    delete mapping;
+}
 
-    for (x = x1; x < x2; x++) {
-        for (y = y1; y < y2; y++) {
-            p = pixel(x, y);
-            c = c.fromRgb(p);
-            histogram[c.value()]++;
-        }
+ColorLUT ImageLogic::bakeColorLUT(const QVector<PointOperation>& ops, int size) const
+{
+    ScopedTimer timer("bakeColorLUT");
+    ImageLogic work(*this);
+    ColorLUT lut(size);
+    ColorMapping *mapping;
+
+    for (int i = 0; i < ops.size(); i++) {
+        mapping = work.pointMapping(ops[i]);
+        if (!mapping)
+            continue;
+        if (i + 1 < ops.size())
+            work.mapPixels(*mapping);
+        lut.transform(*mapping);
+        delete mapping;
     }
 
-    cdf[0] = histogram[0];
-    for (i = 1; i < LIGHT_MAX; i++)
-        cdf[i] = cdf[i - 1] + histogram[i];
+    return lut;
+}
 
-    for (x = x1; x < x2; x++) {
-        for (y = y1; y < y2; y++) {
-            p = pixel(x, y);
+void ImageLogic::applyColorLUT(const ColorLUT& lut)
+{
+    ScopedTimer timer("applyColorLUT");
+    const Span *s;
+    QRgb *line;
 
-            c = c.fromRgb(p);
-            value = (int)floor(255 * double(cdf[c.value()] - cdf[0]) / double(n - cdf[0]));
-            c.setHsv(c.hue(), c.saturation(), value);
-            p = c.rgb();
+    countPass(selectedArea());
 
-            setPixel(x, y, p);
+    for (int y = y1; y < y2; y++) {
+        line = (QRgb*)scanLine(y);
+        for (s = spanBegin(y); s != spanEnd(y); s++) {
+            lut.mapLine(line + s->begin, line + s->begin, s->end - s->begin);
         }
     }
 }
 
-void ImageLogic::channelCorrection()
+void ImageLogic::linearCorrection()
 {
-    int rmax, bmax, gmax;
-    int rmin, bmin, gmin;
-    int r, g, b;
+    pointOperation(LinearCorrection);
+}
 
-    r = g = b = 0;
+void ImageLogic::linearHSVCorrection()
+{
+    pointOperation(LinearHSVCorrection);
+}
 
-    rmax = bmax = gmax = 0;
-    rmin = bmin = gmin = INT_MAX;
+// Tile t of n covers [t * size / n, (t + 1) * size / n) of the selection box.
+struct ClaheHistograms {
+    const ImageLogic *image;
+    int x1, y1, width, height;
+    int tilesX, tilesY;
+    double clip;
+    float *luts;
+
+    void operator()(int begin, int end) const
+    {
+        int histogram[LIGHT_MAX];
+        const Span *s;
+        const QRgb *line;
+        QRgb p;
+        int i, a, b, n, excess, step, sum;
+
+        for (int t = begin; t < end; t++) {
+            int left = x1 + (t % tilesX) * width / tilesX;
+            int right = x1 + (t % tilesX + 1) * width / tilesX;
+            int top = y1 + (t / tilesX) * height / tilesY;
+            int bottom = y1 + (t / tilesX + 1) * height / tilesY;
+            float *lut = luts + t * LIGHT_MAX;
+
+            for (i = 0; i < LIGHT_MAX; i++)
+                histogram[i] = 0;
+
+            n = 0;
+            for (int y = top; y < bottom; y++) {
+                line = (const QRgb*)image->constScanLine(y);
+                for (s = image->spanBegin(y); s != image->spanEnd(y); s++) {
+                    a = qMax(s->begin, left);
+                    b = qMin(s->end, right);
+                    for (int x = a; x < b; x++) {
+                        p = line[x];
+                        histogram[qMax(qRed(p), qMax(qGreen(p), qBlue(p)))]++;
+                    }
+                    if (a < b)
+                        n += b - a;
+                }
+            }
 
-    for (int x = x1; x < x2; x++) {
-        for (int y = y1; y < y2; y++) {
-            QRgb p = pixel(x, y);
+            if (!n) {
+                for (i = 0; i < LIGHT_MAX; i++)
+                    lut[i] = i;
+                continue;
+            }
 
-            r = qRed(p);
-            g = qGreen(p);
-            b = qBlue(p);
+            // clip and hand the excess out evenly, the remainder spread
+            // over the whole range
+            int limit = qMax(1, int(clip * n / LIGHT_MAX));
+            excess = 0;
+            for (i = 0; i < LIGHT_MAX; i++) {
+                if (histogram[i] > limit) {
+                    excess += histogram[i] - limit;
+                    histogram[i] = limit;
+                }
+            }
+            for (i = 0; i < LIGHT_MAX; i++)
+                histogram[i] += excess / LIGHT_MAX;
+            excess %= LIGHT_MAX;
+            if (excess) {
+                step = LIGHT_MAX / excess;
+                for (i = 0; i < LIGHT_MAX && excess > 0; i += step, excess--)
+                    histogram[i]++;
+            }
 
-            if (r > rmax) rmax = r;
-            if (r < rmin) rmin = r;
+            sum = 0;
+            for (i = 0; i < LIGHT_MAX; i++) {
+                sum += histogram[i];
+                lut[i] = qMin(255.0f, 255.0f * sum / n);
+            }
+        }
+    }
+};
+
+// Every pixel interpolates its value between the LUTs of the four nearest
+// tile centers; hue and saturation are kept by scaling the channels.
+struct ClaheRows {
+    ImageLogic *image;
+    uchar *bits;
+    int bytesPerLine;
+    int x1, y1, height;
+    int tilesX, tilesY;
+    const float *luts;
+    const int *column;
+    const float *columnWeight;
+
+    void operator()(int begin, int end) const
+    {
+        const Span *s;
+        QRgb *line;
+        QRgb p;
+        int v, i;
+        float f, k, upper, lower;
+
+        for (int y = begin; y < end; y++) {
+            float ty = (y - y1 + 0.5f) * tilesY / height - 0.5f;
+            int row = qBound(0, int(floor(ty)), tilesY - 1);
+            int next = qMin(row + 1, tilesY - 1);
+            float fy = qBound(0.0f, ty - row, 1.0f);
+            const float *top = luts + row * tilesX * LIGHT_MAX;
+            const float *bottom = luts + next * tilesX * LIGHT_MAX;
+
+            line = (QRgb*)(bits + y * bytesPerLine);
+            for (s = image->spanBegin(y); s != image->spanEnd(y); s++) {
+                for (int x = s->begin; x < s->end; x++) {
+                    p = line[x];
+                    v = qMax(qRed(p), qMax(qGreen(p), qBlue(p)));
+                    if (!v)
+                        continue;
+                    i = column[x - x1] * LIGHT_MAX + v;
+                    f = columnWeight[x - x1];
+                    upper = top[i] + f * (top[i + LIGHT_MAX] - top[i]);
+                    lower = bottom[i] + f * (bottom[i + LIGHT_MAX] - bottom[i]);
+                    k = (upper + fy * (lower - upper)) / v;
+                    line[x] = qRgba(qMin(255, int(qRed(p) * k + 0.5f)),
+                                    qMin(255, int(qGreen(p) * k + 0.5f)),
+                                    qMin(255, int(qBlue(p) * k + 0.5f)),
+                                    qAlpha(p));
+                }
+            }
+        }
+    }
+};
 
-            if (g > gmax) gmax = g;
-            if (g < gmin) gmin = g;
+// Contrast limited adaptive histogram equalization of the HSV value: the
+// selection box is split into tilesX x tilesY tiles, each tile histogram is
+// clipped at clipLimit times the mean bin count and turned into a LUT.
+void ImageLogic::clahe(int tilesX, int tilesY, double clipLimit)
+{
+    ScopedTimer timer("clahe");
+    int width = x2 - x1;
+    int height = y2 - y1;
 
-            if (b > bmax) bmax = b;
-            if (b < bmin) bmin = b;
-        }
+    if (width <= 0 || height <= 0 || tilesX < 1 || tilesY < 1)
+        return;
+    tilesX = qMin(tilesX, width);
+    tilesY = qMin(tilesY, height);
+
+    // one extra LUT at the end, so that the last column of tiles can
+    // interpolate with weight 0 without a branch
+    QVector<float> luts((tilesX * tilesY + 1) * LIGHT_MAX);
+    QVector<int> column(width);
+    QVector<float> columnWeight(width);
+
+    {
+        ScopedTimer timer("tile histograms");
+        countPass(selectedArea());
+        ClaheHistograms histograms;
+        histograms.image = this;
+        histograms.x1 = x1;
+        histograms.y1 = y1;
+        histograms.width = width;
+        histograms.height = height;
+        histograms.tilesX = tilesX;
+        histograms.tilesY = tilesY;
+        histograms.clip = clipLimit;
+        histograms.luts = luts.data();
+        parallelFor(0, tilesX * tilesY, histograms);
     }
 
-    for (int x = x1; x < x2; x++) {
-        for (int y = y1; y < y2; y++) {
-            QRgb p = pixel(x, y);
+    for (int x = 0; x < width; x++) {
+        float tx = (x + 0.5f) * tilesX / width - 0.5f;
+        column[x] = qBound(0, int(floor(tx)), tilesX - 1);
+        columnWeight[x] = column[x] + 1 < tilesX ? qBound(0.0f, tx - column[x], 1.0f) : 0.0f;
+    }
 
-            if (rmax > rmin)
-                r = checkColor((qRed(p) - rmin) * 255 / (rmax - rmin));
-            if (gmax > gmin)
-                g = checkColor((qGreen(p) - gmin) * 255 / (gmax - gmin));
-            if (bmax > bmin)
-                b = checkColor((qBlue(p) - bmin) * 255 / (bmax - bmin));
+    countPass(selectedArea());
+    ClaheRows rows;
+    rows.image = this;
+    // bits() detaches, so take the pointer once before going parallel
+    rows.bits = bits();
+    rows.bytesPerLine = bytesPerLine();
+    rows.x1 = x1;
+    rows.y1 = y1;
+    rows.height = height;
+    rows.tilesX = tilesX;
+    rows.tilesY = tilesY;
+    rows.luts = luts.constData();
+    rows.column = column.constData();
+    rows.columnWeight = columnWeight.constData();
+    parallelFor(y1, y2, rows, 16);
+}
 
-            setPixel(x, y, qRgb(r, g, b));
+void ImageLogic::channelCorrection()
+{
+    pointOperation(ChannelCorrection);
+}
+
+struct ConvolutionRows {
+    const ImageLogic *image;
+    const QImage *original;
+    uchar *bits;
+    int bytesPerLine;
+    const double *weights;
+    int width, height;
+    int x1, y1, x2, y2;
+
+    void operator()(int begin, int end) const
+    {
+        ScratchBuffer<const QRgb*> rows(height);
+        const Span *s;
+
+        for (int y = begin; y < end; y++) {
+            for (int k = 0; k < height; k++)
+                rows[k] = (const QRgb*)original->constScanLine(check(y - k + height / 2, y1, y2));
+            QRgb *dst = (QRgb*)(bits + y * bytesPerLine);
+            for (s = image->spanBegin(y); s != image->spanEnd(y); s++)
+                convolveRow(rows.constData(), height, weights, width, x1, x2, dst, s->begin, s->end);
         }
     }
-}
+};
 
 void ImageLogic::convolution(Kernel& ker)
 {
-    int x, y, k, l, n, m;
-    double rsum, gsum, bsum;
-    QRgb p;
+    ScopedTimer timer("convolution");
 
     ker.reverse();
 
-    QImage original = *static_cast<QImage*>(this);
-
-    for (x = x1; x < x2; x++) {
-        for (y = y1; y < y2; y++) {
-            rsum = gsum = bsum = 0.0;
-            for (l = 0; l < ker.width; l++) {
-                for (k = 0; k < ker.height; k++) {
-                    n = check(x - (l - ker.width / 2), x1, x2);
-                    m = check(y - (k - ker.height / 2), y1, y2);
-                    p = original.pixel(n, m);
-                    rsum += ker.kernel[k][l] * qRed(p);
-                    gsum += ker.kernel[k][l] * qGreen(p);
-                    bsum += ker.kernel[k][l] * qBlue(p);
-                }
-            }
-            setPixel(x, y, qRgb(checkColor(rsum), checkColor(gsum), checkColor(bsum)));
-        }
-    }
+    QVector<double> weights(ker.width * ker.height);
+    for (int k = 0; k < ker.height; k++)
+        for (int l = 0; l < ker.width; l++)
+            weights[k * ker.width + l] = ker.kernel[k][l];
+
+    ScratchImage original(*this);
+    countPass(selectedArea());
+
+    ConvolutionRows rows;
+    rows.image = this;
+    rows.original = &original;
+    // bits() detaches, so take the pointer once before going parallel
+    rows.bits = bits();
+    rows.bytesPerLine = bytesPerLine();
+    rows.weights = weights.constData();
+    rows.width = ker.width;
+    rows.height = ker.height;
+    rows.x1 = x1;
+    rows.y1 = y1;
+    rows.x2 = x2;
+    rows.y2 = y2;
+    parallelFor(y1, y2, rows, 16);
 }
 
-void ImageLogic::unsharpMask(double alpha)
+Kernel ImageLogic::sharpenKernel(double alpha)
 {
     Kernel ker = gaussKernel(0.5);
     Kernel id = Kernel::id(3);
@@ -311,6 +701,13 @@ void ImageLogic::unsharpMask(double alpha)
     ker = alpha * ker;
     ker = ker + id;
     ker.normalize();
+    return ker;
+}
+
+void ImageLogic::unsharpMask(double alpha)
+{
+    ScopedTimer timer("unsharpMask");
+    Kernel ker = sharpenKernel(alpha);
 
     convolution(ker);
 }
@@ -338,6 +735,12 @@ Kernel ImageLogic::gaussKernel(double sigma)
 
 void ImageLogic::gaussianBlur(double sigma)
 {
+    ScopedTimer timer("gaussianBlur");
+    if (sigma >= PYRAMID_BLUR_SIGMA) {
+        pyramidBlur(sigma);
+        return;
+    }
+
     Kernel ker = gaussKernel(sigma);
     ker.normalize();
     if (ker.height == 0 || ker.width== 0)
@@ -347,6 +750,12 @@ void ImageLogic::gaussianBlur(double sigma)
 
 void ImageLogic::fastGaussianBlur(double sigma)
 {
+    ScopedTimer timer("fastGaussianBlur");
+    if (sigma >= PYRAMID_BLUR_SIGMA) {
+        pyramidBlur(sigma);
+        return;
+    }
+
     int size = 6.0 * sigma;
     if (size % 2 == 0) 
         size--;
@@ -369,122 +778,472 @@ void ImageLogic::fastGaussianBlur(double sigma)
     convolution(row);
 }
 
+const Pyramid& ImageLogic::pyramid() const
+{
+    if (!pyramidCache.isBuiltFor(*this))
+        pyramidCache.build(*this, -1, false);
+    return pyramidCache;
+}
+
+// Blurred copy of the selection bounding box, clamped at its border like
+// the other filters. Large sigmas run on a pyramid, the cached one when
+// the whole image is selected.
+QImage ImageLogic::blurredSelection(double sigma) const
+{
+    if (!selection && sigma >= PYRAMID_BLUR_SIGMA && pyramid().levelCount() > 2)
+        return Pyramid::blur(pyramid(), sigma);
+
+    QImage box = selection ? copy(selectionRect()) : QImage(*this);
+    if (sigma >= PYRAMID_BLUR_SIGMA)
+        return Pyramid::blur(box, sigma);
+
+    ImageLogic work(box);
+    work.fastGaussianBlur(sigma);
+    return work;
+}
+
+void ImageLogic::pyramidBlur(double sigma)
+{
+    QImage blurred = blurredSelection(sigma);
+    const Span *s;
+
+    for (int y = y1; y < y2; y++) {
+        const QRgb *src = (const QRgb*)blurred.constScanLine(y - y1) - x1;
+        QRgb *dst = (QRgb*)scanLine(y);
+        for (s = spanBegin(y); s != spanEnd(y); s++)
+            memcpy(dst + s->begin, src + s->begin, (s->end - s->begin) * sizeof(QRgb));
+    }
+}
+
+// out = in + alpha * (in - blur(in)) with a blur of any size.
+void ImageLogic::unsharpMask(double alpha, double sigma)
+{
+    ScopedTimer timer("unsharpMask");
+    QImage blurred = blurredSelection(sigma);
+    const Span *s;
+    QRgb p, b;
+
+    countPass(selectedArea());
+
+    for (int y = y1; y < y2; y++) {
+        const QRgb *src = (const QRgb*)blurred.constScanLine(y - y1) - x1;
+        QRgb *dst = (QRgb*)scanLine(y);
+        for (s = spanBegin(y); s != spanEnd(y); s++) {
+            for (int x = s->begin; x < s->end; x++) {
+                p = dst[x];
+                b = src[x];
+                dst[x] = qRgba(checkColor(round(qRed(p) + alpha * (qRed(p) - qRed(b)))),
+                               checkColor(round(qGreen(p) + alpha * (qGreen(p) - qGreen(b)))),
+                               checkColor(round(qBlue(p) + alpha * (qBlue(p) - qBlue(b)))),
+                               qAlpha(p));
+            }
+        }
+    }
+}
+
 void ImageLogic::glassEffect(int radius)
 {
+    ScopedTimer timer("glassEffect");
+    const Span *s;
     int x, y, k, l;
-    QImage original = *static_cast<QImage*>(this);
+    ScratchImage original(*this);
     QRgb p;
 
-    for (k = x1; k < x2; k++) {
-        for (l = y1; l < y2; l++) {
-            x = check(k + (double(rand()) / double(RAND_MAX) - 0.5) * radius, x1, x2);
-            y = check(l + (double(rand()) / double(RAND_MAX) - 0.5) * radius, y1, y2);
-            p = original.pixel(k, l);
-            setPixel(x, y, p);
+    countPass(selectedArea());
+
+    for (l = y1; l < y2; l++) {
+        for (s = spanBegin(l); s != spanEnd(l); s++) {
+            for (k = s->begin; k < s->end; k++) {
+                x = check(k + (double(rand()) / double(RAND_MAX) - 0.5) * radius, x1, x2);
+                y = check(l + (double(rand()) / double(RAND_MAX) - 0.5) * radius, y1, y2);
+                if (masked && !contains(x, y))
+                    continue;
+                p = original.pixel(k, l);
+                setPixel(x, y, p);
+            }
         }
     }
 }
 
 void ImageLogic::wavesEffect(double waveLength, double amplitude)
 {
+    ScopedTimer timer("wavesEffect");
+    const Span *s;
     int x, y, k, l;
-    QImage original = *static_cast<QImage*>(this);
+    ScratchImage original(*this);
     QRgb p;
 
-    for (k = x1; k < x2; k++) {
-        for (l = y1; l < y2; l++) {
-            x = check(k + amplitude * sin(2 * M_PI * double(l) / waveLength), x1, x2);
-            y = l;
-            p = original.pixel(k, l);
-            setPixel(x, y, p);
+    countPass(selectedArea());
+
+    for (l = y1; l < y2; l++) {
+        for (s = spanBegin(l); s != spanEnd(l); s++) {
+            for (k = s->begin; k < s->end; k++) {
+                x = check(k + amplitude * sin(2 * M_PI * double(l) / waveLength), s->begin, s->end);
+                y = l;
+                p = original.pixel(k, l);
+                setPixel(x, y, p);
+            }
         }
     }
 }
 
 void ImageLogic::medianFilter(int radius)
 {
+    ScopedTimer timer("medianFilter");
     int diam = radius * 2 + 1;
     int size = diam * diam;
     int s2 = size / 2;
     int d2 = diam / 2;
     int rm, gm, bm;
-    int *red, *green, *blue;
     int n, m, x, y, k, l, i;
+    const Span *s;
     QRgb p;
 
-    QImage original = *static_cast<QImage*>(this);
-    red = new int[size];
-    green = new int[size];
-    blue = new int[size];
-
-    for (x = x1; x < x2; x++) {
-        for (y = y1; y < y2; y++) {
-            i = 0;
-            for (k = 0; k < diam; k++) {
-                for (l = 0; l < diam; l++) {
-                    n = check(x - (l - d2), x1, x2);
-                    m = check(y - (k - d2), y1, y2);
-                    p = original.pixel(n, m);
-                    red[i] = qRed(p);
-                    green[i] = qGreen(p);
-                    blue[i] = qBlue(p);
-                    i++;
+    ScratchImage original(*this);
+    countPass(selectedArea());
+    ScratchBuffer<int> red(size), green(size), blue(size);
+
+    for (y = y1; y < y2; y++) {
+        for (s = spanBegin(y); s != spanEnd(y); s++) {
+            for (x = s->begin; x < s->end; x++) {
+                i = 0;
+                for (k = 0; k < diam; k++) {
+                    for (l = 0; l < diam; l++) {
+                        n = check(x - (l - d2), x1, x2);
+                        m = check(y - (k - d2), y1, y2);
+                        p = original.pixel(n, m);
+                        red[i] = qRed(p);
+                        green[i] = qGreen(p);
+                        blue[i] = qBlue(p);
+                        i++;
+                    }
                 }
+//                rm = search(red, s2, 0, i - 1);
+//                gm = search(green, s2, 0, i - 1);
+//                bm = search(blue, s2, 0, i - 1);
+                sort(red.data(), red.data() + size);
+                sort(green.data(), green.data() + size);
+                sort(blue.data(), blue.data() + size);
+                rm = red[s2];
+                gm = green[s2];
+                bm = blue[s2];
+                setPixel(x, y, qRgb(rm, gm, bm));
             }
-//            rm = search(red, s2, 0, i - 1);
-//            gm = search(green, s2, 0, i - 1);
-//            bm = search(blue, s2, 0, i - 1);
-            sort(red, red + size);
-            sort(green, green + size);
-            sort(blue, blue + size);
-            rm = red[s2];
-            gm = green[s2];
-            bm = blue[s2];
-            setPixel(x, y, qRgb(rm, gm, bm));
         }
     }
-
-    delete [] red;
-    delete [] green;
-    delete [] blue;
 }
 
 void ImageLogic::greyWorld()
 {
-    double redAvg, greenAvg, blueAvg, avg;
-    double n = width() * height();
-    int x, y;
-    int r, g, b;
-    QRgb p;
+    pointOperation(GreyWorld);
+}
 
-    avg = redAvg = greenAvg = blueAvg = 0.0;
-    for (x = x1; x < x2; x++) {
-        for (y = y1; y < y2; y++) {
-            p = pixel(x, y);
-            redAvg += qRed(p);
-            greenAvg += qGreen(p);
-            blueAvg += qBlue(p);
+struct MaxOp {
+    static inline QRgb apply(QRgb a, QRgb b)
+    {
+        return qRgba(qMax(qRed(a), qRed(b)), qMax(qGreen(a), qGreen(b)), qMax(qBlue(a), qBlue(b)), qMax(qAlpha(a), qAlpha(b)));
+    }
+#ifdef __SSE2__
+    static inline __m128i apply(__m128i a, __m128i b)
+    {
+        return _mm_max_epu8(a, b);
+    }
+#endif
+};
+
+struct MinOp {
+    static inline QRgb apply(QRgb a, QRgb b)
+    {
+        return qRgba(qMin(qRed(a), qRed(b)), qMin(qGreen(a), qGreen(b)), qMin(qBlue(a), qBlue(b)), qMin(qAlpha(a), qAlpha(b)));
+    }
+#ifdef __SSE2__
+    static inline __m128i apply(__m128i a, __m128i b)
+    {
+        return _mm_min_epu8(a, b);
+    }
+#endif
+};
+
+// van Herk/Gil-Werman running max (min) over windows of 2 * radius + 1:
+// the padded line is cut into blocks of the window size, g holds prefix and
+// h suffix extrema inside each block, so every output is op(h[x], g[x + 2r]).
+// Only dst[begin..end) is computed, the line border is replicated.
+template <class Op>
+static void vanHerkLine(const QRgb *src, QRgb *dst, int len, int begin, int end, int radius, QRgb *g, QRgb *h)
+{
+    int k = 2 * radius + 1;
+    int padded = end - begin + 2 * radius;
+    int i;
+
+    for (i = 0; i < padded; i++) {
+        QRgb f = src[check(begin + i - radius, 0, len)];
+        g[i] = (i % k == 0) ? f : Op::apply(g[i - 1], f);
+    }
+
+    for (i = padded - 1; i >= 0; i--) {
+        QRgb f = src[check(begin + i - radius, 0, len)];
+        h[i] = (i % k == k - 1 || i == padded - 1) ? f : Op::apply(h[i + 1], f);
+    }
+
+    for (i = begin; i < end; i++) {
+        dst[i] = Op::apply(h[i - begin], g[i - begin + 2 * radius]);
+    }
+}
+
+template <class Op>
+static inline void applyRow(const QRgb *a, const QRgb *b, QRgb *dst, int len)
+{
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 4 <= len; x += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + x));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+        _mm_storeu_si128((__m128i*)(dst + x), Op::apply(va, vb));
+    }
+#endif
+    for (; x < len; x++)
+        dst[x] = Op::apply(a[x], b[x]);
+}
+
+// Both passes work in selection coordinates: row 0 and column 0 are the
+// top left corner of the selection bounding box. extentBegin/extentEnd give
+// for every row the columns which have to be computed.
+struct MorphologyPlanes {
+    const uchar *src;
+    uchar *dst;
+    int srcBytesPerLine;
+    int dstBytesPerLine;
+    int width;
+    int height;
+    const int *extentBegin;
+    const int *extentEnd;
+    const ImageLogic *mask;
+    int x1, y1;
+};
+
+template <class Op>
+struct HorizontalPass {
+    MorphologyPlanes planes;
+    int radius;
+
+    void operator()(int begin, int end) const
+    {
+        int len = planes.width;
+        ScratchBuffer<QRgb> line(len), g(len + 2 * radius), h(len + 2 * radius);
+        const QRgb *src;
+        QRgb *dst;
+
+        for (int y = begin; y < end; y++) {
+            if (planes.extentBegin[y] >= planes.extentEnd[y])
+                continue;
+            src = (const QRgb*)(planes.src + y * planes.srcBytesPerLine);
+            dst = (QRgb*)(planes.dst + y * planes.dstBytesPerLine);
+            if (src == dst) {
+                memcpy(line.data(), src, len * sizeof(QRgb));
+                src = line.constData();
+            }
+            vanHerkLine<Op>(src, dst, len, planes.extentBegin[y], planes.extentEnd[y], radius, g.data(), h.data());
+        }
+    }
+};
+
+const int MORPHOLOGY_STRIPE = 64;
+
+// Columns are processed in narrow stripes, one padded row of the stripe at
+// a time, so that the vertical pass walks memory row by row. With a mask
+// only the rows crossing the stripe are computed and only spans are stored.
+template <class Op>
+struct VerticalPass {
+    MorphologyPlanes planes;
+    int radius;
+
+    void operator()(int begin, int end) const
+    {
+        int len = planes.height;
+        int k = 2 * radius + 1;
+        int padded = len + 2 * radius;
+        ScratchBuffer<QRgb> g(padded * MORPHOLOGY_STRIPE), h(padded * MORPHOLOGY_STRIPE), out(MORPHOLOGY_STRIPE);
+        const QRgb *f;
+        const Span *s;
+        QRgb *row;
+        int i, w, first, last, a, b;
+
+        for (int x = begin; x < end; x += MORPHOLOGY_STRIPE) {
+            w = qMin(MORPHOLOGY_STRIPE, end - x);
+
+            for (first = 0; first < len; first++)
+                if (planes.extentBegin[first] < x + w && planes.extentEnd[first] > x)
+                    break;
+            for (last = len; last > first; last--)
+                if (planes.extentBegin[last - 1] < x + w && planes.extentEnd[last - 1] > x)
+                    break;
+            if (first == last)
+                continue;
+            padded = last - first + 2 * radius;
+
+            for (i = 0; i < padded; i++) {
+                f = (const QRgb*)(planes.src + check(first + i - radius, 0, len) * planes.srcBytesPerLine) + x;
+                if (i % k == 0)
+                    memcpy(g.data() + i * w, f, w * sizeof(QRgb));
+                else
+                    applyRow<Op>(g.constData() + (i - 1) * w, f, g.data() + i * w, w);
+            }
+
+            for (i = padded - 1; i >= 0; i--) {
+                f = (const QRgb*)(planes.src + check(first + i - radius, 0, len) * planes.srcBytesPerLine) + x;
+                if (i % k == k - 1 || i == padded - 1)
+                    memcpy(h.data() + i * w, f, w * sizeof(QRgb));
+                else
+                    applyRow<Op>(h.constData() + (i + 1) * w, f, h.data() + i * w, w);
+            }
+
+            for (i = 0; i < last - first; i++) {
+                row = (QRgb*)(planes.dst + (first + i) * planes.dstBytesPerLine);
+                if (!planes.mask) {
+                    applyRow<Op>(h.constData() + i * w, g.constData() + (i + 2 * radius) * w, row + x, w);
+                    continue;
+                }
+                applyRow<Op>(h.constData() + i * w, g.constData() + (i + 2 * radius) * w, out.data(), w);
+                for (s = planes.mask->spanBegin(planes.y1 + first + i); s != planes.mask->spanEnd(planes.y1 + first + i); s++) {
+                    a = qMax(s->begin - planes.x1, x);
+                    b = qMin(s->end - planes.x1, x + w);
+                    if (a < b)
+                        memcpy(row + a, out.constData() + a - x, (b - a) * sizeof(QRgb));
+                }
+            }
         }
     }
+};
 
-    redAvg /= n;
-    greenAvg /= n;
-    blueAvg /= n;
-    avg = (redAvg + greenAvg + blueAvg) / 3.;
+template <class Op>
+static void morphologyPass(ImageLogic *image, int radiusX, int radiusY)
+{
+    QRect box = image->selectionRect();
+    int width = box.width();
+    int height = box.height();
+    QVector<int> spanBegin(height), spanEnd(height), extentBegin(height), extentEnd(height);
+    const Span *s;
+    int y, i;
+
+    for (y = 0; y < height; y++) {
+        spanBegin[y] = width;
+        spanEnd[y] = 0;
+        for (s = image->spanBegin(box.y() + y); s != image->spanEnd(box.y() + y); s++) {
+            spanBegin[y] = qMin(spanBegin[y], s->begin - box.x());
+            spanEnd[y] = qMax(spanEnd[y], s->end - box.x());
+        }
+    }
 
-    for (x = x1; x < x2; x++) {
-        for (y = y1; y < y2; y++) {
-            p = pixel(x, y);
-            r = checkColor(qRed(p) * avg / redAvg);
-            g = checkColor(qGreen(p) * avg / greenAvg);
-            b = checkColor(qBlue(p) * avg / blueAvg);
-            setPixel(x, y, qRgb(r, g, b));
+    // the vertical pass reads horizontal results radiusY rows around spans
+    for (y = 0; y < height; y++) {
+        extentBegin[y] = spanBegin[y];
+        extentEnd[y] = spanEnd[y];
+        if (!image->isMasked() || radiusY == 0)
+            continue;
+        for (i = qMax(0, y - radiusY); i < qMin(height, y + radiusY + 1); i++) {
+            extentBegin[y] = qMin(extentBegin[y], spanBegin[i]);
+            extentEnd[y] = qMax(extentEnd[y], spanEnd[i]);
         }
     }
+
+    // bits() detaches, so take the pointer once before going parallel
+    uchar *bits = image->bits() + box.y() * image->bytesPerLine() + box.x() * sizeof(QRgb);
+    MorphologyPlanes planes;
+    planes.src = bits;
+    planes.dst = bits;
+    planes.srcBytesPerLine = planes.dstBytesPerLine = image->bytesPerLine();
+    planes.width = width;
+    planes.height = height;
+    planes.mask = 0;
+    planes.x1 = box.x();
+    planes.y1 = box.y();
+
+    // with a mask the horizontal results go to a scratch plane, so that
+    // pixels between the spans are never written
+    ScratchBuffer<QRgb> temp(image->isMasked() && radiusX > 0 ? width * height : 0);
+    if (image->isMasked() && radiusX > 0) {
+        planes.dst = (uchar*)temp.data();
+        planes.dstBytesPerLine = width * sizeof(QRgb);
+    }
+
+    if (radiusX > 0) {
+        ScopedTimer timer("horizontal pass");
+        countPass(image->selectedArea());
+        HorizontalPass<Op> pass;
+        planes.extentBegin = extentBegin.constData();
+        planes.extentEnd = extentEnd.constData();
+        pass.planes = planes;
+        pass.radius = radiusX;
+        parallelFor(0, height, pass, 16);
+
+        planes.src = planes.dst;
+        planes.srcBytesPerLine = planes.dstBytesPerLine;
+        planes.dst = bits;
+        planes.dstBytesPerLine = image->bytesPerLine();
+    }
+
+    if (radiusY > 0) {
+        ScopedTimer timer("vertical pass");
+        countPass(image->selectedArea());
+        VerticalPass<Op> pass;
+        planes.extentBegin = spanBegin.constData();
+        planes.extentEnd = spanEnd.constData();
+        if (image->isMasked())
+            planes.mask = image;
+        pass.planes = planes;
+        pass.radius = radiusY;
+        parallelFor(0, width, pass, MORPHOLOGY_STRIPE);
+    } else if (image->isMasked()) {
+        for (y = 0; y < height; y++) {
+            for (s = image->spanBegin(box.y() + y); s != image->spanEnd(box.y() + y); s++) {
+                memcpy(bits + y * image->bytesPerLine() + (s->begin - box.x()) * sizeof(QRgb),
+                       planes.src + y * planes.srcBytesPerLine + (s->begin - box.x()) * sizeof(QRgb),
+                       (s->end - s->begin) * sizeof(QRgb));
+            }
+        }
+    }
+}
+
+void ImageLogic::morphology(int radiusX, int radiusY, bool dilate)
+{
+    if (radiusX < 0 || radiusY < 0 || x2 <= x1 || y2 <= y1)
+        return;
+
+    if (dilate)
+        morphologyPass<MaxOp>(this, radiusX, radiusY);
+    else
+        morphologyPass<MinOp>(this, radiusX, radiusY);
+}
+
+void ImageLogic::erosion(int radiusX, int radiusY)
+{
+    ScopedTimer timer("erosion");
+    morphology(radiusX, radiusY, false);
+}
+
+void ImageLogic::dilation(int radiusX, int radiusY)
+{
+    ScopedTimer timer("dilation");
+    morphology(radiusX, radiusY, true);
+}
+
+void ImageLogic::opening(int radiusX, int radiusY)
+{
+    ScopedTimer timer("opening");
+    morphology(radiusX, radiusY, false);
+    morphology(radiusX, radiusY, true);
+}
+
+void ImageLogic::closing(int radiusX, int radiusY)
+{
+    ScopedTimer timer("closing");
+    morphology(radiusX, radiusY, true);
+    morphology(radiusX, radiusY, false);
 }
 
 void ImageLogic::userFilter(Kernel& ker)
 {
+    ScopedTimer timer("userFilter");
     convolution(ker);
 }
 
@@ -498,7 +1257,8 @@ void ImageLogic::scaling(double scale)
     double xOld, yOld;
     int xCeil, yCeil, xFloor, yFloor;
     int bx, by, ex, ey;
-    QImage original = *static_cast<QImage*>(this);
+    ScopedTimer timer("scaling");
+    ScratchImage original(*this);
     QRgb p;
 
     fillSelection();
@@ -515,6 +1275,8 @@ void ImageLogic::scaling(double scale)
         ey = (newHeight + Height) / 2;
     }
 
+    countPass(qint64(ex - bx) * (ey - by));
+
     for (x = bx; x < ex; x++) {
         for (y = by; y < ey; y++) {
             if (selection) {
@@ -534,6 +1296,8 @@ void ImageLogic::scaling(double scale)
 
             if (check2scale(xFloor, width()) || check2scale(xCeil, width()) || check2scale(yFloor, height()) || check2scale(yCeil, height()))
                 continue;
+            if (masked && !contains((int)floor(xOld + 0.5), (int)floor(yOld + 0.5)))
+                continue;
 
             p = bilinearInterpolation(original, xOld, yOld, xFloor, xCeil, yFloor, yCeil);
 
@@ -577,14 +1341,38 @@ QRgb ImageLogic::bilinearInterpolation(const QImage& original, double xOld, doub
 
 void ImageLogic::fillSelection()
 {
-    for (int x = x1; x < x2; x++) {
-        for (int y = y1; y < y2; y++) {
-            setPixel(x, y, qRgb(255, 255, 255));
+    const Span *s;
+    QRgb *line;
+
+    for (int y = y1; y < y2; y++) {
+        line = (QRgb*)scanLine(y);
+        for (s = spanBegin(y); s != spanEnd(y); s++) {
+            for (int x = s->begin; x < s->end; x++) {
+                line[x] = qRgb(255, 255, 255);
+            }
         }
     }
 }
 
-void ImageLogic::rotate(double alpha)
+void ImageLogic::rotate(double alpha, RotationMode mode)
+{
+    ScopedTimer timer("rotate");
+    int quarter = (int)floor(alpha / (M_PI / 2) + 0.5);
+
+    if (fabs(alpha - quarter * M_PI / 2) < eps) {
+        quarter = ((quarter % 4) + 4) % 4;
+        if (quarter)
+            orthogonalTransform(Transform(quarter));
+        return;
+    }
+
+    if (mode == ThreeShear)
+        shearRotate(alpha);
+    else
+        bilinearRotate(alpha);
+}
+
+void ImageLogic::bilinearRotate(double alpha)
 {
     int Width = x2 - x1;
     int Height = y2 - y1;
@@ -592,10 +1380,11 @@ void ImageLogic::rotate(double alpha)
     double x0, y0;
     double xOld, yOld;
     int xCeil, yCeil, xFloor, yFloor;
-    QImage original = *static_cast<QImage*>(this);
+    ScratchImage original(*this);
     QRgb p;
 
     fillSelection();
+    countPass(qint64(width()) * height());
 
     x0 = x1 + Width / 2.;
     y0 = y1 + Height / 2.;
@@ -613,6 +1402,8 @@ void ImageLogic::rotate(double alpha)
 
             if (check2rot(xFloor, x1, x2) || check2rot(xCeil, x1, x2) || check2rot(yFloor, y1, y2) || check2rot(yCeil, y1, y2))
                 continue;
+            if (masked && !contains((int)floor(xOld + 0.5), (int)floor(yOld + 0.5)))
+                continue;
 
             p = bilinearInterpolation(original, xOld, yOld, xFloor, xCeil, yFloor, yCeil);
 
@@ -621,18 +1412,382 @@ void ImageLogic::rotate(double alpha)
     }
 }
 
+void ImageLogic::flipHorizontal()
+{
+    ScopedTimer timer("flipHorizontal");
+    orthogonalTransform(FlipHorizontal);
+}
+
+void ImageLogic::flipVertical()
+{
+    ScopedTimer timer("flipVertical");
+    orthogonalTransform(FlipVertical);
+}
+
+static inline QRgb* pixelAt(uchar *bits, int bytesPerLine, int x, int y)
+{
+    return (QRgb*)(bits + y * bytesPerLine) + x;
+}
+
+static inline const QRgb* pixelAt(const uchar *bits, int bytesPerLine, int x, int y)
+{
+    return (const QRgb*)(bits + y * bytesPerLine) + x;
+}
+
+// Position in a w x h source block of the pixel that a transform moves to
+// (x, y) of the destination block.
+static inline void transformSource(ImageLogic::Transform transform, int w, int h, int x, int y, int *sx, int *sy)
+{
+    switch (transform) {
+    case ImageLogic::Rotate90:
+        *sx = y;
+        *sy = h - 1 - x;
+        break;
+    case ImageLogic::Rotate180:
+        *sx = w - 1 - x;
+        *sy = h - 1 - y;
+        break;
+    case ImageLogic::Rotate270:
+        *sx = w - 1 - y;
+        *sy = x;
+        break;
+    case ImageLogic::FlipHorizontal:
+        *sx = w - 1 - x;
+        *sy = y;
+        break;
+    case ImageLogic::FlipVertical:
+        *sx = x;
+        *sy = h - 1 - y;
+        break;
+    }
+}
+
+static inline void reverseRow(const QRgb *src, QRgb *dst, int len)
+{
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 4 <= len; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + len - 4 - x));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+    for (; x < len; x++)
+        dst[x] = src[len - 1 - x];
+}
+
+const int TRANSPOSE_TILE = 8;
+const int TRANSPOSE_BLOCK = 256;
+
+// Quarter turns walk the source in 8x8 tiles so that both the rows read and
+// the rows written stay in cache; full tiles are moved as four SSE2 4x4
+// transposes, partial tiles at the borders pixel by pixel. Blocks of
+// TRANSPOSE_BLOCK source pixels square run in parallel.
+struct TransposeBlocks {
+    const uchar *src;
+    int srcBytesPerLine;
+    int w, h;
+    uchar *dst;
+    int dstBytesPerLine;
+    bool clockwise;
+
+    void operator()(const QRect& block) const
+    {
+        int tx, ty, sx, sy, x, y, dx, dy;
+
+        for (ty = block.top(); ty <= block.bottom(); ty += TRANSPOSE_TILE) {
+            for (tx = block.left(); tx <= block.right(); tx += TRANSPOSE_TILE) {
+#ifdef __SSE2__
+                if (tx + TRANSPOSE_TILE <= w && ty + TRANSPOSE_TILE <= h) {
+                    for (sy = ty; sy < ty + TRANSPOSE_TILE; sy += 4) {
+                        for (sx = tx; sx < tx + TRANSPOSE_TILE; sx += 4) {
+                            __m128i r0 = _mm_loadu_si128((const __m128i*)pixelAt(src, srcBytesPerLine, sx, sy));
+                            __m128i r1 = _mm_loadu_si128((const __m128i*)pixelAt(src, srcBytesPerLine, sx, sy + 1));
+                            __m128i r2 = _mm_loadu_si128((const __m128i*)pixelAt(src, srcBytesPerLine, sx, sy + 2));
+                            __m128i r3 = _mm_loadu_si128((const __m128i*)pixelAt(src, srcBytesPerLine, sx, sy + 3));
+
+                            __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+                            __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+                            __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+                            __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+                            __m128i c[4];
+                            c[0] = _mm_unpacklo_epi64(t0, t1);
+                            c[1] = _mm_unpackhi_epi64(t0, t1);
+                            c[2] = _mm_unpacklo_epi64(t2, t3);
+                            c[3] = _mm_unpackhi_epi64(t2, t3);
+
+                            for (int k = 0; k < 4; k++) {
+                                if (clockwise)
+                                    _mm_storeu_si128((__m128i*)pixelAt(dst, dstBytesPerLine, h - 4 - sy, sx + k),
+                                                     _mm_shuffle_epi32(c[k], _MM_SHUFFLE(0, 1, 2, 3)));
+                                else
+                                    _mm_storeu_si128((__m128i*)pixelAt(dst, dstBytesPerLine, sy, w - 1 - sx - k), c[k]);
+                            }
+                        }
+                    }
+                    continue;
+                }
+#endif
+                for (y = ty; y < qMin(ty + TRANSPOSE_TILE, h); y++) {
+                    for (x = tx; x < qMin(tx + TRANSPOSE_TILE, w); x++) {
+                        dx = clockwise ? h - 1 - y : y;
+                        dy = clockwise ? x : w - 1 - x;
+                        *pixelAt(dst, dstBytesPerLine, dx, dy) = *pixelAt(src, srcBytesPerLine, x, y);
+                    }
+                }
+            }
+        }
+    }
+};
+
+static void transformBlock(const QImage& src, QImage& dst, ImageLogic::Transform transform)
+{
+    int w = src.width();
+    int h = src.height();
+    TransposeBlocks blocks;
+    int y;
+
+    switch (transform) {
+    case ImageLogic::Rotate90:
+    case ImageLogic::Rotate270:
+        dst = QImage(h, w, src.format());
+        blocks.src = src.constBits();
+        blocks.srcBytesPerLine = src.bytesPerLine();
+        blocks.w = w;
+        blocks.h = h;
+        blocks.dst = dst.bits();
+        blocks.dstBytesPerLine = dst.bytesPerLine();
+        blocks.clockwise = transform == ImageLogic::Rotate90;
+        parallelForTiles(QRect(0, 0, w, h), TRANSPOSE_BLOCK, TRANSPOSE_BLOCK, blocks);
+        break;
+    case ImageLogic::Rotate180:
+        dst = QImage(w, h, src.format());
+        for (y = 0; y < h; y++)
+            reverseRow((const QRgb*)src.constScanLine(y), (QRgb*)dst.scanLine(h - 1 - y), w);
+        break;
+    case ImageLogic::FlipHorizontal:
+        dst = QImage(w, h, src.format());
+        for (y = 0; y < h; y++)
+            reverseRow((const QRgb*)src.constScanLine(y), (QRgb*)dst.scanLine(y), w);
+        break;
+    case ImageLogic::FlipVertical:
+        dst = QImage(w, h, src.format());
+        for (y = 0; y < h; y++)
+            memcpy(dst.scanLine(h - 1 - y), src.constScanLine(y), w * sizeof(QRgb));
+        break;
+    }
+}
+
+void ImageLogic::orthogonalTransform(Transform transform)
+{
+    QImage block, result;
+    QRgb *line;
+    const QRgb *from;
+    int bx, by, x, y, sx, sy;
+
+    countPass(qint64(x2 - x1) * (y2 - y1));
+
+    if (!selection) {
+        transformBlock(*this, result, transform);
+        *static_cast<QImage*>(this) = result;
+        resetSelection();
+        return;
+    }
+
+    block = copy(selectionRect());
+    transformBlock(block, result, transform);
+
+    if (transform != FlipHorizontal && transform != FlipVertical)
+        fillSelection();
+
+    // keep the selection centre in place
+    bx = x1 + (block.width() - result.width()) / 2;
+    by = y1 + (block.height() - result.height()) / 2;
+
+    for (y = qMax(0, by); y < qMin(height(), by + result.height()); y++) {
+        line = (QRgb*)scanLine(y);
+        from = (const QRgb*)result.constScanLine(y - by);
+        for (x = qMax(0, bx); x < qMin(width(), bx + result.width()); x++) {
+            if (masked) {
+                transformSource(transform, block.width(), block.height(), x - bx, y - by, &sx, &sy);
+                if (!contains(x1 + sx, y1 + sy))
+                    continue;
+                if ((transform == FlipHorizontal || transform == FlipVertical) && !contains(x, y))
+                    continue;
+            }
+            line[x] = from[x - bx];
+        }
+    }
+}
+
+// Premultiplied ARGB plane used by the three-shear rotation; (ox, oy) is the
+// position of pixel (0, 0) relative to the rotation centre.
+struct ShearPlane {
+    QVector<QRgb> pixels;
+    int width, height;
+    int ox, oy;
+
+    QRgb at(int x, int y) const
+    {
+        if (x < 0 || y < 0 || x >= width || y >= height)
+            return 0;
+        return pixels[y * width + x];
+    }
+};
+
+static inline QRgb lerpPremultiplied(QRgb a, QRgb b, int f)
+{
+    // f is the weight of b in 1/256 units; red/blue and alpha/green are
+    // interpolated two channels at a time
+    quint32 rb = ((a & 0xff00ff) * (256 - f) + (b & 0xff00ff) * f) >> 8;
+    quint32 ag = (((a >> 8) & 0xff00ff) * (256 - f) + ((b >> 8) & 0xff00ff) * f) >> 8;
+    return (rb & 0xff00ff) | ((ag & 0xff00ff) << 8);
+}
+
+// dst(x, y) = src(x - a * y, y): every row is shifted as a whole, so the
+// pass streams through memory
+static void shearX(const ShearPlane& src, ShearPlane& dst, double a)
+{
+    double top = a * src.oy;
+    double bottom = a * (src.oy + src.height - 1);
+    int shiftMin = (int)floor(qMin(top, bottom));
+    int shiftMax = (int)ceil(qMax(top, bottom));
+    double shift, pos;
+    int x, y, i, f;
+    const QRgb *row;
+    QRgb *out;
+
+    dst.ox = src.ox + shiftMin;
+    dst.oy = src.oy;
+    dst.width = src.width + shiftMax - shiftMin + 1;
+    dst.height = src.height;
+    dst.pixels.fill(0, dst.width * dst.height);
+
+    for (y = 0; y < dst.height; y++) {
+        shift = a * (src.oy + y);
+        row = src.pixels.constData() + y * src.width;
+        out = dst.pixels.data() + y * dst.width;
+        for (x = 0; x < dst.width; x++) {
+            pos = dst.ox + x - shift - src.ox;
+            i = (int)floor(pos);
+            if (i < -1 || i >= src.width)
+                continue;
+            f = (int)((pos - i) * 256);
+            out[x] = lerpPremultiplied(i >= 0 ? row[i] : 0, i + 1 < src.width ? row[i + 1] : 0, f);
+        }
+    }
+}
+
+// dst(x, y) = src(x, y - b * x)
+static void shearY(const ShearPlane& src, ShearPlane& dst, double b)
+{
+    double left = b * src.ox;
+    double right = b * (src.ox + src.width - 1);
+    int shiftMin = (int)floor(qMin(left, right));
+    int shiftMax = (int)ceil(qMax(left, right));
+    double pos;
+    int x, y, j, f;
+    QRgb *out;
+
+    dst.ox = src.ox;
+    dst.oy = src.oy + shiftMin;
+    dst.width = src.width;
+    dst.height = src.height + shiftMax - shiftMin + 1;
+    dst.pixels.fill(0, dst.width * dst.height);
+
+    for (y = 0; y < dst.height; y++) {
+        out = dst.pixels.data() + y * dst.width;
+        for (x = 0; x < dst.width; x++) {
+            pos = dst.oy + y - b * (src.ox + x) - src.oy;
+            j = (int)floor(pos);
+            if (j < -1 || j >= src.height)
+                continue;
+            f = (int)((pos - j) * 256);
+            out[x] = lerpPremultiplied(src.at(x, j), src.at(x, j + 1), f);
+        }
+    }
+}
+
+// Paeth rotation: shear in x by -tan(alpha / 2), in y by sin(alpha) and in
+// x again. Each pass is a one-dimensional resampling along rows or columns.
+void ImageLogic::shearRotate(double alpha)
+{
+    ShearPlane plane, tmp;
+    QRgb *line;
+    QRgb p;
+    int x, y, px, py, a, w, h;
+
+    alpha = remainder(alpha, 2 * M_PI);
+
+    w = x2 - x1;
+    h = y2 - y1;
+    plane.width = w;
+    plane.height = h;
+    plane.ox = -w / 2;
+    plane.oy = -h / 2;
+    plane.pixels.fill(0, w * h);
+    for (y = y1; y < y2; y++) {
+        line = (QRgb*)scanLine(y);
+        for (const Span *s = spanBegin(y); s != spanEnd(y); s++) {
+            for (x = s->begin; x < s->end; x++) {
+                plane.pixels[(y - y1) * w + x - x1] = line[x] | 0xff000000;
+            }
+        }
+    }
+
+    // shears degrade past a quarter turn, so larger angles start with an
+    // exact half turn of the plane around the origin
+    if (fabs(alpha) > M_PI / 2) {
+        std::reverse(plane.pixels.begin(), plane.pixels.end());
+        plane.ox = -(plane.ox + w - 1);
+        plane.oy = -(plane.oy + h - 1);
+        alpha = remainder(alpha + M_PI, 2 * M_PI);
+    }
+
+    shearX(plane, tmp, -tan(alpha / 2));
+    countPass(qint64(tmp.width) * tmp.height);
+    shearY(tmp, plane, sin(alpha));
+    countPass(qint64(plane.width) * plane.height);
+    shearX(plane, tmp, -tan(alpha / 2));
+    countPass(qint64(tmp.width) * tmp.height);
+
+    fillSelection();
+
+    // composite the premultiplied result over the image
+    for (y = 0; y < tmp.height; y++) {
+        py = y1 + h / 2 + tmp.oy + y;
+        if (py < 0 || py >= height())
+            continue;
+        line = (QRgb*)scanLine(py);
+        for (x = 0; x < tmp.width; x++) {
+            px = x1 + w / 2 + tmp.ox + x;
+            p = tmp.pixels[y * tmp.width + x];
+            a = qAlpha(p);
+            if (px < 0 || px >= width() || a == 0)
+                continue;
+            line[px] = qRgb(checkColor(qRed(p) + qRed(line[px]) * (255 - a) / 255),
+                            checkColor(qGreen(p) + qGreen(line[px]) * (255 - a) / 255),
+                            checkColor(qBlue(p) + qBlue(line[px]) * (255 - a) / 255));
+        }
+    }
+}
+
 void ImageLogic::setSelection(int _x1, int _y1, int _x2, int _y2)
 {
     x1 = _x1;
     y1 = _y1;
     x2 = _x2;
     y2 = _y2;
+    masked = false;
     if (x1 > x2)
         qSwap(x1, x2);
     if (y1 > y2)
         qSwap(y1, y2);
     if (y1 == y2 || x1 == x2) {
         selection = false;
+        x2 = x1;
+        y2 = y1;
+        rectangleSpans();
         return;
     }
     if (x2 > width())
@@ -644,12 +1799,170 @@ void ImageLogic::setSelection(int _x1, int _y1, int _x2, int _y2)
     if (y1 < 0)
         y1 = 0;
     selection = true;
+    rectangleSpans();
+}
+
+void ImageLogic::setSelection(const QPolygon& polygon)
+{
+    QRect box = polygon.boundingRect().intersected(rect());
+    QVector<double> cross;
+    double yc, xa, xb;
+    int i, j, y, n;
+    Span span;
+
+    if (polygon.size() < 3 || box.isEmpty()) {
+        setSelection(0, 0, 0, 0);
+        return;
+    }
+
+    spans.clear();
+    rowStart.clear();
+    rowStart.push_back(0);
+
+    n = polygon.size();
+    for (y = box.top(); y <= box.bottom(); y++) {
+        // even-odd scanline fill sampled at pixel centres
+        yc = y + 0.5;
+        cross.clear();
+        for (i = 0, j = n - 1; i < n; j = i++) {
+            const QPoint& a = polygon[i];
+            const QPoint& b = polygon[j];
+            if ((a.y() <= yc) != (b.y() <= yc))
+                cross.push_back(a.x() + (yc - a.y()) * (b.x() - a.x()) / double(b.y() - a.y()));
+        }
+        qSort(cross.begin(), cross.end());
+
+        for (i = 0; i + 1 < cross.size(); i += 2) {
+            xa = cross[i];
+            xb = cross[i + 1];
+            span.begin = qMax((int)ceil(xa - 0.5), box.left());
+            span.end = qMin((int)ceil(xb - 0.5), box.right() + 1);
+            if (span.begin < span.end)
+                spans.push_back(span);
+        }
+        rowStart.push_back(spans.size());
+    }
+
+    x1 = box.left();
+    y1 = box.top();
+    x2 = box.right() + 1;
+    y2 = box.bottom() + 1;
+    shrinkToSpans();
+}
+
+void ImageLogic::setSelection(const QImage& mask)
+{
+    int w = qMin(width(), mask.width());
+    int h = qMin(height(), mask.height());
+    Span span;
+
+    spans.clear();
+    rowStart.clear();
+    rowStart.push_back(0);
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            if (!qAlpha(mask.pixel(x, y)))
+                continue;
+            span.begin = x;
+            while (x < w && qAlpha(mask.pixel(x, y)))
+                x++;
+            span.end = x;
+            spans.push_back(span);
+        }
+        rowStart.push_back(spans.size());
+    }
+
+    x1 = y1 = 0;
+    x2 = w;
+    y2 = h;
+    shrinkToSpans();
+}
+
+// Narrows the bounding box of a mask selection to the rows and columns
+// actually covered by spans.
+void ImageLogic::shrinkToSpans()
+{
+    int first, last, left, right, y;
+    const Span *s;
+
+    for (first = y1; first < y2; first++)
+        if (spanBegin(first) != spanEnd(first))
+            break;
+    for (last = y2; last > first; last--)
+        if (spanBegin(last - 1) != spanEnd(last - 1))
+            break;
+
+    if (first == last) {
+        setSelection(0, 0, 0, 0);
+        return;
+    }
+
+    left = x2;
+    right = x1;
+    for (y = first; y < last; y++) {
+        for (s = spanBegin(y); s != spanEnd(y); s++) {
+            left = qMin(left, s->begin);
+            right = qMax(right, s->end);
+        }
+    }
+
+    rowStart = rowStart.mid(first - y1, last - first + 1);
+    x1 = left;
+    x2 = right;
+    y1 = first;
+    y2 = last;
+    selection = true;
+    masked = true;
+}
+
+void ImageLogic::rectangleSpans()
+{
+    Span span;
+
+    span.begin = x1;
+    span.end = x2;
+
+    spans.clear();
+    rowStart.resize(y2 - y1 + 1);
+    rowStart[0] = 0;
+    for (int y = y1; y < y2; y++) {
+        if (span.begin < span.end)
+            spans.push_back(span);
+        rowStart[y - y1 + 1] = spans.size();
+    }
 }
 
 void ImageLogic::resetSelection()
 {
     selection = false;
+    masked = false;
     x1 = y1 = 0;
     x2 = width();
     y2 = height();
+    rectangleSpans();
+}
+
+bool ImageLogic::contains(int x, int y) const
+{
+    if (y < y1 || y >= y2)
+        return false;
+    for (const Span *s = spanBegin(y); s != spanEnd(y); s++) {
+        if (x >= s->begin && x < s->end)
+            return true;
+    }
+    return false;
+}
+
+int ImageLogic::selectedArea() const
+{
+    int area = 0;
+    for (int i = 0; i < spans.size(); i++)
+        area += spans[i].end - spans[i].begin;
+    return area;
+}
+
+QRect ImageLogic::selectionRect() const
+{
+    return QRect(x1, y1, x2 - x1, y2 - y1);
 }
@@ -2,11 +2,16 @@
 #define LOGIC_H
 
 #include <QImage>
+#include <QPolygon>
+#include <QVector>
+
+#include "colorlut.h"
+#include "imagekernels.h"
+#include "pyramid.h"
 
-const double RED_INTENSE = 0.2125;
-const double GREEN_INTENSE = 0.7154;
-const double BLUE_INTENSE = 0.0721;
 const int LIGHT_MAX = 256;
+const int CLAHE_DEFAULT_TILES = 8;
+const double CLAHE_DEFAULT_CLIP = 2.0;
 
 struct Kernel {
     double **kernel;
@@ -26,38 +31,107 @@ struct Kernel {
     void normalize();
 
     static Kernel id(int size);
+
+private:
+    void allocate();
+};
+
+struct Span {
+    int begin;
+    int end;
 };
 
 class ImageLogic : public QImage {
+public:
+    enum PointOperation {
+        LinearCorrection,
+        LinearHSVCorrection,
+        ChannelCorrection,
+        GreyWorld
+    };
+
+    enum RotationMode {
+        Bilinear,
+        ThreeShear
+    };
+
+    enum Transform {
+        Rotate90 = 1,
+        Rotate180 = 2,
+        Rotate270 = 3,
+        FlipHorizontal,
+        FlipVertical
+    };
+
 private:
-    Kernel gaussKernel(double sigma);
     void convolution(Kernel& ker);
     QRgb bilinearInterpolation(const QImage& original, double xOld, double yOld, int xFloor, int xCeil, int yFloor, int yCeil);
     void fillSelection();
+    void bilinearRotate(double alpha);
+    void shearRotate(double alpha);
+    void orthogonalTransform(Transform transform);
     int getLuminosity(int r, int g, int b);
+    void rectangleSpans();
+    void shrinkToSpans();
+    void mapPixels(const ColorMapping& mapping);
+    void morphology(int radiusX, int radiusY, bool dilate);
+    QImage blurredSelection(double sigma) const;
+    void pyramidBlur(double sigma);
 
     bool selection;
+    bool masked;
     int x1, y1, x2, y2;
 
+    // selection as run-length spans: row y owns
+    // spans[rowStart[y - y1]] .. spans[rowStart[y - y1 + 1] - 1]
+    QVector<Span> spans;
+    QVector<int> rowStart;
+
+    mutable Pyramid pyramidCache;
+
 public:
+    static Kernel gaussKernel(double sigma);
+    static Kernel sharpenKernel(double alpha);
+
     ImageLogic(const QImage& image);
     void linearCorrection();
     void linearHSVCorrection();
+    void clahe(int tilesX = CLAHE_DEFAULT_TILES, int tilesY = CLAHE_DEFAULT_TILES, double clipLimit = CLAHE_DEFAULT_CLIP);
     void channelCorrection();
     void gaussianBlur(double sigma);
     void fastGaussianBlur(double sigma);
     void unsharpMask(double alpha);
+    void unsharpMask(double alpha, double sigma);
     void glassEffect(int radius);
     void wavesEffect(double waveLength, double amplitude);
     void medianFilter(int radius);
+    void erosion(int radiusX, int radiusY);
+    void dilation(int radiusX, int radiusY);
+    void opening(int radiusX, int radiusY);
+    void closing(int radiusX, int radiusY);
     void greyWorld();
     void userFilter(Kernel& ker);
     void scaling(double scale);
     void scalingSelection(double scale);
-    void rotate(double alpha);
+    void rotate(double alpha, RotationMode mode = Bilinear);
+    void flipHorizontal();
+    void flipVertical();
     void setSelection(int _x1, int _y1, int _x2, int _y2);
+    void setSelection(const QPolygon& polygon);
+    void setSelection(const QImage& mask);
     void resetSelection();
+    bool isMasked() const { return masked; }
+    bool contains(int x, int y) const;
+    int selectedArea() const;
+    QRect selectionRect() const;
+    const Span* spanBegin(int y) const { return spans.constData() + rowStart[y - y1]; }
+    const Span* spanEnd(int y) const { return spans.constData() + rowStart[y - y1 + 1]; }
     void rotateSelection(double alpha);
+    ColorMapping* pointMapping(PointOperation op);
+    void pointOperation(PointOperation op, ColorLUT *lut = 0);
+    ColorLUT bakeColorLUT(const QVector<PointOperation>& ops, int size = LUT_DEFAULT_SIZE) const;
+    void applyColorLUT(const ColorLUT& lut);
+    const Pyramid& pyramid() const;
 
 };
 
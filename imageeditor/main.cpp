@@ -1,11 +1,174 @@
 #include <QApplication>
+#include <QStringList>
+#include <QTime>
+
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #include "imageeditor.h"
+#include "pipeline.h"
+#include "profiler.h"
+#include "sequence.h"
+
+static int benchmark(const QStringList& args)
+{
+    const int iterations = 3;
+    int width = args.at(2).toInt();
+    int height = args.at(3).toInt();
+    int interleavedTime = INT_MAX, planarTime = INT_MAX, diff = 0;
+    Pipeline pipeline;
+    QImage source(width, height, QImage::Format_RGB32), result, planarResult;
+    QTime timer;
+
+    if (width <= 0 || height <= 0) {
+        printf("Wrong parameters\n");
+        return 1;
+    }
+    for (int i = 4; i < args.size(); i++) {
+        if (!pipeline.addStep(args.at(i)))
+            return 1;
+    }
+
+    for (int y = 0; y < height; y++) {
+        QRgb *line = (QRgb*)source.scanLine(y);
+        for (int x = 0; x < width; x++)
+            line[x] = qRgb((x + rand() % 32) & 255, (y + rand() % 32) & 255, (x + y) & 255);
+    }
+
+    // conversions are part of the planar time, as they would be for a
+    // chain started from a loaded file
+    for (int i = 0; i < iterations; i++) {
+        timer.start();
+        ImageLogic image(source);
+        pipeline.apply(image);
+        interleavedTime = qMin(interleavedTime, timer.elapsed());
+        result = image;
+
+        timer.start();
+        PlanarImage planar(source);
+        pipeline.apply(planar);
+        planarResult = planar.toImage();
+        planarTime = qMin(planarTime, timer.elapsed());
+    }
+
+    for (int y = 0; y < height; y++) {
+        const QRgb *a = (const QRgb*)result.constScanLine(y);
+        const QRgb *b = (const QRgb*)planarResult.constScanLine(y);
+        for (int x = 0; x < width; x++) {
+            diff = qMax(diff, qAbs(qRed(a[x]) - qRed(b[x])));
+            diff = qMax(diff, qAbs(qGreen(a[x]) - qGreen(b[x])));
+            diff = qMax(diff, qAbs(qBlue(a[x]) - qBlue(b[x])));
+        }
+    }
+
+    double pixels = double(width) * height / 1e6;
+    printf("interleaved ARGB32: %6d ms  %8.1f Mpx/s\n", interleavedTime, pixels * 1000 / qMax(interleavedTime, 1));
+    printf("planar float32:     %6d ms  %8.1f Mpx/s\n", planarTime, pixels * 1000 / qMax(planarTime, 1));
+    printf("max channel difference: %d\n", diff);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
     QApplication app(argc, argv);
-    ImageEditor imageEditor;
-    imageEditor.show();
-    return app.exec();
+    QStringList args = app.arguments();
+    int res;
+
+    if (args.size() > 2 && args.at(1) == "--trace") {
+        Profiler::startTrace(args.at(2));
+        args.removeAt(1);
+        args.removeAt(1);
+    }
+
+    if (args.size() > 1 && args.at(1) == "--help") {
+        printf( "Usage: imageeditor [--trace FILE] [OPTION] ...\n"
+                "Without options the editor window is opened.\n"
+                "Available options:\n"
+                "--trace FILE                 write a Chrome trace of the session to FILE\n"
+                "--process [--planar] FILE1 FILE2 OP...\n"
+                "                             filter a file strip by strip, where:\n"
+                "                             --planar - work on planar float32 strips\n"
+                "                             FILE1 - input image (PNG and JPEG are streamed)\n"
+                "                             FILE2 - where to save the result\n"
+                "                             OP    - one of:\n"
+                "%s\n"
+                "--sequence [--planar] [--raw FORMAT WIDTH HEIGHT] INPUT OUTPUT OP...\n"
+                "                             filter every frame of a sequence, where:\n"
+                "                             INPUT  - numbered files such as in%%04d.png,\n"
+                "                                      or - for raw frames on stdin\n"
+                "                             OUTPUT - numbered files such as out%%04d.png,\n"
+                "                                      or - for raw frames on stdout\n"
+                "                             FORMAT - raw frame layout: rgb24, bgra or yuv420p\n"
+                "                                      (WIDTH and HEIGHT are used for stdin)\n"
+                "--benchmark WIDTH HEIGHT OP...\n"
+                "                             time a chain of OPs on a synthetic image in\n"
+                "                             ARGB32 and in planar float32\n"
+                "--help    print this message and exit\n", Pipeline::syntax());
+        return 0;
+    } else if (args.size() > 1 && args.at(1) == "--benchmark") {
+        if (args.size() < 5) {
+            printf("Wrong parameters\n");
+            return 1;
+        }
+        res = benchmark(args);
+    } else if (args.size() > 1 && args.at(1) == "--process") {
+        Pipeline pipeline;
+        if (args.size() > 2 && args.at(2) == "--planar") {
+            pipeline.setPlanar(true);
+            args.removeAt(2);
+        }
+        if (args.size() < 5) {
+            printf("Wrong parameters\n");
+            return 1;
+        }
+        for (int i = 4; i < args.size(); i++) {
+            if (!pipeline.addStep(args.at(i)))
+                return 1;
+        }
+        res = pipeline.run(args.at(2), args.at(3)) ? 0 : 1;
+        printf("%s\n", qPrintable(Profiler::summary()));
+    } else if (args.size() > 1 && args.at(1) == "--sequence") {
+        Pipeline pipeline;
+        RawFormat raw;
+        QTime timer;
+        if (args.size() > 2 && args.at(2) == "--planar") {
+            pipeline.setPlanar(true);
+            args.removeAt(2);
+        }
+        if (args.size() > 5 && args.at(2) == "--raw") {
+            raw.width = args.at(4).toInt();
+            raw.height = args.at(5).toInt();
+            if (!raw.parse(args.at(3))) {
+                fprintf(stderr, "Unknown raw format %s\n", qPrintable(args.at(3)));
+                return 1;
+            }
+            for (int i = 0; i < 4; i++)
+                args.removeAt(2);
+        }
+        if (args.size() < 5) {
+            fprintf(stderr, "Wrong parameters\n");
+            return 1;
+        }
+        for (int i = 4; i < args.size(); i++) {
+            if (!pipeline.addStep(args.at(i)))
+                return 1;
+        }
+        // stdout may carry the frames, so reports go to stderr
+        Sequence sequence(pipeline);
+        sequence.setRawFormat(raw);
+        timer.start();
+        res = sequence.run(args.at(2), args.at(3)) ? 0 : 1;
+        int elapsed = qMax(timer.elapsed(), 1);
+        fprintf(stderr, "%d frames in %d ms, %.1f frames/s\n", sequence.frameCount(), elapsed, sequence.frameCount() * 1000.0 / elapsed);
+        fprintf(stderr, "%s\n", qPrintable(Profiler::summary()));
+    } else {
+        ImageEditor imageEditor;
+        imageEditor.show();
+        res = app.exec();
+    }
+
+    if (!Profiler::stopTrace())
+        return 1;
+    return res;
 }
@@ -0,0 +1,467 @@
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <cstring>
+
+#include "pipeline.h"
+#include "profiler.h"
+#include "stripio.h"
+
+static int gaussHalo(double sigma)
+{
+    // same kernel size as ImageLogic::gaussKernel
+    int size = 6.0 * sigma;
+    if (size % 2 == 0)
+        size--;
+    return size > 0 ? size / 2 : 0;
+}
+
+int PipelineStep::halo() const
+{
+    switch (op) {
+    case Gaussian:
+    case FastGaussian:
+        return gaussHalo(value);
+    case Sharpen:
+        return gaussHalo(0.5);
+    case Median:
+        return radiusY;
+    case Erosion:
+    case Dilation:
+        return radiusY;
+    case Opening:
+    case Closing:
+        return 2 * radiusY;
+    case Lut:
+    case Clahe:
+        return 0;
+    }
+    return 0;
+}
+
+bool PipelineStep::isLocal() const
+{
+    switch (op) {
+    case Gaussian:
+    case FastGaussian:
+        return value < PYRAMID_BLUR_SIGMA;
+    case Sharpen:
+    case Median:
+    case Erosion:
+    case Dilation:
+    case Opening:
+    case Closing:
+    case Lut:
+        return true;
+    case Clahe:
+        return false;
+    }
+    return true;
+}
+
+void PipelineStep::apply(ImageLogic& image) const
+{
+    switch (op) {
+    case Gaussian:
+        image.gaussianBlur(value);
+        break;
+    case FastGaussian:
+        image.fastGaussianBlur(value);
+        break;
+    case Sharpen:
+        image.unsharpMask(value);
+        break;
+    case Median:
+        image.medianFilter(radiusY);
+        break;
+    case Erosion:
+        image.erosion(radiusX, radiusY);
+        break;
+    case Dilation:
+        image.dilation(radiusX, radiusY);
+        break;
+    case Opening:
+        image.opening(radiusX, radiusY);
+        break;
+    case Closing:
+        image.closing(radiusX, radiusY);
+        break;
+    case Lut:
+        image.applyColorLUT(lut);
+        break;
+    case Clahe:
+        image.clahe(radiusX, radiusY, value);
+        break;
+    }
+}
+
+void PipelineStep::apply(PlanarImage& image) const
+{
+    // steps without a float version, and blurs that ImageLogic runs on a
+    // pyramid, so that planar mode gives the same result
+    if (op == Median || op == Clahe || !isLocal()) {
+        ImageLogic interleaved(image.toImage());
+        apply(interleaved);
+        image = PlanarImage(interleaved);
+        return;
+    }
+
+    switch (op) {
+    case Gaussian:
+        image.gaussianBlur(value);
+        break;
+    case FastGaussian:
+        image.fastGaussianBlur(value);
+        break;
+    case Sharpen:
+        image.unsharpMask(value);
+        break;
+    case Erosion:
+        image.erosion(radiusX, radiusY);
+        break;
+    case Dilation:
+        image.dilation(radiusX, radiusY);
+        break;
+    case Opening:
+        image.opening(radiusX, radiusY);
+        break;
+    case Closing:
+        image.closing(radiusX, radiusY);
+        break;
+    case Lut:
+        image.applyColorLUT(lut);
+        break;
+    case Median:
+    case Clahe:
+        break;
+    }
+}
+
+const char* Pipeline::syntax()
+{
+    return "gaussian:SIGMA  fastgaussian:SIGMA  sharpen:ALPHA  median:RADIUS\n"
+           "erosion:RX[,RY]  dilation:RX[,RY]  opening:RX[,RY]  closing:RX[,RY]\n"
+           "lut:FILE.cube  clahe[:TILES[,CLIP]]";
+}
+
+bool Pipeline::addStep(const QString& spec)
+{
+    PipelineStep step;
+    QString name = spec.section(':', 0, 0).trimmed().toLower();
+    QString arg = spec.section(':', 1);
+    QStringList values = arg.split(',');
+    bool ok = true, ok2 = true;
+
+    step.value = 0;
+    step.radiusX = step.radiusY = 0;
+
+    if (name == "gaussian" || name == "fastgaussian" || name == "sharpen") {
+        step.op = name == "gaussian" ? PipelineStep::Gaussian :
+                  name == "fastgaussian" ? PipelineStep::FastGaussian : PipelineStep::Sharpen;
+        step.value = arg.toDouble(&ok);
+        ok = ok && step.value > 0;
+    } else if (name == "median") {
+        step.op = PipelineStep::Median;
+        step.radiusY = arg.toInt(&ok);
+        ok = ok && step.radiusY >= 0;
+    } else if (name == "erosion" || name == "dilation" || name == "opening" || name == "closing") {
+        step.op = name == "erosion" ? PipelineStep::Erosion :
+                  name == "dilation" ? PipelineStep::Dilation :
+                  name == "opening" ? PipelineStep::Opening : PipelineStep::Closing;
+        step.radiusX = values[0].toInt(&ok);
+        step.radiusY = values.size() > 1 ? values[1].toInt(&ok2) : step.radiusX;
+        ok = ok && ok2 && values.size() <= 2 && step.radiusX >= 0 && step.radiusY >= 0;
+    } else if (name == "clahe") {
+        step.op = PipelineStep::Clahe;
+        step.radiusX = step.radiusY = CLAHE_DEFAULT_TILES;
+        step.value = CLAHE_DEFAULT_CLIP;
+        if (!arg.isEmpty())
+            step.radiusX = step.radiusY = values[0].toInt(&ok);
+        if (values.size() > 1)
+            step.value = values[1].toDouble(&ok2);
+        ok = ok && ok2 && values.size() <= 2 && step.radiusX > 0 && step.value > 0;
+    } else if (name == "lut") {
+        step.op = PipelineStep::Lut;
+        if (!step.lut.load(arg))
+            return false;
+    } else {
+        qWarning("Unknown operation: %s", qPrintable(spec));
+        return false;
+    }
+
+    if (!ok) {
+        qWarning("Wrong parameters: %s", qPrintable(spec));
+        return false;
+    }
+
+    steps.push_back(step);
+    return true;
+}
+
+int Pipeline::halo() const
+{
+    int h = 0;
+    for (int i = 0; i < steps.size(); i++)
+        h += steps[i].halo();
+    return h;
+}
+
+bool Pipeline::isLocal() const
+{
+    for (int i = 0; i < steps.size(); i++)
+        if (!steps[i].isLocal())
+            return false;
+    return true;
+}
+
+void Pipeline::apply(ImageLogic& image) const
+{
+    for (int i = 0; i < steps.size(); i++)
+        steps[i].apply(image);
+}
+
+struct Strip {
+    int y;
+    QImage image;
+};
+
+// Bounded queue between the decoder, the processing loop and the encoder.
+// close() ends the stream; an aborted queue also drops what it holds.
+class StripQueue {
+public:
+    StripQueue(int capacity) : capacity(capacity), closed(false), aborted(false) {}
+
+    bool push(const Strip& strip)
+    {
+        QMutexLocker locker(&mutex);
+        while (!closed && strips.size() >= capacity)
+            notFull.wait(&mutex);
+        if (closed)
+            return false;
+        strips.enqueue(strip);
+        notEmpty.wakeOne();
+        return true;
+    }
+
+    bool pop(Strip& strip)
+    {
+        QMutexLocker locker(&mutex);
+        while (!closed && strips.isEmpty())
+            notEmpty.wait(&mutex);
+        if (strips.isEmpty())
+            return false;
+        strip = strips.dequeue();
+        notFull.wakeOne();
+        return true;
+    }
+
+    void close(bool abort = false)
+    {
+        QMutexLocker locker(&mutex);
+        closed = true;
+        if (abort) {
+            aborted = true;
+            strips.clear();
+        }
+        notEmpty.wakeAll();
+        notFull.wakeAll();
+    }
+
+    bool isAborted()
+    {
+        QMutexLocker locker(&mutex);
+        return aborted;
+    }
+
+private:
+    QMutex mutex;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QQueue<Strip> strips;
+    int capacity;
+    bool closed;
+    bool aborted;
+};
+
+class StripDecoder : public QThread {
+public:
+    StripDecoder(StripReader *reader, StripQueue *queue, int stripHeight)
+        : reader(reader), queue(queue), stripHeight(stripHeight), ok(true) {}
+
+    bool succeeded() const { return ok; }
+
+protected:
+    void run()
+    {
+        Strip strip;
+
+        for (strip.y = 0; strip.y < reader->height(); strip.y += strip.image.height()) {
+            ScopedTimer timer("decode strip");
+            if (!reader->read(strip.image, stripHeight)) {
+                ok = false;
+                queue->close(true);
+                return;
+            }
+            if (!queue->push(strip))
+                return;
+        }
+        queue->close();
+    }
+
+private:
+    StripReader *reader;
+    StripQueue *queue;
+    int stripHeight;
+    bool ok;
+};
+
+class StripEncoder : public QThread {
+public:
+    StripEncoder(StripWriter *writer, StripQueue *queue)
+        : writer(writer), queue(queue), ok(true) {}
+
+    bool succeeded() const { return ok; }
+
+protected:
+    void run()
+    {
+        Strip strip;
+
+        while (queue->pop(strip)) {
+            ScopedTimer timer("encode strip");
+            if (!writer->write(strip.image)) {
+                ok = false;
+                queue->close(true);
+                return;
+            }
+        }
+        if (queue->isAborted())
+            ok = false;
+        else
+            ok = writer->finish();
+    }
+
+private:
+    StripWriter *writer;
+    StripQueue *queue;
+    bool ok;
+};
+
+// Rows [top, bottom) of the image, taken from consecutive strips.
+static QImage window(const QList<Strip>& strips, int top, int bottom)
+{
+    const Strip& first = strips.first();
+    if (first.y == top && first.image.height() == bottom - top)
+        return first.image;
+
+    QImage res(first.image.width(), bottom - top, first.image.format());
+    int bytes = first.image.width() * sizeof(QRgb);
+
+    Profiler::count(Profiler::BytesCopied, res.byteCount());
+
+    for (int i = 0; i < strips.size(); i++) {
+        const Strip& s = strips[i];
+        for (int y = qMax(top, s.y); y < qMin(bottom, s.y + s.image.height()); y++)
+            memcpy(res.scanLine(y - top), s.image.constScanLine(y - s.y), bytes);
+    }
+
+    return res;
+}
+
+void Pipeline::apply(PlanarImage& image) const
+{
+    for (int i = 0; i < steps.size(); i++)
+        steps[i].apply(image);
+}
+
+bool Pipeline::run(const QString& input, const QString& output, int stripHeight) const
+{
+    StripReader *reader = StripReader::create(input);
+    if (!reader)
+        return false;
+
+    StripWriter *writer = StripWriter::create(output);
+    if (!writer->open(output, reader->width(), reader->height(), reader->hasAlpha())) {
+        delete writer;
+        delete reader;
+        QFile::remove(output);
+        return false;
+    }
+
+    int w = reader->width();
+    int h = reader->height();
+    int extra = halo();
+    if (!isLocal())
+        stripHeight = h;
+    int next, end, need, top, received = 0;
+    bool ok = true;
+    QList<Strip> pending;
+    Strip strip;
+
+    StripQueue decoded(PIPELINE_QUEUE_SIZE);
+    StripQueue processed(PIPELINE_QUEUE_SIZE);
+    StripDecoder decoder(reader, &decoded, stripHeight);
+    StripEncoder encoder(writer, &processed);
+
+    decoder.start();
+    encoder.start();
+
+    for (next = 0; next < h && ok; next = end) {
+        end = qMin(next + stripHeight, h);
+        need = qMin(end + extra, h);
+        top = qMax(0, next - extra);
+
+        while (received < need) {
+            if (!decoded.pop(strip)) {
+                ok = false;
+                break;
+            }
+            received += strip.image.height();
+            pending.append(strip);
+        }
+        if (!ok)
+            break;
+
+        while (pending.first().y + pending.first().image.height() <= top)
+            pending.removeFirst();
+
+        Profiler::enter("process strip");
+        strip.y = next;
+        if (planar) {
+            PlanarImage part(window(pending, top, need));
+            apply(part);
+            strip.image = part.toImage(next - top, end - next);
+        } else {
+            ImageLogic part(window(pending, top, need));
+            apply(part);
+            strip.image = part.copy(0, next - top, w, end - next);
+        }
+        Profiler::leave();
+
+        ok = processed.push(strip);
+    }
+
+    if (ok) {
+        processed.close();
+    } else {
+        decoded.close(true);
+        processed.close(true);
+    }
+
+    decoder.wait();
+    encoder.wait();
+    ok = ok && decoder.succeeded() && encoder.succeeded();
+
+    delete writer;
+    delete reader;
+
+    if (!ok) {
+        qWarning("Cannot process %s", qPrintable(input));
+        QFile::remove(output);
+    }
+    return ok;
+}
@@ -0,0 +1,73 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "colorlut.h"
+#include "logic.h"
+#include "planarimage.h"
+
+const int PIPELINE_STRIP_HEIGHT = 64;
+const int PIPELINE_QUEUE_SIZE = 4;
+
+// Operation whose output row depends only on input rows at most halo()
+// rows away, so that it can run on strips of a file. Non-local operations
+// (Clahe, and blurs large enough to run on a pyramid, whose subsampling
+// grid starts at the top of the image) need the whole image.
+struct PipelineStep {
+    enum Operation {
+        Gaussian,
+        FastGaussian,
+        Sharpen,
+        Median,
+        Erosion,
+        Dilation,
+        Opening,
+        Closing,
+        Lut,
+        Clahe
+    };
+
+    Operation op;
+    double value;
+    int radiusX, radiusY;
+    ColorLUT lut;
+
+    int halo() const;
+    bool isLocal() const;
+    void apply(ImageLogic& image) const;
+    void apply(PlanarImage& image) const;
+};
+
+// Decodes a file strip by strip on one thread, runs the steps on each strip
+// widened by the total halo and encodes the results on another thread, so
+// only a few strips are in memory at a time. A pipeline with a non-local
+// step processes the file as a single strip. In planar mode steps without a
+// float version convert the strip to ARGB32 and back.
+class Pipeline {
+public:
+    Pipeline() : planar(false) {}
+
+    bool addStep(const QString& spec);
+    bool isEmpty() const { return steps.isEmpty(); }
+    int halo() const;
+    bool isLocal() const;
+
+    // strips go through a planar float copy, converted once per strip
+    void setPlanar(bool enable) { planar = enable; }
+    bool isPlanar() const { return planar; }
+
+    void apply(ImageLogic& image) const;
+    void apply(PlanarImage& image) const;
+    bool run(const QString& input, const QString& output, int stripHeight = PIPELINE_STRIP_HEIGHT) const;
+
+    static const char* syntax();
+
+private:
+    QVector<PipelineStep> steps;
+    bool planar;
+};
+
+#endif // PIPELINE_H
@@ -0,0 +1,568 @@
+#include <cstring>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "parallel.h"
+#include "planarimage.h"
+#include "profiler.h"
+#include "scratch.h"
+#include "utils.h"
+
+PlanarImage::PlanarImage() : data(0), w(0), h(0), step(0), format(QImage::Format_RGB32)
+{
+}
+
+PlanarImage::PlanarImage(int width, int height) : data(0), format(QImage::Format_RGB32)
+{
+    allocate(width, height);
+}
+
+PlanarImage::PlanarImage(const PlanarImage& image) : data(0), format(image.format)
+{
+    allocate(image.w, image.h);
+    if (data)
+        memcpy(data, image.data, ChannelCount * h * step * sizeof(float));
+}
+
+PlanarImage& PlanarImage::operator=(const PlanarImage& image)
+{
+    if (this == &image)
+        return *this;
+
+    if (w != image.w || h != image.h)
+        allocate(image.w, image.h);
+    format = image.format;
+    if (data)
+        memcpy(data, image.data, ChannelCount * h * step * sizeof(float));
+    return *this;
+}
+
+PlanarImage::~PlanarImage()
+{
+    ScratchPool::release(data);
+}
+
+void PlanarImage::allocate(int width, int height)
+{
+    ScratchPool::release(data);
+    data = 0;
+    w = width;
+    h = height;
+    step = (width + 15) & ~15;
+    if (w > 0 && h > 0)
+        data = (float*)ScratchPool::acquire(qint64(ChannelCount) * h * step * sizeof(float));
+}
+
+PlanarImage::PlanarImage(const QImage& image) : data(0)
+{
+    ScopedTimer timer("to planar");
+    QImage source = image;
+    const QRgb *src;
+    float *r, *g, *b, *a;
+    int x;
+
+    if (source.format() != QImage::Format_RGB32 && source.format() != QImage::Format_ARGB32)
+        source = source.convertToFormat(QImage::Format_ARGB32);
+    format = source.format();
+    allocate(source.width(), source.height());
+
+    for (int y = 0; y < h; y++) {
+        src = (const QRgb*)source.constScanLine(y);
+        r = line(Red, y);
+        g = line(Green, y);
+        b = line(Blue, y);
+        a = line(Alpha, y);
+        x = 0;
+#ifdef __SSE2__
+        const __m128i mask = _mm_set1_epi32(0xff);
+        for (; x + 4 <= w; x += 4) {
+            __m128i p = _mm_loadu_si128((const __m128i*)(src + x));
+            _mm_store_ps(b + x, _mm_cvtepi32_ps(_mm_and_si128(p, mask)));
+            _mm_store_ps(g + x, _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), mask)));
+            _mm_store_ps(r + x, _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), mask)));
+            _mm_store_ps(a + x, _mm_cvtepi32_ps(_mm_srli_epi32(p, 24)));
+        }
+#endif
+        for (; x < w; x++) {
+            r[x] = qRed(src[x]);
+            g[x] = qGreen(src[x]);
+            b[x] = qBlue(src[x]);
+            a[x] = qAlpha(src[x]);
+        }
+    }
+}
+
+static inline int toByte(float v)
+{
+    return checkColor((int)floor(v + 0.5f));
+}
+
+#ifdef __SSE2__
+static inline __m128i roundHalfUp(const float *v)
+{
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_load_ps(v), _mm_set1_ps(0.5f)));
+}
+#endif
+
+QImage PlanarImage::toImage() const
+{
+    return toImage(0, h);
+}
+
+QImage PlanarImage::toImage(int top, int rows) const
+{
+    ScopedTimer timer("from planar");
+    QImage res(w, rows, format);
+    const float *r, *g, *b, *a;
+    QRgb *dst;
+    int x;
+
+    for (int y = 0; y < rows; y++) {
+        dst = (QRgb*)res.scanLine(y);
+        r = line(Red, top + y);
+        g = line(Green, top + y);
+        b = line(Blue, top + y);
+        a = line(Alpha, top + y);
+        x = 0;
+#ifdef __SSE2__
+        for (; x + 4 <= w; x += 4) {
+            // Rounds half up like toByte: truncation equals floor wherever
+            // v + 0.5 >= 0, and below that both saturate to 0. Bytes
+            // b0..b3 r0..r3 g0..g3 a0..a3, then interleaved to BGRA.
+            __m128i br = _mm_packs_epi32(roundHalfUp(b + x), roundHalfUp(r + x));
+            __m128i ga = _mm_packs_epi32(roundHalfUp(g + x), roundHalfUp(a + x));
+            __m128i v = _mm_packus_epi16(br, ga);
+            v = _mm_unpacklo_epi8(v, _mm_srli_si128(v, 8));
+            v = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+            _mm_storeu_si128((__m128i*)(dst + x), v);
+        }
+#endif
+        for (; x < w; x++)
+            dst[x] = qRgba(toByte(r[x]), toByte(g[x]), toByte(b[x]), toByte(a[x]));
+    }
+
+    return res;
+}
+
+// dst[i] += weight * src[i]
+static inline void addScaled(float *dst, const float *src, float weight, int n)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128 k = _mm_set1_ps(weight);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(k, _mm_loadu_ps(src + i))));
+#endif
+    for (; i < n; i++)
+        dst[i] += weight * src[i];
+}
+
+// Copies a row with pad replicated border pixels on the left and right.
+static inline void padRow(const float *src, float *dst, int len, int left, int right)
+{
+    for (int i = 0; i < left; i++)
+        dst[i] = src[0];
+    memcpy(dst + left, src, len * sizeof(float));
+    for (int i = 0; i < right; i++)
+        dst[left + len + i] = src[len - 1];
+}
+
+// Same indexing as ImageLogic::convolution, which flips the kernel rows
+// only: out(x, y) = sum ker'[k][l] * in(x - (l - width / 2), y - (k - height / 2)).
+struct PlanarConvolution {
+    const PlanarImage *src;
+    PlanarImage *dst;
+    const Kernel *ker;
+
+    void operator()(int begin, int end) const
+    {
+        int w = src->width();
+        int left = ker->width - 1 - ker->width / 2;
+        int right = ker->width / 2;
+        QVector<float> padded(w + ker->width - 1);
+        float *out;
+
+        for (int y = begin; y < end; y++) {
+            for (int c = PlanarImage::Red; c <= PlanarImage::Blue; c++) {
+                out = dst->line(c, y);
+                memset(out, 0, w * sizeof(float));
+                for (int k = 0; k < ker->height; k++) {
+                    padRow(src->line(c, check(y - (k - ker->height / 2), 0, src->height())), padded.data(), w, left, right);
+                    for (int l = 0; l < ker->width; l++)
+                        addScaled(out, padded.constData() + left - (l - ker->width / 2), ker->kernel[k][l], w);
+                }
+            }
+        }
+    }
+};
+
+void PlanarImage::convolution(const Kernel& kernel)
+{
+    ScopedTimer timer("convolution");
+    Kernel ker(kernel);
+    PlanarImage original(*this);
+    PlanarConvolution rows;
+
+    if (ker.width == 0 || ker.height == 0 || isNull())
+        return;
+
+    Profiler::count(Profiler::BytesCopied, ChannelCount * h * step * sizeof(float));
+    Profiler::count(Profiler::Passes, 1);
+    Profiler::count(Profiler::Pixels, qint64(w) * h);
+
+    ker.reverse();
+    rows.src = &original;
+    rows.dst = this;
+    rows.ker = &ker;
+    parallelFor(0, h, rows, 8);
+}
+
+struct SeparableRows {
+    const PlanarImage *src;
+    PlanarImage *dst;
+    const QVector<float> *row;
+    const QVector<float> *column;
+    bool horizontal;
+
+    void operator()(int begin, int end) const
+    {
+        int w = src->width();
+        int n = horizontal ? row->size() : column->size();
+        int r = n / 2;
+        QVector<float> padded(w + 2 * r);
+        float *out;
+
+        for (int y = begin; y < end; y++) {
+            for (int c = PlanarImage::Red; c <= PlanarImage::Blue; c++) {
+                out = dst->line(c, y);
+                memset(out, 0, w * sizeof(float));
+                if (horizontal) {
+                    padRow(src->line(c, y), padded.data(), w, r, r);
+                    for (int i = 0; i < n; i++)
+                        addScaled(out, padded.constData() + r - (i - r), (*row)[i], w);
+                } else {
+                    for (int i = 0; i < n; i++)
+                        addScaled(out, src->line(c, check(y - (i - r), 0, src->height())), (*column)[i], w);
+                }
+            }
+        }
+    }
+};
+
+void PlanarImage::separableConvolution(const QVector<float>& row, const QVector<float>& column)
+{
+    ScopedTimer timer("separable convolution");
+    PlanarImage temp(w, h);
+    SeparableRows rows;
+
+    if (isNull())
+        return;
+
+    Profiler::count(Profiler::Passes, 2);
+    Profiler::count(Profiler::Pixels, 2 * qint64(w) * h);
+
+    rows.row = &row;
+    rows.column = &column;
+
+    rows.src = this;
+    rows.dst = &temp;
+    rows.horizontal = true;
+    parallelFor(0, h, rows, 8);
+
+    rows.src = &temp;
+    rows.dst = this;
+    rows.horizontal = false;
+    parallelFor(0, h, rows, 8);
+}
+
+void PlanarImage::gaussianBlur(double sigma)
+{
+    ScopedTimer timer("gaussianBlur");
+    Kernel ker = ImageLogic::gaussKernel(sigma);
+    ker.normalize();
+    convolution(ker);
+}
+
+void PlanarImage::fastGaussianBlur(double sigma)
+{
+    ScopedTimer timer("fastGaussianBlur");
+    int size = 6.0 * sigma;
+    double sum = 0;
+
+    if (size % 2 == 0)
+        size--;
+    if (size <= 0)
+        return;
+
+    QVector<float> weights(size);
+    for (int i = 0; i < size; i++)
+        sum += normalDistrib(i - size / 2, 0, sigma);
+    for (int i = 0; i < size; i++)
+        weights[i] = normalDistrib(i - size / 2, 0, sigma) / sum;
+
+    separableConvolution(weights, weights);
+}
+
+void PlanarImage::unsharpMask(double alpha)
+{
+    ScopedTimer timer("unsharpMask");
+    convolution(ImageLogic::sharpenKernel(alpha));
+}
+
+void PlanarImage::userFilter(const Kernel& ker)
+{
+    ScopedTimer timer("userFilter");
+    convolution(ker);
+}
+
+struct MaxPlanar {
+    static inline float apply(float a, float b) { return a > b ? a : b; }
+#ifdef __SSE2__
+    static inline __m128 apply(__m128 a, __m128 b) { return _mm_max_ps(a, b); }
+#endif
+};
+
+struct MinPlanar {
+    static inline float apply(float a, float b) { return a < b ? a : b; }
+#ifdef __SSE2__
+    static inline __m128 apply(__m128 a, __m128 b) { return _mm_min_ps(a, b); }
+#endif
+};
+
+template <class Op>
+static inline void applyRow(const float *a, const float *b, float *dst, int len)
+{
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 4 <= len; x += 4)
+        _mm_storeu_ps(dst + x, Op::apply(_mm_loadu_ps(a + x), _mm_loadu_ps(b + x)));
+#endif
+    for (; x < len; x++)
+        dst[x] = Op::apply(a[x], b[x]);
+}
+
+// van Herk/Gil-Werman running extremum over 2 * radius + 1 rows; rows are
+// count floats wide and lie rowStep floats apart, borders are replicated.
+template <class Op>
+static void vanHerkRows(const float *src, int rowStep, int len, int count, int radius, float *dst, int dstStep,
+                        float *g, float *h)
+{
+    int k = 2 * radius + 1;
+    int padded = len + 2 * radius;
+    const float *f;
+    int i;
+
+    for (i = 0; i < padded; i++) {
+        f = src + check(i - radius, 0, len) * rowStep;
+        if (i % k == 0)
+            memcpy(g + i * count, f, count * sizeof(float));
+        else
+            applyRow<Op>(g + (i - 1) * count, f, g + i * count, count);
+    }
+    for (i = padded - 1; i >= 0; i--) {
+        f = src + check(i - radius, 0, len) * rowStep;
+        if (i % k == k - 1 || i == padded - 1)
+            memcpy(h + i * count, f, count * sizeof(float));
+        else
+            applyRow<Op>(h + (i + 1) * count, f, h + i * count, count);
+    }
+    for (i = 0; i < len; i++)
+        applyRow<Op>(h + i * count, g + (i + 2 * radius) * count, dst + i * dstStep, count);
+}
+
+template <class Op>
+static void vanHerkLine(const float *src, float *dst, int len, int radius, float *g, float *h)
+{
+    int k = 2 * radius + 1;
+    int padded = len + 2 * radius;
+    int i;
+
+    for (i = 0; i < padded; i++) {
+        float f = src[check(i - radius, 0, len)];
+        g[i] = (i % k == 0) ? f : Op::apply(g[i - 1], f);
+    }
+    for (i = padded - 1; i >= 0; i--) {
+        float f = src[check(i - radius, 0, len)];
+        h[i] = (i % k == k - 1 || i == padded - 1) ? f : Op::apply(h[i + 1], f);
+    }
+    for (i = 0; i < len; i++)
+        dst[i] = Op::apply(h[i], g[i + 2 * radius]);
+}
+
+const int PLANAR_STRIPE = 64;
+
+// Rows are filtered one channel row at a time, columns in stripes of
+// PLANAR_STRIPE floats so that the vertical pass reads whole row segments.
+template <class Op>
+struct PlanarMorphology {
+    PlanarImage *image;
+    int radius;
+    bool horizontal;
+
+    void operator()(int begin, int end) const
+    {
+        int w = image->width();
+        int h = image->height();
+        int len = horizontal ? w : h;
+        int count = horizontal ? 1 : PLANAR_STRIPE;
+        QVector<float> g((len + 2 * radius) * count), hh((len + 2 * radius) * count), out(len * count);
+        int c, i, x, n;
+
+        for (i = begin; i < end; i++) {
+            c = i % PlanarImage::ChannelCount;
+            if (horizontal) {
+                float *row = image->line(c, i / PlanarImage::ChannelCount);
+                vanHerkLine<Op>(row, out.data(), w, radius, g.data(), hh.data());
+                memcpy(row, out.constData(), w * sizeof(float));
+            } else {
+                x = (i / PlanarImage::ChannelCount) * PLANAR_STRIPE;
+                n = qMin(PLANAR_STRIPE, w - x);
+                vanHerkRows<Op>(image->line(c, 0) + x, image->stride(), h, n, radius, out.data(), n, g.data(), hh.data());
+                for (int y = 0; y < h; y++)
+                    memcpy(image->line(c, y) + x, out.constData() + y * n, n * sizeof(float));
+            }
+        }
+    }
+};
+
+template <class Op>
+static void planarMorphology(PlanarImage *image, int radiusX, int radiusY)
+{
+    PlanarMorphology<Op> pass;
+    pass.image = image;
+
+    if (radiusX > 0) {
+        ScopedTimer timer("horizontal pass");
+        Profiler::count(Profiler::Passes, 1);
+        Profiler::count(Profiler::Pixels, qint64(image->width()) * image->height());
+        pass.radius = radiusX;
+        pass.horizontal = true;
+        parallelFor(0, image->height() * PlanarImage::ChannelCount, pass, 16);
+    }
+    if (radiusY > 0) {
+        ScopedTimer timer("vertical pass");
+        Profiler::count(Profiler::Passes, 1);
+        Profiler::count(Profiler::Pixels, qint64(image->width()) * image->height());
+        pass.radius = radiusY;
+        pass.horizontal = false;
+        parallelFor(0, (image->width() + PLANAR_STRIPE - 1) / PLANAR_STRIPE * PlanarImage::ChannelCount, pass);
+    }
+}
+
+void PlanarImage::morphology(int radiusX, int radiusY, bool dilate)
+{
+    if (radiusX < 0 || radiusY < 0 || isNull())
+        return;
+
+    if (dilate)
+        planarMorphology<MaxPlanar>(this, radiusX, radiusY);
+    else
+        planarMorphology<MinPlanar>(this, radiusX, radiusY);
+}
+
+void PlanarImage::erosion(int radiusX, int radiusY)
+{
+    ScopedTimer timer("erosion");
+    morphology(radiusX, radiusY, false);
+}
+
+void PlanarImage::dilation(int radiusX, int radiusY)
+{
+    ScopedTimer timer("dilation");
+    morphology(radiusX, radiusY, true);
+}
+
+void PlanarImage::opening(int radiusX, int radiusY)
+{
+    ScopedTimer timer("opening");
+    morphology(radiusX, radiusY, false);
+    morphology(radiusX, radiusY, true);
+}
+
+void PlanarImage::closing(int radiusX, int radiusY)
+{
+    ScopedTimer timer("closing");
+    morphology(radiusX, radiusY, true);
+    morphology(radiusX, radiusY, false);
+}
+
+void PlanarImage::channelCorrection()
+{
+    ScopedTimer timer("channelCorrection");
+    float lo, hi, scale;
+    const float *src;
+    float *dst;
+    int x, y;
+
+    Profiler::count(Profiler::Passes, 2);
+    Profiler::count(Profiler::Pixels, 2 * qint64(w) * h);
+
+    for (int c = Red; c <= Blue; c++) {
+        lo = 255;
+        hi = 0;
+        for (y = 0; y < h; y++) {
+            src = line(c, y);
+            for (x = 0; x < w; x++) {
+                lo = qMin(lo, src[x]);
+                hi = qMax(hi, src[x]);
+            }
+        }
+        if (hi <= lo)
+            continue;
+
+        scale = 255 / (hi - lo);
+        for (y = 0; y < h; y++) {
+            dst = line(c, y);
+            for (x = 0; x < w; x++)
+                dst[x] = (dst[x] - lo) * scale;
+        }
+    }
+}
+
+void PlanarImage::greyWorld()
+{
+    ScopedTimer timer("greyWorld");
+    double avg[ChannelCount], mean = 0;
+    const float *src;
+    float *dst, scale;
+    int x, y, c;
+
+    Profiler::count(Profiler::Passes, 2);
+    Profiler::count(Profiler::Pixels, 2 * qint64(w) * h);
+
+    for (c = Red; c <= Blue; c++) {
+        avg[c] = 0;
+        for (y = 0; y < h; y++) {
+            src = line(c, y);
+            for (x = 0; x < w; x++)
+                avg[c] += src[x];
+        }
+        avg[c] /= double(w) * h;
+        mean += avg[c] / 3;
+    }
+
+    for (c = Red; c <= Blue; c++) {
+        if (avg[c] < eps)
+            continue;
+        scale = mean / avg[c];
+        for (y = 0; y < h; y++) {
+            dst = line(c, y);
+            for (x = 0; x < w; x++)
+                dst[x] *= scale;
+        }
+    }
+}
+
+void PlanarImage::applyColorLUT(const ColorLUT& lut)
+{
+    ScopedTimer timer("applyColorLUT");
+
+    Profiler::count(Profiler::Passes, 1);
+    Profiler::count(Profiler::Pixels, qint64(w) * h);
+
+    for (int y = 0; y < h; y++)
+        lut.mapPlanar(line(Red, y), line(Green, y), line(Blue, y), w);
+}
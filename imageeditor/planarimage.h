@@ -0,0 +1,70 @@
+#ifndef PLANARIMAGE_H
+#define PLANARIMAGE_H
+
+#include <QImage>
+
+#include "colorlut.h"
+#include "logic.h"
+
+// Float working copy of an image with one plane per channel. Values stay in
+// the 0..255 scale but are neither rounded nor clamped between operations;
+// toImage() does that once. Planes come from the scratch pool; every row
+// starts on a 64-byte boundary and is padded to a multiple of 16 floats, so
+// rows can be processed four or eight floats at a time without tails inside
+// the stride.
+//
+// Operations work on the whole image and follow the ImageLogic operation of
+// the same name.
+class PlanarImage {
+public:
+    enum Channel {
+        Red,
+        Green,
+        Blue,
+        Alpha,
+        ChannelCount
+    };
+
+    PlanarImage();
+    PlanarImage(int width, int height);
+    explicit PlanarImage(const QImage& image);
+    PlanarImage(const PlanarImage& image);
+    PlanarImage& operator=(const PlanarImage& image);
+    ~PlanarImage();
+
+    bool isNull() const { return !data; }
+    int width() const { return w; }
+    int height() const { return h; }
+    int stride() const { return step; }
+
+    float* line(int channel, int y) { return data + (channel * h + y) * step; }
+    const float* line(int channel, int y) const { return data + (channel * h + y) * step; }
+
+    QImage toImage() const;
+    QImage toImage(int top, int rows) const;
+
+    void gaussianBlur(double sigma);
+    void fastGaussianBlur(double sigma);
+    void unsharpMask(double alpha);
+    void userFilter(const Kernel& ker);
+    void erosion(int radiusX, int radiusY);
+    void dilation(int radiusX, int radiusY);
+    void opening(int radiusX, int radiusY);
+    void closing(int radiusX, int radiusY);
+    void channelCorrection();
+    void greyWorld();
+    void applyColorLUT(const ColorLUT& lut);
+
+private:
+    void allocate(int width, int height);
+    void convolution(const Kernel& ker);
+    void separableConvolution(const QVector<float>& row, const QVector<float>& column);
+    void morphology(int radiusX, int radiusY, bool dilate);
+
+    float *data;
+    int w, h;
+    int step;
+    QImage::Format format;
+};
+
+#endif // PLANARIMAGE_H
@@ -0,0 +1,254 @@
+#include <QFile>
+#include <QMutex>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadStorage>
+#include <QVector>
+
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "profiler.h"
+
+namespace {
+
+struct Frame {
+    const char *name;
+    qint64 start;
+};
+
+struct SummaryEntry {
+    const char *name;
+    const char *parent;
+    qint64 time;
+};
+
+struct TraceEvent {
+    const char *name;
+    qint64 start;
+    qint64 duration;
+    qint64 value;
+    int thread;
+    bool counter;
+};
+
+}
+
+static const char *counterNames[Profiler::CounterCount] = { "pixels", "passes", "bytes copied", "scratch allocations", "scratch reuses" };
+
+static QMutex mutex;
+static QThreadStorage<QVector<Frame>*> stacks;
+static QVector<SummaryEntry> entries;
+static qint64 counters[Profiler::CounterCount];
+
+static bool tracing = false;
+static QString traceFileName;
+static QVector<TraceEvent> events;
+static QVector<Qt::HANDLE> threads;
+static qint64 traceCounters[Profiler::CounterCount];
+
+// nanoseconds from an arbitrary origin
+static qint64 now()
+{
+#ifdef Q_OS_WIN
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return qint64(counter.QuadPart * 1e9 / frequency.QuadPart);
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static int threadIndex()
+{
+    Qt::HANDLE id = QThread::currentThreadId();
+    int i = threads.indexOf(id);
+    if (i < 0) {
+        threads.push_back(id);
+        i = threads.size() - 1;
+    }
+    return i + 1;
+}
+
+void Profiler::enter(const char *name)
+{
+    if (!stacks.hasLocalData())
+        stacks.setLocalData(new QVector<Frame>);
+
+    Frame frame;
+    frame.name = name;
+    frame.start = now();
+    stacks.localData()->push_back(frame);
+}
+
+void Profiler::leave()
+{
+    QVector<Frame> *stack = stacks.localData();
+    Frame frame = stack->last();
+    qint64 time = now() - frame.start;
+    int depth;
+
+    stack->pop_back();
+    depth = stack->size();
+
+    QMutexLocker locker(&mutex);
+
+    if (depth <= 1) {
+        const char *parent = depth ? stack->last().name : 0;
+        int i;
+        for (i = 0; i < entries.size(); i++) {
+            if (!strcmp(entries[i].name, frame.name) &&
+                (entries[i].parent == parent || (parent && entries[i].parent && !strcmp(entries[i].parent, parent))))
+                break;
+        }
+        if (i == entries.size()) {
+            SummaryEntry entry;
+            entry.name = frame.name;
+            entry.parent = parent;
+            entry.time = 0;
+            entries.push_back(entry);
+        }
+        entries[i].time += time;
+    }
+
+    if (tracing) {
+        TraceEvent event;
+        event.name = frame.name;
+        event.start = frame.start;
+        event.duration = time;
+        event.value = 0;
+        event.thread = threadIndex();
+        event.counter = false;
+        events.push_back(event);
+    }
+}
+
+void Profiler::count(Counter counter, qint64 value)
+{
+    QMutexLocker locker(&mutex);
+
+    counters[counter] += value;
+
+    if (tracing) {
+        traceCounters[counter] += value;
+
+        TraceEvent event;
+        event.name = counterNames[counter];
+        event.start = now();
+        event.duration = 0;
+        event.value = traceCounters[counter];
+        event.thread = threadIndex();
+        event.counter = true;
+        events.push_back(event);
+    }
+}
+
+static QString formatTime(qint64 ns)
+{
+    return QString("%1 ms").arg(ns / 1e6, 0, 'f', 1);
+}
+
+QString Profiler::summary()
+{
+    QMutexLocker locker(&mutex);
+    QStringList scopes, children;
+
+    for (int i = 0; i < entries.size(); i++) {
+        if (entries[i].parent)
+            continue;
+
+        children.clear();
+        for (int j = 0; j < entries.size(); j++) {
+            if (entries[j].parent && !strcmp(entries[j].parent, entries[i].name))
+                children << QString("%1 %2").arg(entries[j].name).arg(formatTime(entries[j].time));
+        }
+
+        QString scope = QString("%1 %2").arg(entries[i].name).arg(formatTime(entries[i].time));
+        if (!children.isEmpty())
+            scope += QString(" (%1)").arg(children.join(", "));
+        scopes << scope;
+    }
+
+    QString res = scopes.join("; ");
+    if (counters[Passes]) {
+        res += QString(" | %1 pixels in %2 passes, %3 MB copied")
+                .arg(counters[Pixels])
+                .arg(counters[Passes])
+                .arg(counters[BytesCopied] / 1048576., 0, 'f', 1);
+    }
+    if (counters[ScratchAllocations] || counters[ScratchReuses]) {
+        res += QString(" | scratch buffers: %1 allocated, %2 reused")
+                .arg(counters[ScratchAllocations])
+                .arg(counters[ScratchReuses]);
+    }
+    return res;
+}
+
+void Profiler::reset()
+{
+    QMutexLocker locker(&mutex);
+
+    entries.clear();
+    for (int i = 0; i < CounterCount; i++)
+        counters[i] = 0;
+}
+
+void Profiler::startTrace(const QString& fileName)
+{
+    QMutexLocker locker(&mutex);
+
+    traceFileName = fileName;
+    tracing = true;
+    events.clear();
+    for (int i = 0; i < CounterCount; i++)
+        traceCounters[i] = 0;
+}
+
+bool Profiler::stopTrace()
+{
+    QMutexLocker locker(&mutex);
+
+    if (!tracing)
+        return true;
+    tracing = false;
+
+    QFile file(traceFileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        qWarning("Cannot create trace file %s", qPrintable(traceFileName));
+        return false;
+    }
+
+    QTextStream out(&file);
+    qint64 origin = events.isEmpty() ? 0 : events[0].start;
+
+    for (int i = 1; i < events.size(); i++)
+        origin = qMin(origin, events[i].start);
+
+    out.setRealNumberNotation(QTextStream::FixedNotation);
+    out.setRealNumberPrecision(3);
+    out << "{\"traceEvents\":[\n";
+    for (int i = 0; i < events.size(); i++) {
+        const TraceEvent& e = events[i];
+        out << "{\"name\":\"" << e.name << "\",\"cat\":\"imageeditor\",\"pid\":1,\"tid\":" << e.thread
+            << ",\"ts\":" << (e.start - origin) / 1e3;
+        if (e.counter)
+            out << ",\"ph\":\"C\",\"args\":{\"value\":" << e.value << "}}";
+        else
+            out << ",\"ph\":\"X\",\"dur\":" << e.duration / 1e3 << "}";
+        out << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    out << "],\"displayTimeUnit\":\"ms\"}\n";
+    file.close();
+
+    events.clear();
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <QString>
+
+// Process-wide timers and counters. Scopes on each thread nest; the summary
+// keeps top-level scopes and their direct children, the trace keeps every
+// scope as a Chrome trace event (chrome://tracing, Perfetto).
+class Profiler {
+public:
+    enum Counter {
+        Pixels,
+        Passes,
+        BytesCopied,
+        ScratchAllocations,
+        ScratchReuses,
+        CounterCount
+    };
+
+    static void enter(const char *name);
+    static void leave();
+    static void count(Counter counter, qint64 value);
+
+    // everything recorded since the last reset, on one line
+    static QString summary();
+    static void reset();
+
+    static void startTrace(const QString& fileName);
+    static bool stopTrace();
+};
+
+class ScopedTimer {
+public:
+    explicit ScopedTimer(const char *name) { Profiler::enter(name); }
+    ~ScopedTimer() { Profiler::leave(); }
+};
+
+#endif // PROFILER_H
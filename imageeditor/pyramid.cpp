@@ -0,0 +1,248 @@
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "logic.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "pyramid.h"
+#include "utils.h"
+
+// Vertical part of the reduce filter: one row of 16-bit channel sums
+// 1 4 6 4 1 over five source rows (at most 16 * 255).
+static void reduceColumns(const uchar *r0, const uchar *r1, const uchar *r2, const uchar *r3, const uchar *r4,
+                          quint16 *dst, int bytes)
+{
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= bytes; i += 8) {
+        __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(r0 + i)), zero);
+        __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(r1 + i)), zero);
+        __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(r2 + i)), zero);
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(r3 + i)), zero);
+        __m128i e = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(r4 + i)), zero);
+        __m128i s = _mm_add_epi16(a, e);
+        s = _mm_add_epi16(s, _mm_slli_epi16(_mm_add_epi16(b, d), 2));
+        s = _mm_add_epi16(s, _mm_add_epi16(_mm_slli_epi16(c, 2), _mm_slli_epi16(c, 1)));
+        _mm_storeu_si128((__m128i*)(dst + i), s);
+    }
+#endif
+    for (; i < bytes; i++)
+        dst[i] = r0[i] + 4 * r1[i] + 6 * r2[i] + 4 * r3[i] + r4[i];
+}
+
+struct ReduceRows {
+    const QImage *src;
+    QImage *dst;
+
+    void operator()(int begin, int end) const
+    {
+        int w = src->width();
+        int h = src->height();
+        int dw = dst->width();
+        QVector<quint16> sums(4 * w);
+        const quint16 *p;
+        uchar *out;
+        int x, c, x0, x1, x2, x3, x4;
+
+        for (int y = begin; y < end; y++) {
+            reduceColumns(src->constScanLine(check(2 * y - 2, 0, h)), src->constScanLine(check(2 * y - 1, 0, h)),
+                          src->constScanLine(check(2 * y, 0, h)), src->constScanLine(check(2 * y + 1, 0, h)),
+                          src->constScanLine(check(2 * y + 2, 0, h)), sums.data(), 4 * w);
+            p = sums.constData();
+            out = dst->scanLine(y);
+            for (x = 0; x < dw; x++) {
+                x0 = 4 * check(2 * x - 2, 0, w);
+                x1 = 4 * check(2 * x - 1, 0, w);
+                x2 = 4 * (2 * x);
+                x3 = 4 * check(2 * x + 1, 0, w);
+                x4 = 4 * check(2 * x + 2, 0, w);
+                for (c = 0; c < 4; c++)
+                    out[4 * x + c] = (p[x0 + c] + 4 * p[x1 + c] + 6 * p[x2 + c] + 4 * p[x3 + c] + p[x4 + c] + 128) >> 8;
+            }
+        }
+    }
+};
+
+QImage Pyramid::reduce(const QImage& image)
+{
+    ScopedTimer timer("reduce");
+    QImage res((image.width() + 1) / 2, (image.height() + 1) / 2, image.format());
+    ReduceRows rows;
+
+    Profiler::count(Profiler::Passes, 1);
+    Profiler::count(Profiler::Pixels, qint64(image.width()) * image.height());
+
+    rows.src = &image;
+    rows.dst = &res;
+    parallelFor(0, res.height(), rows, 8);
+    return res;
+}
+
+// Expand interpolates with the same binomial filter: even outputs take
+// (1 6 1) / 8 around the matching source pixel, odd ones (1 1) / 2 of the
+// two neighbours. Separable, the vertical part comes first.
+struct ExpandRows {
+    const QImage *src;
+    QImage *dst;
+
+    void operator()(int begin, int end) const
+    {
+        int w = src->width();
+        int h = src->height();
+        int dw = dst->width();
+        QVector<quint16> column(4 * w);
+        const uchar *a, *b, *c;
+        const quint16 *p;
+        uchar *out;
+        int x, k, i, j, ch;
+
+        for (int y = begin; y < end; y++) {
+            k = y / 2;
+            if (y % 2 == 0) {
+                a = src->constScanLine(check(k - 1, 0, h));
+                b = src->constScanLine(check(k, 0, h));
+                c = src->constScanLine(check(k + 1, 0, h));
+                for (i = 0; i < 4 * w; i++)
+                    column[i] = a[i] + 6 * b[i] + c[i];
+            } else {
+                a = src->constScanLine(check(k, 0, h));
+                b = src->constScanLine(check(k + 1, 0, h));
+                for (i = 0; i < 4 * w; i++)
+                    column[i] = 4 * (a[i] + b[i]);
+            }
+
+            p = column.constData();
+            out = dst->scanLine(y);
+            for (x = 0; x < dw; x++) {
+                k = x / 2;
+                if (x % 2 == 0) {
+                    i = 4 * check(k - 1, 0, w);
+                    j = 4 * check(k + 1, 0, w);
+                    for (ch = 0; ch < 4; ch++)
+                        out[4 * x + ch] = (p[i + ch] + 6 * p[4 * check(k, 0, w) + ch] + p[j + ch] + 32) >> 6;
+                } else {
+                    i = 4 * check(k, 0, w);
+                    j = 4 * check(k + 1, 0, w);
+                    for (ch = 0; ch < 4; ch++)
+                        out[4 * x + ch] = (4 * (p[i + ch] + p[j + ch]) + 32) >> 6;
+                }
+            }
+        }
+    }
+};
+
+QImage Pyramid::expand(const QImage& image, int width, int height)
+{
+    ScopedTimer timer("expand");
+    QImage res(width, height, image.format());
+    ExpandRows rows;
+
+    Profiler::count(Profiler::Passes, 1);
+    Profiler::count(Profiler::Pixels, qint64(width) * height);
+
+    rows.src = &image;
+    rows.dst = &res;
+    parallelFor(0, height, rows, 8);
+    return res;
+}
+
+void Pyramid::build(const QImage& image, int count, bool keepBase)
+{
+    ScopedTimer timer("pyramid");
+    QImage level = image;
+
+    if (level.format() != QImage::Format_RGB32 && level.format() != QImage::Format_ARGB32)
+        level = level.convertToFormat(QImage::Format_ARGB32);
+
+    levels.clear();
+    sizes.clear();
+    levels.push_back(level);
+    sizes.push_back(level.size());
+    while (count < 0 || levels.size() < count) {
+        if (qMin(sizes.last().width(), sizes.last().height()) < 2 * PYRAMID_MIN_SIZE)
+            break;
+        level = reduce(level);
+        levels.push_back(level);
+        sizes.push_back(level.size());
+    }
+    if (!keepBase)
+        levels[0] = QImage();
+    key = image.cacheKey();
+}
+
+void Pyramid::clear()
+{
+    levels.clear();
+    sizes.clear();
+    key = 0;
+}
+
+QImage Pyramid::laplacian(int i) const
+{
+    const QImage& fine = levels[i];
+    if (i + 1 >= levels.size() || fine.isNull())
+        return fine;
+
+    QImage res = expand(levels[i + 1], fine.width(), fine.height());
+    const uchar *a;
+    uchar *b;
+
+    for (int y = 0; y < res.height(); y++) {
+        a = fine.constScanLine(y);
+        b = res.scanLine(y);
+        for (int x = 0; x < 4 * res.width(); x++)
+            b[x] = checkColor(a[x] - b[x] + 128);
+    }
+    return res;
+}
+
+int Pyramid::levelForScale(double scale) const
+{
+    int i = 0;
+    while (i + 1 < levels.size() && scale <= 0.5 / (1 << i))
+        i++;
+    return i;
+}
+
+QImage Pyramid::blur(const QImage& image, double sigma)
+{
+    Pyramid pyramid;
+    int levels = 1;
+
+    // reduce only as far as the blur needs
+    for (double s = sigma; s >= 4; s /= 2)
+        levels++;
+    pyramid.build(image, levels);
+    return blur(pyramid, sigma);
+}
+
+// Reduce, small blur at the coarse level, expand. Every reduction blurs
+// with variance 1 in units of its own level, so after l reductions the
+// image is already blurred with variance (4^l - 1) / 3 of full-size pixels;
+// the rest is applied at the coarse level, where it is 2^l times smaller.
+QImage Pyramid::blur(const Pyramid& pyramid, double sigma)
+{
+    ScopedTimer timer("pyramid blur");
+    int l = 0;
+    double rest;
+
+    while (l + 1 < pyramid.levelCount() && sigma / (2 << l) >= 2)
+        l++;
+
+    rest = sigma * sigma - ((1 << (2 * l)) - 1) / 3.;
+    rest = rest > 0 ? sqrt(rest) / (1 << l) : 0;
+
+    ImageLogic coarse(pyramid.level(l));
+    if (rest > 0.5)
+        coarse.fastGaussianBlur(rest);
+
+    QImage res = coarse;
+    for (int i = l - 1; i >= 0; i--)
+        res = expand(res, pyramid.size(i).width(), pyramid.size(i).height());
+    return res;
+}
@@ -0,0 +1,42 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <QImage>
+#include <QVector>
+
+const int PYRAMID_MIN_SIZE = 8;
+const double PYRAMID_BLUR_SIGMA = 8.0;
+
+// Gaussian pyramid of an RGB32/ARGB32 image: level 0 is the image, every
+// next level is reduced with the separable 5-tap binomial filter
+// (1 4 6 4 1) / 16 and subsampled by two, down to PYRAMID_MIN_SIZE pixels
+// on the shorter side. Without keepBase level 0 is not kept (the owner of
+// the image is level 0) and only its size is known.
+class Pyramid {
+public:
+    Pyramid() : key(0) {}
+
+    void build(const QImage& image, int levels = -1, bool keepBase = true);
+    bool isBuiltFor(const QImage& image) const { return !levels.isEmpty() && key == image.cacheKey(); }
+    void clear();
+
+    int levelCount() const { return levels.size(); }
+    const QImage& level(int i) const { return levels[i]; }
+    QSize size(int i) const { return sizes[i]; }
+    // level(i) minus the expanded level(i + 1), offset by 128
+    QImage laplacian(int i) const;
+    // the level to draw the image at the given scale (<= 1) from
+    int levelForScale(double scale) const;
+
+    static QImage reduce(const QImage& image);
+    static QImage expand(const QImage& image, int width, int height);
+    static QImage blur(const QImage& image, double sigma);
+    static QImage blur(const Pyramid& pyramid, double sigma);
+
+private:
+    QVector<QImage> levels;
+    QVector<QSize> sizes;
+    qint64 key;
+};
+
+#endif // PYRAMID_H
@@ -0,0 +1,123 @@
+#include <QMutex>
+#include <QVector>
+
+#include <cstring>
+
+#include "profiler.h"
+#include "scratch.h"
+
+const qint64 SCRATCH_GRANULARITY = 4096;
+
+// Every block starts with a SCRATCH_ALIGNMENT byte header holding the
+// capacity of the buffer behind it. The pool is shared by all threads;
+// they take it once per buffer, not per row.
+struct ScratchArena {
+    QMutex mutex;
+    QVector<char*> blocks;
+    qint64 cached;
+
+    ScratchArena() : cached(0) {}
+    ~ScratchArena()
+    {
+        for (int i = 0; i < blocks.size(); i++)
+            qFreeAligned(blocks[i]);
+    }
+};
+
+static ScratchArena pool;
+
+static inline qint64& capacity(char *block)
+{
+    return *(qint64*)block;
+}
+
+void* ScratchPool::acquire(qint64 bytes)
+{
+    int best = -1;
+    qint64 size;
+    char *block = 0;
+
+    if (bytes <= 0)
+        return 0;
+
+    {
+        QMutexLocker locker(&pool.mutex);
+        for (int i = 0; i < pool.blocks.size(); i++) {
+            size = capacity(pool.blocks[i]);
+            if (size >= bytes && size <= 2 * bytes + SCRATCH_GRANULARITY &&
+                    (best < 0 || size < capacity(pool.blocks[best])))
+                best = i;
+        }
+        if (best >= 0) {
+            block = pool.blocks[best];
+            pool.blocks.remove(best);
+            pool.cached -= capacity(block);
+        }
+    }
+
+    if (block) {
+        Profiler::count(Profiler::ScratchReuses, 1);
+        return block + SCRATCH_ALIGNMENT;
+    }
+
+    size = qMax(SCRATCH_GRANULARITY, (bytes + SCRATCH_GRANULARITY - 1) / SCRATCH_GRANULARITY * SCRATCH_GRANULARITY);
+    block = (char*)qMallocAligned(size + SCRATCH_ALIGNMENT, SCRATCH_ALIGNMENT);
+    if (!block) {
+        qWarning("Cannot allocate %lld bytes of scratch memory", bytes);
+        return 0;
+    }
+    capacity(block) = size;
+    Profiler::count(Profiler::ScratchAllocations, 1);
+    return block + SCRATCH_ALIGNMENT;
+}
+
+void ScratchPool::release(void *buffer)
+{
+    if (!buffer)
+        return;
+
+    char *block = (char*)buffer - SCRATCH_ALIGNMENT;
+
+    {
+        QMutexLocker locker(&pool.mutex);
+        if (pool.cached + capacity(block) <= SCRATCH_POOL_LIMIT) {
+            pool.blocks.push_back(block);
+            pool.cached += capacity(block);
+            return;
+        }
+    }
+    qFreeAligned(block);
+}
+
+void ScratchPool::trim()
+{
+    QVector<char*> blocks;
+
+    {
+        QMutexLocker locker(&pool.mutex);
+        blocks = pool.blocks;
+        pool.blocks.clear();
+        pool.cached = 0;
+    }
+    for (int i = 0; i < blocks.size(); i++)
+        qFreeAligned(blocks[i]);
+}
+
+ScratchImage::ScratchImage(const QImage& image) : buffer(0)
+{
+    if (image.isNull())
+        return;
+
+    ScopedTimer timer("snapshot");
+    Profiler::count(Profiler::BytesCopied, image.byteCount());
+
+    buffer = ScratchPool::acquire(image.byteCount());
+    memcpy(buffer, image.constBits(), image.byteCount());
+    QImage::operator=(QImage((uchar*)buffer, image.width(), image.height(), image.bytesPerLine(), image.format()));
+}
+
+ScratchImage::~ScratchImage()
+{
+    QImage::operator=(QImage());
+    ScratchPool::release(buffer);
+}
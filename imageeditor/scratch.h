@@ -0,0 +1,59 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <QImage>
+
+const int SCRATCH_ALIGNMENT = 64;
+const qint64 SCRATCH_POOL_LIMIT = 512 * 1024 * 1024;
+
+// Process-wide pool of 64-byte aligned scratch buffers. acquire() hands out
+// the smallest free buffer that fits (and is not more than about twice the
+// request) or allocates a new one; release() returns a buffer to the pool,
+// which frees it instead when the pool would hold more than
+// SCRATCH_POOL_LIMIT bytes. Buffers stay cached until trim(), so batch runs
+// reuse them from file to file.
+class ScratchPool {
+public:
+    static void* acquire(qint64 bytes);
+    static void release(void *buffer);
+    // frees every cached buffer
+    static void trim();
+};
+
+// Uninitialized array from the pool for the lifetime of the object.
+template <class T>
+class ScratchBuffer {
+public:
+    explicit ScratchBuffer(int count)
+        : buffer((T*)ScratchPool::acquire(qint64(count) * sizeof(T))), count(count) {}
+    ~ScratchBuffer() { ScratchPool::release(buffer); }
+
+    T* data() { return buffer; }
+    const T* constData() const { return buffer; }
+    T& operator[](int i) { return buffer[i]; }
+    const T& operator[](int i) const { return buffer[i]; }
+    int size() const { return count; }
+
+private:
+    ScratchBuffer(const ScratchBuffer&);
+    ScratchBuffer& operator=(const ScratchBuffer&);
+
+    T *buffer;
+    int count;
+};
+
+// Deep copy of an image in a pooled buffer. QImage copies of it share the
+// buffer and must not outlive it.
+class ScratchImage : public QImage {
+public:
+    explicit ScratchImage(const QImage& image);
+    ~ScratchImage();
+
+private:
+    ScratchImage(const ScratchImage&);
+    ScratchImage& operator=(const ScratchImage&);
+
+    void *buffer;
+};
+
+#endif // SCRATCH_H
@@ -0,0 +1,444 @@
+#include <QFile>
+#include <QMap>
+#include <QMutex>
+#include <QSemaphore>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <stdio.h>
+
+#ifdef Q_OS_WIN
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "planarimage.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "sequence.h"
+#include "utils.h"
+
+bool RawFormat::parse(const QString& name)
+{
+    QString lower = name.toLower();
+    if (lower == "rgb24")
+        layout = RGB24;
+    else if (lower == "bgra")
+        layout = BGRA;
+    else if (lower == "yuv420p")
+        layout = YUV420P;
+    else
+        return false;
+    return true;
+}
+
+int RawFormat::frameSize() const
+{
+    switch (layout) {
+    case RGB24:
+        return width * height * 3;
+    case BGRA:
+        return width * height * 4;
+    case YUV420P:
+        return width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+    case None:
+        break;
+    }
+    return 0;
+}
+
+QImage RawFormat::toImage(const QByteArray& frame) const
+{
+    QImage image(width, height, QImage::Format_RGB32);
+    const uchar *src = (const uchar*)frame.constData();
+    int chromaWidth = (width + 1) / 2;
+    const uchar *u = src + width * height;
+    const uchar *v = u + chromaWidth * ((height + 1) / 2);
+    int x, y, c, d, e;
+    QRgb *line;
+
+    for (y = 0; y < height; y++) {
+        line = (QRgb*)image.scanLine(y);
+        switch (layout) {
+        case RGB24:
+            for (x = 0; x < width; x++, src += 3)
+                line[x] = qRgb(src[0], src[1], src[2]);
+            break;
+        case BGRA:
+            for (x = 0; x < width; x++, src += 4)
+                line[x] = qRgb(src[2], src[1], src[0]);
+            break;
+        case YUV420P:
+            for (x = 0; x < width; x++) {
+                c = 298 * (src[y * width + x] - 16) + 128;
+                d = u[(y / 2) * chromaWidth + x / 2] - 128;
+                e = v[(y / 2) * chromaWidth + x / 2] - 128;
+                line[x] = qRgb(checkColor((c + 409 * e) >> 8),
+                               checkColor((c - 100 * d - 208 * e) >> 8),
+                               checkColor((c + 516 * d) >> 8));
+            }
+            break;
+        case None:
+            break;
+        }
+    }
+    return image;
+}
+
+QByteArray RawFormat::fromImage(const QImage& image) const
+{
+    int w = image.width();
+    int h = image.height();
+    RawFormat format(*this);
+    format.width = w;
+    format.height = h;
+    QByteArray frame(format.frameSize(), 0);
+    uchar *dst = (uchar*)frame.data();
+    int chromaWidth = (w + 1) / 2;
+    uchar *u = dst + w * h;
+    uchar *v = u + chromaWidth * ((h + 1) / 2);
+    const QRgb *line;
+    int x, y, i, j, r, g, b, n;
+    QRgb p;
+
+    for (y = 0; y < h; y++) {
+        line = (const QRgb*)image.constScanLine(y);
+        switch (layout) {
+        case RGB24:
+            for (x = 0; x < w; x++, dst += 3) {
+                dst[0] = qRed(line[x]);
+                dst[1] = qGreen(line[x]);
+                dst[2] = qBlue(line[x]);
+            }
+            break;
+        case BGRA:
+            for (x = 0; x < w; x++, dst += 4) {
+                dst[0] = qBlue(line[x]);
+                dst[1] = qGreen(line[x]);
+                dst[2] = qRed(line[x]);
+                dst[3] = qAlpha(line[x]);
+            }
+            break;
+        case YUV420P:
+            for (x = 0; x < w; x++) {
+                p = line[x];
+                dst[y * w + x] = ((66 * qRed(p) + 129 * qGreen(p) + 25 * qBlue(p) + 128) >> 8) + 16;
+            }
+            break;
+        case None:
+            break;
+        }
+    }
+
+    if (layout != YUV420P)
+        return frame;
+
+    // chroma of the 2x2 block average
+    for (y = 0; y < h; y += 2) {
+        for (x = 0; x < w; x += 2) {
+            r = g = b = n = 0;
+            for (i = y; i < qMin(y + 2, h); i++) {
+                for (j = x; j < qMin(x + 2, w); j++) {
+                    p = ((const QRgb*)image.constScanLine(i))[j];
+                    r += qRed(p);
+                    g += qGreen(p);
+                    b += qBlue(p);
+                    n++;
+                }
+            }
+            r /= n;
+            g /= n;
+            b /= n;
+            u[(y / 2) * chromaWidth + x / 2] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            v[(y / 2) * chromaWidth + x / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    }
+    return frame;
+}
+
+static QString frameName(const QString& pattern, int index)
+{
+    QString name;
+    return name.sprintf(qPrintable(pattern), index);
+}
+
+namespace {
+
+// position counts frames from 0 in input order, index is the number used
+// in file names
+struct Frame {
+    int position;
+    int index;
+    QString fileName;
+    QByteArray data;
+};
+
+// State shared by the reader, the frame tasks and the writer. The
+// available semaphore counts the frames that may still be read; a frame
+// gives its slot back once written. fail() releases enough slots to wake
+// the reader.
+class SequenceState {
+public:
+    SequenceState(int capacity) : available(capacity), capacity(capacity), total(-1), failed(false) {}
+
+    QSemaphore available;
+
+    // no more frames; count is the number read
+    void close(int count)
+    {
+        QMutexLocker locker(&mutex);
+        total = count;
+        written.wakeAll();
+    }
+
+    void deliver(int position, const QByteArray& data)
+    {
+        QMutexLocker locker(&mutex);
+        encoded.insert(position, data);
+        written.wakeAll();
+    }
+
+    // waits for the frame at position; false at the end or after a failure
+    bool take(int position, QByteArray& data)
+    {
+        QMutexLocker locker(&mutex);
+        while (!failed && !encoded.contains(position) && (total < 0 || position < total))
+            written.wait(&mutex);
+        if (failed || !encoded.contains(position))
+            return false;
+        data = encoded.take(position);
+        return true;
+    }
+
+    void fail()
+    {
+        QMutexLocker locker(&mutex);
+        if (failed)
+            return;
+        failed = true;
+        encoded.clear();
+        available.release(capacity);
+        written.wakeAll();
+    }
+
+    bool hasFailed()
+    {
+        QMutexLocker locker(&mutex);
+        return failed;
+    }
+
+    int count()
+    {
+        QMutexLocker locker(&mutex);
+        return total;
+    }
+
+private:
+    QMutex mutex;
+    QWaitCondition written;
+    QMap<int, QByteArray> encoded;
+    int capacity;
+    int total;
+    bool failed;
+};
+
+// Decodes, processes and encodes one frame; runs as a scheduler task, so
+// several frames are processed at once and the pipeline's own parallel
+// loops share the same threads.
+class FrameTask : public Task {
+public:
+    FrameTask(SequenceState *state, const Pipeline& pipeline, const RawFormat& raw, const QString& output, const Frame& frame)
+        : state(state), pipeline(pipeline), raw(raw), output(output), frame(frame) {}
+
+    void run()
+    {
+        if (state->hasFailed() || !process())
+            state->available.release();
+        // the task lives until its group is waited for, the frame does not
+        frame.data = QByteArray();
+    }
+
+private:
+    // false when the frame's slot has to be released here
+    bool process()
+    {
+        ScopedTimer timer("frame");
+        QImage image;
+
+        if (frame.fileName.isEmpty())
+            image = raw.toImage(frame.data);
+        else
+            image = QImage(frame.fileName);
+        frame.data = QByteArray();
+        if (image.isNull()) {
+            qWarning("Cannot load frame %d", frame.index);
+            state->fail();
+            return false;
+        }
+
+        if (pipeline.isPlanar()) {
+            PlanarImage planar(image);
+            pipeline.apply(planar);
+            image = planar.toImage();
+        } else {
+            ImageLogic logic(image);
+            pipeline.apply(logic);
+            image = logic;
+        }
+
+        if (output == "-") {
+            state->deliver(frame.position, raw.fromImage(image));
+            return true;
+        }
+
+        QString fileName = frameName(output, frame.index);
+        if (!image.save(fileName)) {
+            qWarning("Cannot save %s", qPrintable(fileName));
+            state->fail();
+        }
+        return false;
+    }
+
+    SequenceState *state;
+    const Pipeline& pipeline;
+    RawFormat raw;
+    QString output;
+    Frame frame;
+};
+
+// Reads the frames and spawns a task for each. A group deletes its tasks
+// only when it is waited for, so two groups take turns as in the server:
+// when one holds a window of tasks, the other one is waited for. Without
+// scheduler workers the tasks would only run inside wait, so they run right
+// away instead.
+class FrameReader : public QThread {
+public:
+    FrameReader(SequenceState *state, const Pipeline& pipeline, const RawFormat& raw,
+                const QString& input, const QString& output, int window)
+        : state(state), pipeline(pipeline), raw(raw), input(input), output(output),
+          window(window), current(0), count(0) {}
+
+protected:
+    void run()
+    {
+        Frame frame;
+        int size = raw.frameSize();
+        size_t n;
+
+        frame.position = 0;
+        if (input == "-") {
+            for (frame.index = 0; ; frame.index++) {
+                state->available.acquire();
+                if (state->hasFailed())
+                    break;
+                ScopedTimer timer("read frame");
+                frame.data.resize(size);
+                n = fread(frame.data.data(), 1, size, stdin);
+                if (n == 0 && feof(stdin))
+                    break;
+                if (n != size_t(size)) {
+                    qWarning("Truncated frame %d on stdin", frame.index);
+                    state->fail();
+                    break;
+                }
+                spawn(frame);
+                frame.position++;
+            }
+        } else {
+            frame.index = QFile::exists(frameName(input, 0)) ? 0 : 1;
+            for (; QFile::exists(frameName(input, frame.index)); frame.index++) {
+                state->available.acquire();
+                if (state->hasFailed())
+                    break;
+                frame.fileName = frameName(input, frame.index);
+                spawn(frame);
+                frame.position++;
+            }
+        }
+        state->close(frame.position);
+        groups[0].wait();
+        groups[1].wait();
+    }
+
+private:
+    void spawn(const Frame& frame)
+    {
+        FrameTask *task = new FrameTask(state, pipeline, raw, output, frame);
+        if (Scheduler::threadCount() == 1) {
+            task->run();
+            delete task;
+            return;
+        }
+        groups[current].spawn(task);
+        if (++count == window) {
+            current ^= 1;
+            groups[current].wait();
+            count = 0;
+        }
+    }
+
+    SequenceState *state;
+    const Pipeline& pipeline;
+    RawFormat raw;
+    QString input;
+    QString output;
+    TaskGroup groups[2];
+    int window;
+    int current;
+    int count;
+};
+
+}
+
+bool Sequence::run(const QString& input, const QString& output)
+{
+    bool fromStdin = input == "-";
+    bool toStdout = output == "-";
+
+    if ((fromStdin || toStdout) && raw.layout == RawFormat::None) {
+        qWarning("A raw frame format is needed for stdin and stdout");
+        return false;
+    }
+    if (fromStdin && (raw.width <= 0 || raw.height <= 0)) {
+        qWarning("Frame size is needed for stdin");
+        return false;
+    }
+    if ((!fromStdin && !input.contains('%')) || (!toStdout && !output.contains('%'))) {
+        qWarning("Frame files are given by a pattern such as frame%%04d.png");
+        return false;
+    }
+
+#ifdef Q_OS_WIN
+    if (fromStdin)
+        _setmode(_fileno(stdin), _O_BINARY);
+    if (toStdout)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    int window = Scheduler::threadCount() * SEQUENCE_FRAMES_PER_THREAD;
+    SequenceState state(window);
+    FrameReader reader(&state, pipeline, raw, input, output, window);
+    QByteArray data;
+    int i;
+
+    reader.start();
+
+    // frames go to stdout in input order, whichever task finishes first
+    if (toStdout) {
+        for (i = 0; state.take(i, data); i++) {
+            ScopedTimer timer("write frame");
+            if (fwrite(data.constData(), 1, data.size(), stdout) != size_t(data.size())) {
+                qWarning("Cannot write frame %d to stdout", i);
+                state.fail();
+                break;
+            }
+            state.available.release();
+        }
+        fflush(stdout);
+    }
+
+    reader.wait();
+
+    frames = qMax(0, state.count());
+    return !state.hasFailed();
+}
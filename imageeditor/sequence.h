@@ -0,0 +1,60 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QString>
+
+#include "pipeline.h"
+
+// frames read but not yet written, per scheduler thread
+const int SEQUENCE_FRAMES_PER_THREAD = 2;
+
+// Layout of headerless frames on a pipe. YUV420P is planar I420 with
+// BT.601 limited range; RGB24 is packed R, G, B; BGRA is the byte order of
+// a little-endian QImage::Format_RGB32 scan line.
+struct RawFormat {
+    enum Layout {
+        None,
+        RGB24,
+        BGRA,
+        YUV420P
+    };
+
+    Layout layout;
+    int width, height;
+
+    RawFormat() : layout(None), width(0), height(0) {}
+
+    bool parse(const QString& name);
+    int frameSize() const;
+    QImage toImage(const QByteArray& frame) const;
+    QByteArray fromImage(const QImage& image) const;
+};
+
+// Runs a pipeline over every frame of a sequence. The input is either a
+// file name pattern with a printf-style number (frames are numbered from 0
+// or 1 up to the first missing file) or "-" for raw frames on stdin; the
+// output is a pattern or "-" for raw frames on stdout, in input order.
+//
+// One thread reads, scheduler tasks decode, process and encode whole
+// frames, and at most SEQUENCE_FRAMES_PER_THREAD frames per scheduler
+// thread are in flight, so memory use does not grow with the length of
+// the sequence.
+class Sequence {
+public:
+    Sequence(const Pipeline& pipeline) : pipeline(pipeline), frames(0) {}
+
+    // required for "-"; stdin also needs the frame size
+    void setRawFormat(const RawFormat& format) { raw = format; }
+
+    bool run(const QString& input, const QString& output);
+    int frameCount() const { return frames; }
+
+private:
+    const Pipeline& pipeline;
+    RawFormat raw;
+    int frames;
+};
+
+#endif // SEQUENCE_H
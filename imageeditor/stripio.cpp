@@ -0,0 +1,511 @@
+#include <QFile>
+#include <QFileInfo>
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+
+#include <png.h>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+#include "stripio.h"
+
+static FILE* openFile(const QString& fileName, const char *mode)
+{
+    FILE *file = fopen(QFile::encodeName(fileName).constData(), mode);
+    if (!file)
+        qWarning("Cannot open %s", qPrintable(fileName));
+    return file;
+}
+
+// libpng and libjpeg report fatal errors by longjmp; every function that
+// calls into them sets its own jump target and only keeps plain data on
+// the stack.
+
+class PngStripReader : public StripReader {
+public:
+    PngStripReader() : file(0), png(0), info(0) {}
+    ~PngStripReader();
+
+    bool open(const QString& fileName);
+    bool read(QImage& strip, int rows);
+
+private:
+    FILE *file;
+    png_structp png;
+    png_infop info;
+    int y;
+};
+
+PngStripReader::~PngStripReader()
+{
+    if (png)
+        png_destroy_read_struct(&png, info ? &info : 0, 0);
+    if (file)
+        fclose(file);
+}
+
+bool PngStripReader::open(const QString& fileName)
+{
+    png_uint_32 width, height;
+    int depth, type, interlace;
+
+    if (!(file = openFile(fileName, "rb")))
+        return false;
+
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+    if (!png)
+        return false;
+    info = png_create_info_struct(png);
+    if (!info)
+        return false;
+
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    png_init_io(png, file);
+    png_read_info(png, info);
+    png_get_IHDR(png, info, &width, &height, &depth, &type, &interlace, 0, 0);
+
+    // interlaced files cannot be decoded row by row
+    if (interlace != PNG_INTERLACE_NONE)
+        return false;
+
+    alpha = (type & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS);
+
+    if (type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png);
+    if (type == PNG_COLOR_TYPE_GRAY && depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png);
+    if (png_get_valid(png, info, PNG_INFO_tRNS))
+        png_set_tRNS_to_alpha(png);
+    if (depth == 16)
+        png_set_strip_16(png);
+    if (!(type & PNG_COLOR_MASK_COLOR))
+        png_set_gray_to_rgb(png);
+
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    png_set_bgr(png);
+    if (!alpha)
+        png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+#else
+    if (alpha)
+        png_set_swap_alpha(png);
+    else
+        png_set_filler(png, 0xff, PNG_FILLER_BEFORE);
+#endif
+
+    png_read_update_info(png, info);
+
+    w = width;
+    h = height;
+    y = 0;
+    return true;
+}
+
+bool PngStripReader::read(QImage& strip, int rows)
+{
+    if (rows > h - y)
+        rows = h - y;
+    strip = QImage(w, rows, alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    for (int i = 0; i < rows; i++)
+        png_read_row(png, strip.scanLine(i), 0);
+    y += rows;
+
+    return true;
+}
+
+struct JpegError {
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr info)
+{
+    char message[JMSG_LENGTH_MAX];
+
+    (*info->err->format_message)(info, message);
+    qWarning("%s", message);
+    longjmp(((JpegError*)info->err)->jump, 1);
+}
+
+class JpegStripReader : public StripReader {
+public:
+    JpegStripReader() : file(0), created(false) {}
+    ~JpegStripReader();
+
+    bool open(const QString& fileName);
+    bool read(QImage& strip, int rows);
+
+private:
+    FILE *file;
+    bool created;
+    jpeg_decompress_struct cinfo;
+    JpegError error;
+    QVector<JSAMPLE> buffer;
+    int y;
+};
+
+JpegStripReader::~JpegStripReader()
+{
+    if (created)
+        jpeg_destroy_decompress(&cinfo);
+    if (file)
+        fclose(file);
+}
+
+bool JpegStripReader::open(const QString& fileName)
+{
+    if (!(file = openFile(fileName, "rb")))
+        return false;
+
+    cinfo.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = jpegErrorExit;
+    if (setjmp(error.jump))
+        return false;
+
+    jpeg_create_decompress(&cinfo);
+    created = true;
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // libjpeg does not convert CMYK to RGB
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+        return false;
+
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    w = cinfo.output_width;
+    h = cinfo.output_height;
+    alpha = false;
+    y = 0;
+    buffer.resize(3 * w);
+    return true;
+}
+
+bool JpegStripReader::read(QImage& strip, int rows)
+{
+    JSAMPROW row = buffer.data();
+    const JSAMPLE *p;
+    QRgb *line;
+
+    if (rows > h - y)
+        rows = h - y;
+    strip = QImage(w, rows, QImage::Format_RGB32);
+
+    if (setjmp(error.jump))
+        return false;
+
+    for (int i = 0; i < rows; i++) {
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        line = (QRgb*)strip.scanLine(i);
+        p = row;
+        for (int x = 0; x < w; x++, p += 3)
+            line[x] = qRgb(p[0], p[1], p[2]);
+    }
+    y += rows;
+
+    return true;
+}
+
+class QImageStripReader : public StripReader {
+public:
+    bool open(const QString& fileName);
+    bool read(QImage& strip, int rows);
+
+private:
+    QImage image;
+    int y;
+};
+
+bool QImageStripReader::open(const QString& fileName)
+{
+    if (!image.load(fileName)) {
+        qWarning("Cannot load %s", qPrintable(fileName));
+        return false;
+    }
+
+    alpha = image.hasAlphaChannel();
+    image = image.convertToFormat(alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    w = image.width();
+    h = image.height();
+    y = 0;
+    return true;
+}
+
+bool QImageStripReader::read(QImage& strip, int rows)
+{
+    if (rows > h - y)
+        rows = h - y;
+    strip = image.copy(0, y, w, rows);
+    y += rows;
+
+    // the last strip releases the decoded file
+    if (y == h)
+        image = QImage();
+
+    return true;
+}
+
+StripReader* StripReader::create(const QString& fileName)
+{
+    StripReader *reader = 0;
+    unsigned char magic[8];
+    size_t size = 0;
+    FILE *file;
+
+    if (!(file = openFile(fileName, "rb")))
+        return 0;
+    size = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+
+    if (size == sizeof(magic) && !png_sig_cmp(magic, 0, sizeof(magic)))
+        reader = new PngStripReader;
+    else if (size >= 2 && magic[0] == 0xff && magic[1] == 0xd8)
+        reader = new JpegStripReader;
+
+    if (reader && reader->open(fileName))
+        return reader;
+    delete reader;
+
+    reader = new QImageStripReader;
+    if (reader->open(fileName))
+        return reader;
+    delete reader;
+
+    return 0;
+}
+
+class PngStripWriter : public StripWriter {
+public:
+    PngStripWriter() : file(0), png(0), info(0) {}
+    ~PngStripWriter();
+
+    bool open(const QString& fileName, int width, int height, bool hasAlpha);
+    bool write(const QImage& strip);
+    bool finish();
+
+private:
+    FILE *file;
+    png_structp png;
+    png_infop info;
+};
+
+PngStripWriter::~PngStripWriter()
+{
+    if (png)
+        png_destroy_write_struct(&png, info ? &info : 0);
+    if (file)
+        fclose(file);
+}
+
+bool PngStripWriter::open(const QString& fileName, int width, int height, bool hasAlpha)
+{
+    if (!(file = openFile(fileName, "wb")))
+        return false;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+    if (!png)
+        return false;
+    info = png_create_info_struct(png);
+    if (!info)
+        return false;
+
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    png_init_io(png, file);
+    png_set_IHDR(png, info, width, height, 8, hasAlpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    png_set_bgr(png);
+    if (!hasAlpha)
+        png_set_filler(png, 0, PNG_FILLER_AFTER);
+#else
+    if (hasAlpha)
+        png_set_swap_alpha(png);
+    else
+        png_set_filler(png, 0, PNG_FILLER_BEFORE);
+#endif
+
+    return true;
+}
+
+bool PngStripWriter::write(const QImage& strip)
+{
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    for (int i = 0; i < strip.height(); i++)
+        png_write_row(png, (png_bytep)strip.constScanLine(i));
+
+    return true;
+}
+
+bool PngStripWriter::finish()
+{
+    if (setjmp(png_jmpbuf(png)))
+        return false;
+
+    png_write_end(png, info);
+    png_destroy_write_struct(&png, &info);
+    png = 0;
+    info = 0;
+
+    if (fclose(file)) {
+        file = 0;
+        qWarning("Cannot write PNG file");
+        return false;
+    }
+    file = 0;
+    return true;
+}
+
+class JpegStripWriter : public StripWriter {
+public:
+    JpegStripWriter() : file(0), created(false) {}
+    ~JpegStripWriter();
+
+    bool open(const QString& fileName, int width, int height, bool hasAlpha);
+    bool write(const QImage& strip);
+    bool finish();
+
+private:
+    FILE *file;
+    bool created;
+    jpeg_compress_struct cinfo;
+    JpegError error;
+    QVector<JSAMPLE> buffer;
+};
+
+JpegStripWriter::~JpegStripWriter()
+{
+    if (created)
+        jpeg_destroy_compress(&cinfo);
+    if (file)
+        fclose(file);
+}
+
+bool JpegStripWriter::open(const QString& fileName, int width, int height, bool)
+{
+    if (!(file = openFile(fileName, "wb")))
+        return false;
+
+    cinfo.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = jpegErrorExit;
+    if (setjmp(error.jump))
+        return false;
+
+    jpeg_create_compress(&cinfo);
+    created = true;
+    jpeg_stdio_dest(&cinfo, file);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, JPEG_DEFAULT_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    buffer.resize(3 * width);
+    return true;
+}
+
+bool JpegStripWriter::write(const QImage& strip)
+{
+    JSAMPROW row = buffer.data();
+    const QRgb *line;
+    JSAMPLE *p;
+
+    if (setjmp(error.jump))
+        return false;
+
+    for (int i = 0; i < strip.height(); i++) {
+        line = (const QRgb*)strip.constScanLine(i);
+        p = row;
+        for (int x = 0; x < strip.width(); x++, p += 3) {
+            p[0] = qRed(line[x]);
+            p[1] = qGreen(line[x]);
+            p[2] = qBlue(line[x]);
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    return true;
+}
+
+bool JpegStripWriter::finish()
+{
+    if (setjmp(error.jump))
+        return false;
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    created = false;
+
+    if (fclose(file)) {
+        file = 0;
+        qWarning("Cannot write JPEG file");
+        return false;
+    }
+    file = 0;
+    return true;
+}
+
+class QImageStripWriter : public StripWriter {
+public:
+    bool open(const QString& fileName, int width, int height, bool hasAlpha);
+    bool write(const QImage& strip);
+    bool finish();
+
+private:
+    QString name;
+    QImage image;
+    int y;
+};
+
+bool QImageStripWriter::open(const QString& fileName, int width, int height, bool hasAlpha)
+{
+    name = fileName;
+    image = QImage(width, height, hasAlpha ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    y = 0;
+    return !image.isNull();
+}
+
+bool QImageStripWriter::write(const QImage& strip)
+{
+    for (int i = 0; i < strip.height(); i++, y++)
+        memcpy(image.scanLine(y), strip.constScanLine(i), image.width() * sizeof(QRgb));
+    return true;
+}
+
+bool QImageStripWriter::finish()
+{
+    if (!image.save(name)) {
+        qWarning("Cannot save %s", qPrintable(name));
+        return false;
+    }
+    return true;
+}
+
+StripWriter* StripWriter::create(const QString& fileName)
+{
+    QString suffix = QFileInfo(fileName).suffix().toLower();
+
+    if (suffix == "png")
+        return new PngStripWriter;
+    if (suffix == "jpg" || suffix == "jpeg")
+        return new JpegStripWriter;
+    return new QImageStripWriter;
+}
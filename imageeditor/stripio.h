@@ -0,0 +1,44 @@
+#ifndef STRIPIO_H
+#define STRIPIO_H
+
+#include <QImage>
+#include <QString>
+
+const int JPEG_DEFAULT_QUALITY = 90;
+
+// Sequential row access to an image file. Strips are returned as RGB32 or
+// ARGB32 images, top to bottom. create() returns an opened reader or 0;
+// files libpng/libjpeg cannot stream (interlaced PNG, CMYK JPEG, other
+// formats) fall back to decoding the whole file with QImage.
+class StripReader {
+public:
+    virtual ~StripReader() {}
+
+    int width() const { return w; }
+    int height() const { return h; }
+    bool hasAlpha() const { return alpha; }
+
+    virtual bool open(const QString& fileName) = 0;
+    virtual bool read(QImage& strip, int rows) = 0;
+
+    static StripReader* create(const QString& fileName);
+
+protected:
+    int w, h;
+    bool alpha;
+};
+
+// PNG and JPEG are encoded row by row, other formats are collected and
+// saved with QImage by finish().
+class StripWriter {
+public:
+    virtual ~StripWriter() {}
+
+    virtual bool open(const QString& fileName, int width, int height, bool hasAlpha) = 0;
+    virtual bool write(const QImage& strip) = 0;
+    virtual bool finish() = 0;
+
+    static StripWriter* create(const QString& fileName);
+};
+
+#endif // STRIPIO_H
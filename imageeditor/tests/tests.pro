@@ -0,0 +1,35 @@
+QT       += testlib
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TARGET = tst_imageeditor
+
+INCLUDEPATH += ..
+DEFINES += GOLDEN_DIR=\\\"$$PWD/golden\\\"
+
+SOURCES += \
+    tst_imageeditor.cpp \
+    ../logic.cpp \
+    ../colorlut.cpp \
+    ../pipeline.cpp \
+    ../planarimage.cpp \
+    ../pyramid.cpp \
+    ../profiler.cpp \
+    ../scratch.cpp \
+    ../stripio.cpp \
+    ../utils.cpp
+
+HEADERS += \
+    ../logic.h \
+    ../colorlut.h \
+    ../pipeline.h \
+    ../planarimage.h \
+    ../pyramid.h \
+    ../profiler.h \
+    ../scratch.h \
+    ../stripio.h \
+    ../utils.h
+
+LIBS += -lpng -ljpeg
+
+include(../../common/common.pri)
@@ -0,0 +1,421 @@
+#include <QtTest>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTextStream>
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "logic.h"
+#include "pipeline.h"
+#include "planarimage.h"
+#include "utils.h"
+
+// Golden images and the throughput baseline live in GOLDEN_DIR. Run with
+// GOLDEN_RECORD=1 to (re)write them from the current build, on the machine
+// the baseline should describe. PNG files in GOLDEN_DIR/inputs are used as
+// sample inputs next to the synthetic ones. The baseline describes one
+// machine, so the throughput checks only run with GOLDEN_PERF=1.
+const double THROUGHPUT_FLOOR = 0.8;
+const int THROUGHPUT_WIDTH = 1600;
+const int THROUGHPUT_HEIGHT = 1200;
+const int THROUGHPUT_ITERATIONS = 3;
+// a measurement repeats the operation until this much time has passed
+const qint64 THROUGHPUT_MIN_NSECS = 200000000;
+
+struct GoldenOperation {
+    const char *name;
+    void (*run)(ImageLogic& image);
+    // largest channel difference and mean channel difference allowed
+    int maxDiff;
+    double meanDiff;
+};
+
+static void linearCorrection(ImageLogic& image) { image.linearCorrection(); }
+static void linearHSVCorrection(ImageLogic& image) { image.linearHSVCorrection(); }
+static void channelCorrection(ImageLogic& image) { image.channelCorrection(); }
+static void greyWorld(ImageLogic& image) { image.greyWorld(); }
+static void clahe(ImageLogic& image) { image.clahe(4, 4, 3.0); }
+static void gaussianBlur(ImageLogic& image) { image.gaussianBlur(1.5); }
+static void largeGaussianBlur(ImageLogic& image) { image.gaussianBlur(12.0); }
+static void fastGaussianBlur(ImageLogic& image) { image.fastGaussianBlur(2.0); }
+static void unsharpMask(ImageLogic& image) { image.unsharpMask(1.5); }
+static void largeUnsharpMask(ImageLogic& image) { image.unsharpMask(1.0, 20.0); }
+static void glassEffect(ImageLogic& image) { srand(1); image.glassEffect(5); }
+static void wavesEffect(ImageLogic& image) { image.wavesEffect(20.0, 5.0); }
+static void medianFilter(ImageLogic& image) { image.medianFilter(2); }
+static void erosion(ImageLogic& image) { image.erosion(3, 1); }
+static void dilation(ImageLogic& image) { image.dilation(1, 3); }
+static void opening(ImageLogic& image) { image.opening(2, 2); }
+static void closing(ImageLogic& image) { image.closing(2, 2); }
+static void scaling(ImageLogic& image) { image.scaling(0.7); }
+static void rotate(ImageLogic& image) { image.rotate(0.3); }
+static void shearRotate(ImageLogic& image) { image.rotate(2.0, ImageLogic::ThreeShear); }
+static void rotate90(ImageLogic& image) { image.rotate(M_PI / 2); }
+static void flipHorizontal(ImageLogic& image) { image.flipHorizontal(); }
+static void flipVertical(ImageLogic& image) { image.flipVertical(); }
+
+static void userFilter(ImageLogic& image)
+{
+    Kernel ker(3, 5);
+    for (int i = 0; i < ker.height; i++)
+        for (int j = 0; j < ker.width; j++)
+            ker.kernel[i][j] = i + j + 1;
+    ker.normalize();
+    image.userFilter(ker);
+}
+
+static void colorLUT(ImageLogic& image)
+{
+    QVector<ImageLogic::PointOperation> ops;
+    ops << ImageLogic::ChannelCorrection << ImageLogic::GreyWorld;
+    image.applyColorLUT(image.bakeColorLUT(ops));
+}
+
+// the LUT the editor collects while the corrections are applied
+static void gradedLUT(ImageLogic& image)
+{
+    ImageLogic graded(image);
+    ColorLUT lut;
+    graded.pointOperation(ImageLogic::ChannelCorrection, &lut);
+    graded.pointOperation(ImageLogic::GreyWorld, &lut);
+    image.applyColorLUT(lut);
+}
+
+static void planarGaussianBlur(ImageLogic& image)
+{
+    PlanarImage planar(image);
+    planar.gaussianBlur(1.5);
+    image = ImageLogic(planar.toImage());
+}
+
+static const GoldenOperation operations[] = {
+    { "linearCorrection", linearCorrection, 0, 0.0 },
+    { "linearHSVCorrection", linearHSVCorrection, 0, 0.0 },
+    { "channelCorrection", channelCorrection, 0, 0.0 },
+    { "greyWorld", greyWorld, 0, 0.0 },
+    { "clahe", clahe, 1, 0.05 },
+    { "gaussianBlur", gaussianBlur, 1, 0.05 },
+    { "largeGaussianBlur", largeGaussianBlur, 1, 0.05 },
+    { "fastGaussianBlur", fastGaussianBlur, 1, 0.05 },
+    { "unsharpMask", unsharpMask, 1, 0.05 },
+    { "largeUnsharpMask", largeUnsharpMask, 1, 0.05 },
+    { "glassEffect", glassEffect, 0, 0.0 },
+    { "wavesEffect", wavesEffect, 1, 0.05 },
+    { "medianFilter", medianFilter, 0, 0.0 },
+    { "erosion", erosion, 0, 0.0 },
+    { "dilation", dilation, 0, 0.0 },
+    { "opening", opening, 0, 0.0 },
+    { "closing", closing, 0, 0.0 },
+    { "userFilter", userFilter, 1, 0.05 },
+    { "colorLUT", colorLUT, 1, 0.05 },
+    { "gradedLUT", gradedLUT, 1, 0.05 },
+    { "scaling", scaling, 1, 0.05 },
+    { "rotate", rotate, 1, 0.05 },
+    { "shearRotate", shearRotate, 1, 0.05 },
+    { "rotate90", rotate90, 0, 0.0 },
+    { "flipHorizontal", flipHorizontal, 0, 0.0 },
+    { "flipVertical", flipVertical, 0, 0.0 },
+    { "planarGaussianBlur", planarGaussianBlur, 1, 0.05 }
+};
+
+static const int operationCount = sizeof(operations) / sizeof(operations[0]);
+
+// Fixed pseudo-random noise, independent of the C library.
+static uint noise(uint x, uint y)
+{
+    uint h = x * 374761393u + y * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return h ^ (h >> 16);
+}
+
+static QImage gradientImage(int width, int height)
+{
+    QImage image(width, height, QImage::Format_RGB32);
+    for (int y = 0; y < height; y++) {
+        QRgb *line = (QRgb*)image.scanLine(y);
+        for (int x = 0; x < width; x++) {
+            int n = noise(x, y) % 24;
+            line[x] = qRgb(qMin(255, 20 + x * 200 / width + n),
+                           qMin(255, 40 + y * 160 / height + n),
+                           qMin(255, 30 + (x + y) * 90 / (width + height) + n));
+        }
+    }
+    return image;
+}
+
+// hard edges, thin lines and a translucent alpha ramp
+static QImage shapesImage(int width, int height)
+{
+    QImage image(width, height, QImage::Format_ARGB32);
+    for (int y = 0; y < height; y++) {
+        QRgb *line = (QRgb*)image.scanLine(y);
+        for (int x = 0; x < width; x++) {
+            bool checker = ((x / 16) + (y / 16)) % 2;
+            bool stripe = x % 23 == 0 || y % 29 == 0;
+            int v = stripe ? 250 : checker ? 180 : 60;
+            line[x] = qRgba(v, (v + x) & 255, 255 - v, 128 + 127 * x / width);
+        }
+    }
+    return image;
+}
+
+struct GoldenInput {
+    QString name;
+    QImage image;
+    bool lasso;
+};
+
+class TestImageEditor : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void golden_data();
+    void golden();
+    void throughput_data();
+    void throughput();
+    void strips_data();
+    void strips();
+    void cleanupTestCase();
+
+private:
+    bool record;
+    bool checkPerf;
+    QDir dir;
+    QList<GoldenInput> inputs;
+    QMap<QString, double> baseline;
+    QMap<QString, double> measured;
+};
+
+void TestImageEditor::initTestCase()
+{
+    record = qgetenv("GOLDEN_RECORD") == "1";
+    checkPerf = qgetenv("GOLDEN_PERF") == "1";
+    dir = QDir(GOLDEN_DIR);
+    if (record)
+        dir.mkpath(".");
+
+    GoldenInput input;
+    input.lasso = false;
+    input.name = "gradient";
+    input.image = gradientImage(173, 131);
+    inputs << input;
+    input.name = "shapes";
+    input.image = shapesImage(160, 120);
+    inputs << input;
+    input.name = "gradient_lasso";
+    input.image = gradientImage(173, 131);
+    input.lasso = true;
+    inputs << input;
+
+    QDir sampleDir(dir.filePath("inputs"));
+    QStringList samples = sampleDir.entryList(QStringList() << "*.png", QDir::Files, QDir::Name);
+    for (int i = 0; i < samples.size(); i++) {
+        input.name = QFileInfo(samples[i]).baseName();
+        input.image = QImage(sampleDir.filePath(samples[i]));
+        input.lasso = false;
+        if (!input.image.isNull())
+            inputs << input;
+    }
+
+    QFile file(dir.filePath("baseline.txt"));
+    if (!record && file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        QTextStream in(&file);
+        QString name;
+        double rate;
+        while (!in.atEnd()) {
+            in >> name >> rate;
+            if (!name.isEmpty())
+                baseline[name] = rate;
+        }
+    }
+}
+
+void TestImageEditor::golden_data()
+{
+    QTest::addColumn<int>("operation");
+    QTest::addColumn<int>("input");
+
+    for (int i = 0; i < inputs.size(); i++) {
+        for (int j = 0; j < operationCount; j++) {
+            QString tag = inputs[i].name + "_" + operations[j].name;
+            QTest::newRow(qPrintable(tag)) << j << i;
+        }
+    }
+}
+
+void TestImageEditor::golden()
+{
+    QFETCH(int, operation);
+    QFETCH(int, input);
+    const GoldenOperation& op = operations[operation];
+    const GoldenInput& in = inputs[input];
+    QString fileName = dir.filePath(in.name + "_" + op.name + ".png");
+
+    ImageLogic image(in.image);
+    if (in.lasso) {
+        QPolygon polygon;
+        polygon << QPoint(10, 12) << QPoint(150, 30) << QPoint(120, 120) << QPoint(30, 90);
+        image.setSelection(polygon);
+    }
+    op.run(image);
+
+    if (record) {
+        QVERIFY2(image.save(fileName, "PNG"), qPrintable(fileName));
+        return;
+    }
+
+    QImage expected(fileName);
+    if (expected.isNull())
+        QFAIL(qPrintable(QString("missing %1, run with GOLDEN_RECORD=1").arg(fileName)));
+    expected = expected.convertToFormat(image.format());
+    QCOMPARE(image.size(), expected.size());
+
+    int maxDiff = 0;
+    double sum = 0;
+    for (int y = 0; y < image.height(); y++) {
+        const QRgb *a = (const QRgb*)image.constScanLine(y);
+        const QRgb *b = (const QRgb*)expected.constScanLine(y);
+        for (int x = 0; x < image.width(); x++) {
+            int d[4] = { qAbs(qRed(a[x]) - qRed(b[x])), qAbs(qGreen(a[x]) - qGreen(b[x])),
+                         qAbs(qBlue(a[x]) - qBlue(b[x])), qAbs(qAlpha(a[x]) - qAlpha(b[x])) };
+            for (int c = 0; c < 4; c++) {
+                maxDiff = qMax(maxDiff, d[c]);
+                sum += d[c];
+            }
+        }
+    }
+    double meanDiff = sum / (4.0 * image.width() * image.height());
+
+    QVERIFY2(maxDiff <= op.maxDiff && meanDiff <= op.meanDiff,
+             qPrintable(QString("max difference %1 (allowed %2), mean %3 (allowed %4)")
+                        .arg(maxDiff).arg(op.maxDiff).arg(meanDiff, 0, 'f', 4).arg(op.meanDiff)));
+}
+
+void TestImageEditor::throughput_data()
+{
+    QTest::addColumn<int>("operation");
+
+    for (int j = 0; j < operationCount; j++)
+        QTest::newRow(operations[j].name) << j;
+}
+
+// Best of a few measurements in megapixels per second, compared with the
+// recorded baseline. Only the operation itself is timed.
+void TestImageEditor::throughput()
+{
+    QFETCH(int, operation);
+    const GoldenOperation& op = operations[operation];
+
+    if (!checkPerf && !record)
+        QSKIP("throughput is only checked with GOLDEN_PERF=1", SkipAll);
+
+    QImage source = gradientImage(THROUGHPUT_WIDTH, THROUGHPUT_HEIGHT);
+    double pixels = double(THROUGHPUT_WIDTH) * THROUGHPUT_HEIGHT / 1e6;
+    double rate = 0;
+    QElapsedTimer timer;
+
+    // an untimed run first, so that caches and the scratch pool are warm
+    ImageLogic warmup(source);
+    op.run(warmup);
+
+    for (int i = 0; i < THROUGHPUT_ITERATIONS; i++) {
+        qint64 elapsed = 0;
+        int runs = 0;
+        while (elapsed < THROUGHPUT_MIN_NSECS) {
+            ImageLogic image(source);
+            timer.start();
+            op.run(image);
+            elapsed += timer.nsecsElapsed();
+            runs++;
+        }
+        rate = qMax(rate, pixels * runs * 1e9 / elapsed);
+    }
+
+    measured[op.name] = rate;
+    if (record)
+        return;
+
+    if (!baseline.contains(op.name))
+        QFAIL("no throughput baseline, run with GOLDEN_RECORD=1");
+    QVERIFY2(rate >= baseline[op.name] * THROUGHPUT_FLOOR,
+             qPrintable(QString("%1 Mpx/s, baseline %2 Mpx/s")
+                        .arg(rate, 0, 'f', 1).arg(baseline[op.name], 0, 'f', 1)));
+}
+
+void TestImageEditor::strips_data()
+{
+    QTest::addColumn<QString>("steps");
+    QTest::addColumn<bool>("planar");
+
+    const char *pipelines[] = {
+        "gaussian:1.5", "fastgaussian:3", "sharpen:1.5", "median:2", "opening:2,3",
+        "gaussian:1|closing:1|fastgaussian:2", "gaussian:10", "fastgaussian:12",
+        "sharpen:1|gaussian:9", "clahe"
+    };
+    for (unsigned i = 0; i < sizeof(pipelines) / sizeof(pipelines[0]); i++) {
+        QTest::newRow(qPrintable(QString(pipelines[i]))) << QString(pipelines[i]) << false;
+        QTest::newRow(qPrintable(QString(pipelines[i]) + " planar")) << QString(pipelines[i]) << true;
+    }
+}
+
+// A file streamed in strips comes out as the whole image would.
+void TestImageEditor::strips()
+{
+    QFETCH(QString, steps);
+    QFETCH(bool, planar);
+    QStringList specs = steps.split('|');
+    QString input = QDir::temp().filePath("tst_imageeditor_strips_in.png");
+    QString output = QDir::temp().filePath("tst_imageeditor_strips_out.png");
+    QImage source = gradientImage(97, 213);
+    Pipeline pipeline;
+
+    for (int i = 0; i < specs.size(); i++)
+        QVERIFY(pipeline.addStep(specs[i]));
+    pipeline.setPlanar(planar);
+
+    QImage expected;
+    if (planar) {
+        PlanarImage image(source);
+        pipeline.apply(image);
+        expected = image.toImage();
+    } else {
+        ImageLogic image(source);
+        pipeline.apply(image);
+        expected = image;
+    }
+
+    QVERIFY(source.save(input, "PNG"));
+    QVERIFY(pipeline.run(input, output, 16));
+    QImage result(output);
+    QFile::remove(input);
+    QFile::remove(output);
+
+    QVERIFY(!result.isNull());
+    QCOMPARE(result.size(), expected.size());
+    result = result.convertToFormat(expected.format());
+    for (int y = 0; y < result.height(); y++) {
+        if (memcmp(result.constScanLine(y), expected.constScanLine(y), result.width() * sizeof(QRgb)) != 0)
+            QFAIL(qPrintable(QString("row %1 differs").arg(y)));
+    }
+}
+
+void TestImageEditor::cleanupTestCase()
+{
+    if (!record || measured.isEmpty())
+        return;
+
+    QFile file(dir.filePath("baseline.txt"));
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Text));
+    QTextStream out(&file);
+    QMap<QString, double>::const_iterator i;
+    for (i = measured.constBegin(); i != measured.constEnd(); ++i)
+        out << i.key() << " " << QString::number(i.value(), 'f', 2) << "\n";
+}
+
+QTEST_MAIN(TestImageEditor)
+#include "tst_imageeditor.moc"
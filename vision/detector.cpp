@@ -0,0 +1,603 @@
+#include <cmath>
+#include <cassert>
+#include <climits>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "detector.h"
+#include "parallel.h"
+#include "liblinear-1.8/linear.h"
+
+// grows v to size without giving memory back when it shrinks
+template <class T>
+static void fit(QVector<T>& v, qint64 size)
+{
+    assert(size * qint64(sizeof(T)) < INT_MAX);
+    if (v.capacity() < size)
+        v.reserve(size);
+    v.resize(size);
+}
+
+template <class T>
+static qint64 bytes(const QVector<T>& v)
+{
+    return qint64(v.capacity()) * sizeof(T);
+}
+
+static int angleBin(double gx, double gy)
+{
+    double angle = atan2(gy, gx) + PI;
+    double coef = HOG_SIZE / (2 * PI);
+    int k;
+
+    if (angle > 2 * PI) {
+        angle -= EPS;
+    }
+    k = (int)(angle * coef);
+    assert(k >= 0 && k < HOG_SIZE);
+    return k;
+}
+
+// Bins without atan2: inside a quadrant |gy| is compared with |gx| times the
+// tangents of the bin boundaries. Gradients on an axis take the bins the
+// formula gives there, and those within a relative SECTOR_MARGIN of a
+// boundary use the formula, so the bins are exactly those of angleBin.
+// HOG_SIZE must be a multiple of 4.
+const double SECTOR_MARGIN = 1e-9;
+
+struct Sectors {
+    double tangents[HOG_SIZE / 4 - 1];
+    int zero, right, left, up, down;
+
+    Sectors()
+    {
+        for (int i = 0; i < HOG_SIZE / 4 - 1; i++)
+            tangents[i] = tan((i + 1) * 2 * PI / HOG_SIZE);
+        zero = angleBin(0, 0);
+        right = angleBin(1, 0);
+        left = angleBin(-1, 0);
+        up = angleBin(0, 1);
+        down = angleBin(0, -1);
+    }
+
+    int bin(double gx, double gy) const
+    {
+        double a = fabs(gx), b = fabs(gy);
+        double margin = SECTOR_MARGIN * (a + b);
+        int o = 0;
+
+        if (gy == 0)
+            return gx == 0 ? zero : (gx > 0 ? right : left);
+        if (gx == 0)
+            return gy > 0 ? up : down;
+        if (a <= margin || b <= margin)
+            return angleBin(gx, gy);
+        for (int i = 0; i < HOG_SIZE / 4 - 1; i++) {
+            if (fabs(b - a * tangents[i]) <= margin)
+                return angleBin(gx, gy);
+            o += b > a * tangents[i];
+        }
+        if ((gx < 0) != (gy < 0))
+            o = HOG_SIZE / 2 - 1 - o;
+        return gy < 0 ? o : o + HOG_SIZE / 2;
+    }
+
+    void binRow(const double *gx, const double *gy, int len, uchar *bins) const
+    {
+        int x = 0;
+#ifdef __SSE2__
+        const __m128d sign = _mm_set1_pd(-0.0);
+        const __m128d zero = _mm_setzero_pd();
+        const __m128i half = _mm_set_epi32(0, HOG_SIZE / 2, 0, HOG_SIZE / 2);
+        const __m128i last = _mm_set_epi32(0, HOG_SIZE / 2 - 1, 0, HOG_SIZE / 2 - 1);
+        for (; x + 2 <= len; x += 2) {
+            __m128d dx = _mm_loadu_pd(gx + x), dy = _mm_loadu_pd(gy + x);
+            __m128d a = _mm_andnot_pd(sign, dx), b = _mm_andnot_pd(sign, dy);
+            __m128d margin = _mm_mul_pd(_mm_set1_pd(SECTOR_MARGIN), _mm_add_pd(a, b));
+            __m128d slow = _mm_or_pd(_mm_cmple_pd(a, margin), _mm_cmple_pd(b, margin));
+            __m128i o = _mm_setzero_si128();
+            for (int i = 0; i < HOG_SIZE / 4 - 1; i++) {
+                __m128d t = _mm_mul_pd(a, _mm_set1_pd(tangents[i]));
+                slow = _mm_or_pd(slow, _mm_cmple_pd(_mm_andnot_pd(sign, _mm_sub_pd(b, t)), margin));
+                o = _mm_sub_epi64(o, _mm_castpd_si128(_mm_cmpgt_pd(b, t)));
+            }
+            __m128i down = _mm_castpd_si128(_mm_cmplt_pd(dy, zero));
+            __m128i flip = _mm_xor_si128(_mm_castpd_si128(_mm_cmplt_pd(dx, zero)), down);
+            o = _mm_add_epi64(_mm_sub_epi64(_mm_xor_si128(o, flip), flip), _mm_and_si128(flip, last));
+            o = _mm_add_epi64(o, _mm_andnot_si128(down, half));
+            bins[x] = _mm_cvtsi128_si32(o);
+            bins[x + 1] = _mm_cvtsi128_si32(_mm_srli_si128(o, 8));
+            int mask = _mm_movemask_pd(slow);
+            if (mask & 1)
+                bins[x] = bin(gx[x], gy[x]);
+            if (mask & 2)
+                bins[x + 1] = bin(gx[x + 1], gy[x + 1]);
+        }
+#endif
+        for (; x < len; x++)
+            bins[x] = bin(gx[x], gy[x]);
+    }
+};
+
+// Blur, luminance, gradient and binning fused over bands of HOG_BAND rows,
+// as Gauss followed by the per pixel steps. A range of bands keeps
+// GAUSS_SIZE horizontally blurred rows and three luminance rows in the
+// scratch slot of its first band, so the intermediate images are never
+// written out.
+struct OrientationRows {
+    const QImage *image;
+    const Sectors *sectors;
+    uchar *bins;
+    QRgb *blurred;
+    double *lines;
+
+    void operator()(int beginBand, int endBand) const
+    {
+        int w = image->width();
+        int h = image->height();
+        int begin = beginBand * HOG_BAND;
+        int end = qMin(endBand * HOG_BAND, h);
+        QRgb *ring = blurred + beginBand * (GAUSS_SIZE + 1) * w;
+        QRgb *column = ring + GAUSS_SIZE * w;
+        double *brightness = lines + beginBand * 5 * w;
+        const QRgb *rows[GAUSS_SIZE];
+        int first = qMax(begin - 1, 0);
+        int last = qMin(end, h - 1);
+        int next = first - GAUSS_SIZE / 2;
+        int x, y, k;
+        double *line;
+
+        for (y = first; y <= last; y++) {
+            // horizontal rows are kept by unclamped index, the vertical pass
+            // reads y - 2 .. y + 2
+            for (; next <= y + GAUSS_SIZE / 2; next++) {
+                rows[0] = (const QRgb*)image->constScanLine(check(check(next, 0, h) + GAUSS_SIZE / 2, 0, h));
+                convolveRow(rows, 1, gauss, GAUSS_SIZE, 0, w, slot(ring, next, GAUSS_SIZE, w), 0, w);
+            }
+            for (k = 0; k < GAUSS_SIZE; k++)
+                rows[k] = slot(ring, y - (k - GAUSS_SIZE / 2), GAUSS_SIZE, w);
+            convolveRow(rows, GAUSS_SIZE, gauss, 1, 0, w, column, 0, w);
+
+            line = slot(brightness, y, 3, w);
+            x = qMax(w - GAUSS_SIZE / 2, 0);
+            luminanceRow(column + GAUSS_SIZE / 2, line, x);
+            for (; x < w; x++)
+                line[x] = luminance(column[check(x + GAUSS_SIZE / 2, 0, w)]);
+
+            if (y - 1 >= begin)
+                orient(brightness, y - 1);
+        }
+        if (end == h)
+            orient(brightness, h - 1);
+    }
+
+    template <class T>
+    static T* slot(T *rows, int y, int size, int width)
+    {
+        return rows + (y % size + size) % size * width;
+    }
+
+    void orient(double *brightness, int y) const
+    {
+        int w = image->width();
+        int h = image->height();
+        double *gradX = brightness + 3 * w;
+        double *gradY = brightness + 4 * w;
+
+        gradientRow(slot(brightness, check(y - 1, 0, h), 3, w),
+                    slot(brightness, y, 3, w),
+                    slot(brightness, check(y + 1, 0, h), 3, w),
+                    w, 0, w, gradX, gradY);
+        sectors->binRow(gradX, gradY, w, bins + y * w);
+    }
+};
+
+// each row of the table is the row above plus the running counts of the row
+static void integrate(const uchar *bins, int width, int height, int *sums)
+{
+    int stride = (width + 1) * HOG_SIZE;
+    int count[HOG_SIZE];
+    int *row;
+    const int *above;
+    int i, j, b;
+
+    memset(sums, 0, stride * sizeof(int));
+    for (j = 0; j < height; j++) {
+        above = sums + j * stride;
+        row = sums + (j + 1) * stride;
+        memset(count, 0, sizeof(count));
+        memset(row, 0, HOG_SIZE * sizeof(int));
+        for (i = 0; i < width; i++) {
+            count[bins[j * width + i]]++;
+            above += HOG_SIZE;
+            row += HOG_SIZE;
+#ifdef __SSE2__
+            for (b = 0; b < HOG_SIZE; b += 4)
+                _mm_storeu_si128((__m128i*)(row + b), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(above + b)),
+                                                                    _mm_loadu_si128((const __m128i*)(count + b))));
+#else
+            for (b = 0; b < HOG_SIZE; b++)
+                row[b] = above[b] + count[b];
+#endif
+        }
+    }
+}
+
+// Feature map of the columns of cells that start at x = column * spacing:
+// full gets X_SIZE wide cells and last the narrower last cell of a window,
+// rows * CELL_FEATURES values per column, top row first.
+struct CellColumns {
+    const Detector *detector;
+    const int *needFull, *needLast;
+    int spacing, rows, lastWidth;
+    int *full, *last;
+
+    void operator()(int begin, int end) const
+    {
+        int c;
+
+        for (c = begin; c < end; c++) {
+            if (needFull[c])
+                column(c * spacing, X_SIZE, full + c * rows * CELL_FEATURES);
+            if (needLast[c])
+                column(c * spacing, lastWidth, last + c * rows * CELL_FEATURES);
+        }
+    }
+
+    void column(int x, int width, int *features) const
+    {
+        int hist[HOG_SIZE];
+        int j;
+
+        for (j = 0; j < rows; j++) {
+            detector->addUnitHOG(hist, x, j * Y_SIZE, x + width, check(j * Y_SIZE + Y_SIZE, 0, detector->hog.height));
+            Detector::nonlinear(hist, HOG_SIZE, features + j * CELL_FEATURES);
+        }
+    }
+};
+
+static double dot(const double *w, const int *x, int n)
+{
+    double sum = 0;
+    int i = 0;
+#ifdef __SSE2__
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    double lanes[2];
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(x + i));
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(w + i), _mm_cvtepi32_pd(v)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(w + i + 2), _mm_cvtepi32_pd(_mm_srli_si128(v, 8))));
+    }
+    _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i++)
+        sum += w[i] * x[i];
+    return sum;
+}
+
+// The score of window n is the sum over its columns of cells of the
+// column features times the weights of that column.
+struct WindowScores {
+    const double *weights;
+    const int *full, *last;
+    int spacing, columns, size;
+    double *scores;
+
+    void operator()(int begin, int end) const
+    {
+        int n, c, x;
+        double p;
+
+        for (n = begin; n < end; n++) {
+            p = 0;
+            for (c = 0; c < columns; c++) {
+                x = n * STEP + c * X_SIZE;
+                p += dot(weights + c * size, (c + 1 < columns ? full : last) + x / spacing * size, size);
+            }
+            scores[n] = p;
+        }
+    }
+};
+
+
+static int gcd(int a, int b)
+{
+    return b ? gcd(b, a % b) : a;
+}
+
+Detector::Detector(const struct model *model) : model(model), weightRows(-1)
+{
+    hog.width = hog.height = 0;
+}
+
+bool Detector::accepts(const QSize& size)
+{
+    return size.width() <= DETECTOR_MAX_SIDE && size.height() <= DETECTOR_MAX_SIDE &&
+           qint64(size.width()) * size.height() <= DETECTOR_MAX_PIXELS;
+}
+
+bool Detector::setImage(const QImage& image)
+{
+    if (!accepts(image.size())) {
+        qWarning("Image of %dx%d pixels is too large", image.width(), image.height());
+        return false;
+    }
+
+    QImage source = image;
+    if (source.format() != QImage::Format_RGB32 && source.format() != QImage::Format_ARGB32)
+        source = source.convertToFormat(QImage::Format_RGB32);
+
+    int height = source.height();
+    int width = source.width();
+    int bands = (height + HOG_BAND - 1) / HOG_BAND;
+    Sectors sectors;
+
+    fit(bins, qint64(width) * height);
+    fit(blurred, qint64(bands) * (GAUSS_SIZE + 1) * width);
+    fit(lines, qint64(bands) * 5 * width);
+
+    OrientationRows rows;
+    rows.image = &source;
+    rows.sectors = &sectors;
+    rows.bins = bins.data();
+    rows.blurred = blurred.data();
+    rows.lines = lines.data();
+    parallelFor(0, bands, rows);
+
+    hog.width = width;
+    hog.height = height;
+    fit(hog.sums, qint64(width + 1) * (height + 1) * HOG_SIZE);
+    integrate(bins.constData(), width, height, hog.sums.data());
+    return true;
+}
+
+qint64 Detector::memoryUsed() const
+{
+    return bytes(bins) + bytes(hog.sums) + bytes(blurred) + bytes(lines) + bytes(weights) +
+           bytes(needFull) + bytes(needLast) + bytes(full) + bytes(last) + bytes(scores);
+}
+
+void Detector::addUnitHOG(int *hist, int x0, int y0, int x1, int y1) const
+{
+    int stride = (hog.width + 1) * HOG_SIZE;
+    const int *sums = hog.sums.constData();
+    const int *a = sums + y0 * stride + x0 * HOG_SIZE;
+    const int *b = sums + y0 * stride + x1 * HOG_SIZE;
+    const int *c = sums + y1 * stride + x0 * HOG_SIZE;
+    const int *d = sums + y1 * stride + x1 * HOG_SIZE;
+    int i;
+
+    assert(x0 >= 0 && x0 <= x1 && x1 <= hog.width);
+    assert(y0 >= 0 && y0 <= y1 && y1 <= hog.height);
+
+    for (i = 0; i < HOG_SIZE; i++) {
+        hist[i] = d[i] - b[i] - c[i] + a[i];
+    }
+}
+
+QVector<int> Detector::features(int x0, int x1, int y0, int y1) const
+{
+    QVector<int> hist;
+    QVector<int> res;
+    int i, j;
+
+    for (i = x0; i < x1; i += X_SIZE) {
+        for (j = y0; j < y1; j += Y_SIZE) {
+            hist.resize(hist.size() + HOG_SIZE);
+            addUnitHOG(hist.data() + hist.size() - HOG_SIZE, i, j, check(i + X_SIZE, 0, x1), check(j + Y_SIZE, 0, y1));
+        }
+    }
+
+    res.resize(hist.size() * CELL_FEATURES / HOG_SIZE);
+    nonlinear(hist.constData(), hist.size(), res.data());
+    return res;
+}
+
+// terms of the nonlinear map of a histogram entry, truncated to int
+static void nonlinearTerms(int count, int *terms)
+{
+    double k, v, l, z = count;
+    int j;
+
+    for (j = -APPROX_ORDER; j <= APPROX_ORDER; j++) {
+        if (z == 0) {
+            *terms++ = 0;
+            *terms++ = 0;
+            continue;
+        }
+        l = j * APPROX_STEP;
+        k = 1 / cosh(PI * l);
+        v = sqrt(z * k);
+        *terms++ = cos(-l * log(z)) * v * 10;
+        *terms++ = sin(-l * log(z)) * v * 10;
+    }
+}
+
+// A cell holds at most X_SIZE * Y_SIZE pixels, so the terms of every count
+// a histogram entry can have are computed once.
+struct NonlinearTable {
+    int terms[X_SIZE * Y_SIZE + 1][NONLINEAR_TERMS];
+
+    NonlinearTable()
+    {
+        for (int i = 0; i <= X_SIZE * Y_SIZE; i++)
+            nonlinearTerms(i, terms[i]);
+    }
+};
+
+static const NonlinearTable table;
+
+// x followed by the terms of every entry
+void Detector::nonlinear(const int *x, int n, int *res)
+{
+    int *out = res + n;
+    const int *terms;
+    int i, k;
+
+    memcpy(res, x, n * sizeof(int));
+    for (i = 0; i < n; i++, out += NONLINEAR_TERMS) {
+        if (x[i] < 0 || x[i] > X_SIZE * Y_SIZE) {
+            nonlinearTerms(x[i], out);
+            continue;
+        }
+        terms = table.terms[x[i]];
+        k = 0;
+#ifdef __SSE2__
+        for (; k + 4 <= NONLINEAR_TERMS; k += 4)
+            _mm_storeu_si128((__m128i*)(out + k), _mm_loadu_si128((const __m128i*)(terms + k)));
+        for (; k + 2 <= NONLINEAR_TERMS; k += 2)
+            _mm_storel_epi64((__m128i*)(out + k), _mm_loadl_epi64((const __m128i*)(terms + k)));
+#endif
+        for (; k < NONLINEAR_TERMS; k++)
+            out[k] = terms[k];
+    }
+}
+
+// feature f of the features() vector of a window is feature k of its cell (i, j)
+void Detector::reshape(int rows)
+{
+    int columns = (HUMAN_WIDTH + X_SIZE - 1) / X_SIZE;
+    int size = rows * CELL_FEATURES;
+    int hist = columns * rows * HOG_SIZE;
+    int used = qMin(NUM_FEATURES, model->bias >= 0 ? model->nr_feature + 1 : model->nr_feature);
+    int i, j, k, f;
+
+    fit(weights, columns * size);
+    for (i = 0; i < columns; i++) {
+        for (j = 0; j < rows; j++) {
+            for (k = 0; k < CELL_FEATURES; k++) {
+                if (k < HOG_SIZE)
+                    f = (i * rows + j) * HOG_SIZE + k;
+                else
+                    f = hist + ((i * rows + j) * HOG_SIZE + (k - HOG_SIZE) / NONLINEAR_TERMS) * NONLINEAR_TERMS +
+                        (k - HOG_SIZE) % NONLINEAR_TERMS;
+                weights[i * size + j * CELL_FEATURES + k] = f < used ? model->w[f] : 0;
+            }
+        }
+    }
+    weightRows = rows;
+}
+
+// The model is linear and windows are made of cells, so the cell features
+// are computed once per image and every window is scored against the
+// weights reshaped to the same cell layout.
+QVector<QRect> Detector::detect(const QImage& image)
+{
+    int width = image.width();
+    int height = image.height();
+    QVector<double> prob;
+    QVector<int> pos;
+    QVector<QRect> answer;
+    int i, j;
+
+    if (!model || model->nr_class != 2 || model->param.solver_type == MCSVM_CS) {
+        qWarning("Only two-class models are supported");
+        return answer;
+    }
+
+    int windows = width > HUMAN_WIDTH ? (width - HUMAN_WIDTH + STEP - 1) / STEP : 0;
+    int columns = (HUMAN_WIDTH + X_SIZE - 1) / X_SIZE;
+    int rows = (height + Y_SIZE - 1) / Y_SIZE;
+    int size = rows * CELL_FEATURES;
+    int spacing = gcd(STEP, X_SIZE);
+
+    if (windows == 0 || rows == 0)
+        return answer;
+
+    if (!setImage(image))
+        return answer;
+    if (rows != weightRows)
+        reshape(rows);
+
+    int count = ((windows - 1) * STEP + (columns - 1) * X_SIZE) / spacing + 1;
+    fit(needFull, count);
+    fit(needLast, count);
+    needFull.fill(0);
+    needLast.fill(0);
+    for (i = 0; i < windows; i++) {
+        for (j = 0; j + 1 < columns; j++)
+            needFull[(i * STEP + j * X_SIZE) / spacing] = 1;
+        needLast[(i * STEP + (columns - 1) * X_SIZE) / spacing] = 1;
+    }
+
+    fit(full, qint64(count) * size);
+    fit(last, qint64(count) * size);
+    CellColumns cells;
+    cells.detector = this;
+    cells.needFull = needFull.constData();
+    cells.needLast = needLast.constData();
+    cells.spacing = spacing;
+    cells.rows = rows;
+    cells.lastWidth = check((columns - 1) * X_SIZE + X_SIZE, 0, HUMAN_WIDTH) - (columns - 1) * X_SIZE;
+    cells.full = full.data();
+    cells.last = last.data();
+    parallelFor(0, count, cells, 4);
+
+    fit(scores, windows);
+    WindowScores score;
+    score.weights = weights.constData();
+    score.full = full.constData();
+    score.last = last.constData();
+    score.spacing = spacing;
+    score.columns = columns;
+    score.size = size;
+    score.scores = scores.data();
+    parallelFor(0, windows, score, 4);
+
+    for (i = 0; i < windows; i++) {
+        if (scores[i] > THRESHOLD) {
+            prob.push_back(scores[i]);
+            pos.push_back(i * STEP);
+        }
+    }
+
+    supressNonMax(answer, prob, pos);
+
+    return answer;
+}
+
+void Detector::supressNonMax(QVector<QRect>& answer, QVector<double>& prob, const QVector<int>& pos)
+{
+    double cur_max;
+    int i_max;
+    int sz;
+    sz = prob.size();
+
+    bool f;
+    int i;
+
+    double thrs = THRESHOLD;
+    while (true) {
+        cur_max = 0;
+        for (i = 0; i < prob.size(); i++) {
+            if (prob[i] > cur_max) {
+                cur_max = prob[i];
+                i_max = i;
+            }
+        }
+        if (cur_max < thrs) {
+            break;
+        }
+        answer.push_back(QRect(pos[i_max], 0, HUMAN_WIDTH, HUMAN_HEIGHT));
+
+        i = 1;
+        f = true;
+        while (f) {
+            f = false;
+            if (i_max - i >= 0 && pos[i_max] - pos[i_max - i] < HUMAN_WIDTH) {
+                prob[i_max - i] = 0;
+                f = true;
+            }
+            if (i_max + i < sz && pos[i_max + i] - pos[i_max] < HUMAN_WIDTH) {
+                prob[i_max + i] = 0;
+                f = true;
+            }
+            i++;
+        }
+        prob[i_max] = 0;
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <QImage>
+#include <QList>
+#include <QMutex>
+#include <QRect>
+#include <QVector>
+
+#include "logic.h"
+
+// rows of the bands the orientation pass is split into
+const int HOG_BAND = 32;
+
+// Largest image the detector accepts. The integral histogram takes
+// 4 * HOG_SIZE bytes per pixel and has to stay below the 2 GB a QVector
+// can hold.
+const int DETECTOR_MAX_SIDE = 16384;
+const int DETECTOR_MAX_PIXELS = 24 << 20;
+
+// a pooled detector holding more than this is deleted instead of reused
+const qint64 DETECTOR_POOL_BYTES = 256 << 20;
+
+// One summed-area table per orientation bin: sums[(y * (width + 1) + x) *
+// HOG_SIZE + b] counts the pixels of bin b in [0, x) x [0, y), so the
+// histogram of any rectangle costs four lookups per bin.
+struct IntegralHOG {
+    int width, height;
+    QVector<int> sums;
+};
+
+// HOG features and window scores of one image at a time. The bin plane,
+// the integral histogram, the cell feature maps and the row scratch of the
+// bands belong to the detector and only grow, so a detector reused over a
+// batch of images stops allocating once it has seen the largest one.
+class Detector {
+    friend struct CellColumns;
+
+public:
+    explicit Detector(const struct model *model = 0);
+
+    // whether an image of size is small enough for setImage
+    static bool accepts(const QSize& size);
+
+    // orientation bins and integral histogram of image; false when the
+    // image is too large
+    bool setImage(const QImage& image);
+    // features of the window [x0, x1) x [y0, y1) of the current image
+    QVector<int> features(int x0, int x1, int y0, int y1) const;
+    // windows of image scoring above THRESHOLD, after non-maximum suppression
+    QVector<QRect> detect(const QImage& image);
+    // bytes held by the buffers
+    qint64 memoryUsed() const;
+
+private:
+    Detector(const Detector&);
+    Detector& operator=(const Detector&);
+
+    void addUnitHOG(int *hist, int x0, int y0, int x1, int y1) const;
+    void reshape(int rows);
+    static void nonlinear(const int *x, int n, int *res);
+    static void supressNonMax(QVector<QRect>& answer, QVector<double>& prob, const QVector<int>& pos);
+
+    const struct model *model;
+    QVector<uchar> bins;
+    IntegralHOG hog;
+    QVector<QRgb> blurred;
+    QVector<double> lines;
+    // weights of the model in the cell layout, for images of weightRows rows of cells
+    int weightRows;
+    QVector<double> weights;
+    QVector<int> needFull, needLast;
+    QVector<int> full, last;
+    QVector<double> scores;
+};
+
+// Detectors for concurrent detection tasks. A task waiting inside detect
+// only helps with its own parallel loops, so at most one detector is taken
+// per thread running tasks: the pool holds as many detectors as the
+// scheduler has threads, plus one for each other thread that waits for
+// detection tasks, whatever the number of images. A detector that grew
+// past DETECTOR_POOL_BYTES on a large image is not kept.
+class DetectorPool {
+public:
+    DetectorPool(const struct model *model) : model(model) {}
+    ~DetectorPool() { qDeleteAll(detectors); }
+
+    Detector* acquire()
+    {
+        QMutexLocker locker(&mutex);
+        if (detectors.isEmpty())
+            return new Detector(model);
+        return detectors.takeLast();
+    }
+
+    void release(Detector *detector)
+    {
+        if (detector->memoryUsed() > DETECTOR_POOL_BYTES) {
+            delete detector;
+            return;
+        }
+        QMutexLocker locker(&mutex);
+        detectors.append(detector);
+    }
+
+private:
+    const struct model *model;
+    QMutex mutex;
+    QList<Detector*> detectors;
+};
+
+#endif // DETECTOR_H
@@ -1,3 +1,7 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "blas.h"
 
 int daxpy_(int *n, double *sa, double *sx, int *incx, double *sy,
@@ -21,6 +25,15 @@ int daxpy_(int *n, double *sa, double *sx, int *incx, double *sy,
   {
     if (iincx == 1 && iincy == 1) /* code for both increments equal to 1 */
     {
+#ifdef __SSE2__
+      __m128d va = _mm_set1_pd(ssa);
+      m = nn-3;
+      for (i = 0; i < m; i += 4)
+      {
+        _mm_storeu_pd(sy+i, _mm_add_pd(_mm_loadu_pd(sy+i), _mm_mul_pd(va, _mm_loadu_pd(sx+i))));
+        _mm_storeu_pd(sy+i+2, _mm_add_pd(_mm_loadu_pd(sy+i+2), _mm_mul_pd(va, _mm_loadu_pd(sx+i+2))));
+      }
+#else
       m = nn-3;
       for (i = 0; i < m; i += 4)
       {
@@ -29,6 +42,7 @@ int daxpy_(int *n, double *sa, double *sx, int *incx, double *sy,
         sy[i+2] += ssa * sx[i+2];
         sy[i+3] += ssa * sx[i+3];
       }
+#endif
       for ( ; i < nn; ++i) /* clean-up loop */
         sy[i] += ssa * sx[i];
     }
@@ -1,3 +1,7 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "blas.h"
 
 double ddot_(int *n, double *sx, int *incx, double *sy, int *incy)
@@ -21,10 +25,23 @@ double ddot_(int *n, double *sx, int *incx, double *sy, int *incy)
   {
     if (iincx == 1 && iincy == 1) /* code for both increments equal to 1 */
     {
+#ifdef __SSE2__
+      __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+      double t[2];
+      m = nn-3;
+      for (i = 0; i < m; i += 4)
+      {
+        s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(sx+i), _mm_loadu_pd(sy+i)));
+        s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(sx+i+2), _mm_loadu_pd(sy+i+2)));
+      }
+      _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+      stemp = t[0] + t[1];
+#else
       m = nn-4;
       for (i = 0; i < m; i += 5)
         stemp += sx[i] * sy[i] + sx[i+1] * sy[i+1] + sx[i+2] * sy[i+2] +
                  sx[i+3] * sy[i+3] + sx[i+4] * sy[i+4];
+#endif
 
       for ( ; i < nn; i++)        /* clean-up loop */
         stemp += sx[i] * sy[i];
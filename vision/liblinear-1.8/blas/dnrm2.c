@@ -1,6 +1,47 @@
 #include <math.h>  /* Needed for fabs() and sqrt() */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "blas.h"
 
+#ifdef __SSE2__
+/* x'*x summed directly, or -1 if the largest |x[i]| is so large or so
+   small that the squares could overflow or underflow and the scaled loop
+   is needed */
+static double sumsq(long int n, const double *x)
+{
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  __m128d m0 = _mm_setzero_pd(), m1 = _mm_setzero_pd();
+  __m128d v0, v1;
+  double t[2], sum, big;
+  long int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    v0 = _mm_loadu_pd(x+i);
+    v1 = _mm_loadu_pd(x+i+2);
+    s0 = _mm_add_pd(s0, _mm_mul_pd(v0, v0));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(v1, v1));
+    m0 = _mm_max_pd(m0, _mm_max_pd(v0, _mm_sub_pd(_mm_setzero_pd(), v0)));
+    m1 = _mm_max_pd(m1, _mm_max_pd(v1, _mm_sub_pd(_mm_setzero_pd(), v1)));
+  }
+  _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+  sum = t[0] + t[1];
+  _mm_storeu_pd(t, _mm_max_pd(m0, m1));
+  big = MAX(t[0], t[1]);
+  for ( ; i < n; i++)
+  {
+    sum += x[i] * x[i];
+    big = MAX(big, fabs(x[i]));
+  }
+
+  if (big > 1e140 || (big < 1e-140 && big != 0.0))
+    return -1.0;
+  return sum;
+}
+#endif
+
 double dnrm2_(int *n, double *x, int *incx)
 {
   long int ix, nn, iincx;
@@ -26,6 +67,13 @@ double dnrm2_(int *n, double *x, int *incx)
       norm = fabs(x[0]);
     }  
     else
+#ifdef __SSE2__
+    if (iincx == 1 && (ssq = sumsq(nn, x)) >= 0.0)
+    {
+      norm = sqrt(ssq);
+    }
+    else
+#endif
     {
       scale = 0.0;
       ssq = 1.0;
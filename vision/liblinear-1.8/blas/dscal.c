@@ -1,3 +1,7 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "blas.h"
 
 int dscal_(int *n, double *sa, double *sx, int *incx)
@@ -20,6 +24,15 @@ int dscal_(int *n, double *sa, double *sx, int *incx)
   {
     if (iincx == 1) /* code for increment equal to 1 */
     {
+#ifdef __SSE2__
+      __m128d va = _mm_set1_pd(ssa);
+      m = nn-3;
+      for (i = 0; i < m; i += 4)
+      {
+        _mm_storeu_pd(sx+i, _mm_mul_pd(va, _mm_loadu_pd(sx+i)));
+        _mm_storeu_pd(sx+i+2, _mm_mul_pd(va, _mm_loadu_pd(sx+i+2)));
+      }
+#else
       m = nn-4;
       for (i = 0; i < m; i += 5)
       {
@@ -29,6 +42,7 @@ int dscal_(int *n, double *sa, double *sx, int *incx)
         sx[i+3] = ssa * sx[i+3];
         sx[i+4] = ssa * sx[i+4];
       }
+#endif
       for ( ; i < nn; ++i) /* clean-up loop */
         sx[i] = ssa * sx[i];
     }
@@ -3,6 +3,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "linear.h"
 #include "tron.h"
 typedef signed char schar;
@@ -29,6 +38,27 @@ static void print_string_stdout(const char *s)
 
 static void (*liblinear_print_string) (const char *) = &print_string_stdout;
 
+static void parallel_serial(int n, int grain, void (*body)(int, int, void *), void *data)
+{
+	(void)grain;
+	if(n > 0)
+		body(0, n, data);
+}
+
+static void (*liblinear_parallel) (int, int, void (*)(int, int, void *), void *) = &parallel_serial;
+
+template <class Body> static void parallel_range(int begin, int end, void *data)
+{
+	(*(const Body *)data)(begin, end);
+}
+
+// body(begin, end) over ranges covering [0, n) of at least grain items,
+// possibly at once on several threads
+template <class Body> static void parallel_for(int n, const Body& body, int grain = 1)
+{
+	liblinear_parallel(n, grain, &parallel_range<Body>, (void *)&body);
+}
+
 #if 1
 static void info(const char *fmt,...)
 {
@@ -43,10 +73,245 @@ static void info(const char *fmt,...)
 static void info(const char *fmt,...) {}
 #endif
 
+// x^T w and w += a*x for a dense instance of n values
+static double dense_dot(const float *x, const double *w, int n)
+{
+	int i = 0;
+	double sum = 0;
+#ifdef __SSE2__
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	double t[2];
+	for(; i+4<=n; i+=4)
+	{
+		__m128 v = _mm_loadu_ps(x+i);
+		s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_cvtps_pd(v), _mm_loadu_pd(w+i)));
+		s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), _mm_loadu_pd(w+i+2)));
+	}
+	_mm_storeu_pd(t, _mm_add_pd(s0, s1));
+	sum = t[0] + t[1];
+#endif
+	for(; i<n; i++)
+		sum += x[i]*w[i];
+	return sum;
+}
+
+// x^T (w + dw), reading x once
+static double dense_dot2(const float *x, const double *w, const double *dw, int n)
+{
+	int i = 0;
+	double sum = 0;
+#ifdef __SSE2__
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	double t[2];
+	for(; i+4<=n; i+=4)
+	{
+		__m128 v = _mm_loadu_ps(x+i);
+		__m128d a = _mm_add_pd(_mm_loadu_pd(w+i), _mm_loadu_pd(dw+i));
+		__m128d b = _mm_add_pd(_mm_loadu_pd(w+i+2), _mm_loadu_pd(dw+i+2));
+		s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_cvtps_pd(v), a));
+		s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), b));
+	}
+	_mm_storeu_pd(t, _mm_add_pd(s0, s1));
+	sum = t[0] + t[1];
+#endif
+	for(; i<n; i++)
+		sum += x[i]*(w[i]+dw[i]);
+	return sum;
+}
+
+static void dense_axpy(double a, const float *x, double *w, int n)
+{
+	int i = 0;
+#ifdef __SSE2__
+	__m128d va = _mm_set1_pd(a);
+	for(; i+4<=n; i+=4)
+	{
+		__m128 v = _mm_loadu_ps(x+i);
+		_mm_storeu_pd(w+i, _mm_add_pd(_mm_loadu_pd(w+i), _mm_mul_pd(va, _mm_cvtps_pd(v))));
+		_mm_storeu_pd(w+i+2, _mm_add_pd(_mm_loadu_pd(w+i+2), _mm_mul_pd(va, _mm_cvtps_pd(_mm_movehl_ps(v, v)))));
+	}
+#endif
+	for(; i<n; i++)
+		w[i] += a*x[i];
+}
+
+// x_i^T w and w += a*x_i for either kind of instance
+static double instance_dot(const problem *prob, int i, const double *w)
+{
+	if(prob->dense)
+		return dense_dot(prob->dense[i], w, prob->n);
+
+	double sum = 0;
+	feature_node *xi = prob->x[i];
+	while(xi->index != -1)
+	{
+		sum += w[xi->index-1]*xi->value;
+		xi++;
+	}
+	return sum;
+}
+
+static double instance_dot2(const problem *prob, int i, const double *w, const double *dw)
+{
+	if(prob->dense)
+		return dense_dot2(prob->dense[i], w, dw, prob->n);
+
+	double sum = 0;
+	feature_node *xi = prob->x[i];
+	while(xi->index != -1)
+	{
+		sum += (w[xi->index-1]+dw[xi->index-1])*xi->value;
+		xi++;
+	}
+	return sum;
+}
+
+static void instance_axpy(const problem *prob, int i, double a, double *w)
+{
+	if(prob->dense)
+	{
+		dense_axpy(a, prob->dense[i], w, prob->n);
+		return;
+	}
+
+	feature_node *xi = prob->x[i];
+	while(xi->index != -1)
+	{
+		w[xi->index-1] += a*xi->value;
+		xi++;
+	}
+}
+
+// QD[i] += x_i^T x_i
+struct instance_norms
+{
+	const problem *prob;
+	double *QD;
+
+	void operator()(int begin, int end) const
+	{
+		for(int i=begin; i<end; i++)
+		{
+			if(prob->dense)
+			{
+				const float *xi = prob->dense[i];
+				for(int s=0; s<prob->n; s++)
+					QD[i] += (double)xi[s]*xi[s];
+			}
+			else
+			{
+				feature_node *xi = prob->x[i];
+				while (xi->index != -1)
+				{
+					QD[i] += (xi->value)*(xi->value);
+					xi++;
+				}
+			}
+		}
+	}
+};
+
+// Xv[i] = x_{I[i]}^T v for i < size, with I NULL for the instances in order
+struct instance_products
+{
+	const problem *prob;
+	const int *I;
+	const double *v;
+	double *Xv;
+
+	void operator()(int begin, int end) const
+	{
+		for(int i=begin; i<end; i++)
+			Xv[i] = instance_dot(prob, I ? I[i] : i, v);
+	}
+};
+
+// XTv = sum of v[i]*x_{I[i]} over i < size. Each of nr_block blocks of the
+// instances sums into its own vector, the first one into XTv and the others
+// into sums, and the vectors are added in block order, so the result
+// depends on nr_block but not on the threads.
+struct instance_sums
+{
+	const problem *prob;
+	const int *I;
+	const double *v;
+	int size;
+	int nr_block;
+	double *XTv;
+	double *sums;
+
+	void operator()(int begin, int end) const
+	{
+		int w_size = prob->n;
+		for(int k=begin; k<end; k++)
+		{
+			double *s = k == 0 ? XTv : sums + (size_t)(k-1)*w_size;
+			int first = k*(size/nr_block) + min(k, size%nr_block);
+			int last = first + size/nr_block + (k < size%nr_block ? 1 : 0);
+			memset(s, 0, sizeof(double)*w_size);
+			for(int i=first; i<last; i++)
+				instance_axpy(prob, I ? I[i] : i, v[i], s);
+		}
+	}
+};
+
+struct block_sums
+{
+	int w_size;
+	int nr_block;
+	const double *sums;
+	double *XTv;
+
+	void operator()(int begin, int end) const
+	{
+		for(int k=1; k<nr_block; k++)
+		{
+			const double *s = sums + (size_t)(k-1)*w_size;
+			for(int j=begin; j<end; j++)
+				XTv[j] += s[j];
+		}
+	}
+};
+
+static void parallel_Xv(const problem *prob, const int *I, int size, const double *v, double *Xv)
+{
+	instance_products body;
+	body.prob = prob;
+	body.I = I;
+	body.v = v;
+	body.Xv = Xv;
+	parallel_for(size, body, 64);
+}
+
+// sums holds (nr_block-1)*n values
+static void parallel_XTv(const problem *prob, const int *I, int size, const double *v, double *XTv,
+	int nr_block, double *sums)
+{
+	instance_sums body;
+	body.prob = prob;
+	body.I = I;
+	body.v = v;
+	body.size = size;
+	body.nr_block = nr_block;
+	body.XTv = XTv;
+	body.sums = sums;
+	parallel_for(nr_block, body);
+
+	if(nr_block > 1)
+	{
+		block_sums add;
+		add.w_size = prob->n;
+		add.nr_block = nr_block;
+		add.sums = sums;
+		add.XTv = XTv;
+		parallel_for(prob->n, add, 4096);
+	}
+}
+
 class l2r_lr_fun : public function
 {
 public:
-	l2r_lr_fun(const problem *prob, double Cp, double Cn);
+	l2r_lr_fun(const problem *prob, double Cp, double Cn, int nr_block);
 	~l2r_lr_fun();
 
 	double fun(double *w);
@@ -62,10 +327,12 @@ private:
 	double *C;
 	double *z;
 	double *D;
+	int nr_block;
+	double *sums;
 	const problem *prob;
 };
 
-l2r_lr_fun::l2r_lr_fun(const problem *prob, double Cp, double Cn)
+l2r_lr_fun::l2r_lr_fun(const problem *prob, double Cp, double Cn, int nr_block)
 {
 	int i;
 	int l=prob->l;
@@ -76,6 +343,8 @@ l2r_lr_fun::l2r_lr_fun(const problem *prob, double Cp, double Cn)
 	z = new double[l];
 	D = new double[l];
 	C = new double[l];
+	this->nr_block = nr_block;
+	sums = new double[(size_t)(nr_block-1)*prob->n];
 
 	for (i=0; i<l; i++)
 	{
@@ -91,6 +360,7 @@ l2r_lr_fun::~l2r_lr_fun()
 	delete[] z;
 	delete[] D;
 	delete[] C;
+	delete[] sums;
 }
 
 
@@ -162,46 +432,18 @@ void l2r_lr_fun::Hv(double *s, double *Hs)
 
 void l2r_lr_fun::Xv(double *v, double *Xv)
 {
-	int i;
-	int l=prob->l;
-	feature_node **x=prob->x;
-
-	for(i=0;i<l;i++)
-	{
-		feature_node *s=x[i];
-		Xv[i]=0;
-		while(s->index!=-1)
-		{
-			Xv[i]+=v[s->index-1]*s->value;
-			s++;
-		}
-	}
+	parallel_Xv(prob, NULL, prob->l, v, Xv);
 }
 
 void l2r_lr_fun::XTv(double *v, double *XTv)
 {
-	int i;
-	int l=prob->l;
-	int w_size=get_nr_variable();
-	feature_node **x=prob->x;
-
-	for(i=0;i<w_size;i++)
-		XTv[i]=0;
-	for(i=0;i<l;i++)
-	{
-		feature_node *s=x[i];
-		while(s->index!=-1)
-		{
-			XTv[s->index-1]+=v[i]*s->value;
-			s++;
-		}
-	}
+	parallel_XTv(prob, NULL, prob->l, v, XTv, nr_block, sums);
 }
 
 class l2r_l2_svc_fun : public function
 {
 public:
-	l2r_l2_svc_fun(const problem *prob, double Cp, double Cn);
+	l2r_l2_svc_fun(const problem *prob, double Cp, double Cn, int nr_block);
 	~l2r_l2_svc_fun();
 
 	double fun(double *w);
@@ -220,10 +462,12 @@ private:
 	double *D;
 	int *I;
 	int sizeI;
+	int nr_block;
+	double *sums;
 	const problem *prob;
 };
 
-l2r_l2_svc_fun::l2r_l2_svc_fun(const problem *prob, double Cp, double Cn)
+l2r_l2_svc_fun::l2r_l2_svc_fun(const problem *prob, double Cp, double Cn, int nr_block)
 {
 	int i;
 	int l=prob->l;
@@ -235,6 +479,8 @@ l2r_l2_svc_fun::l2r_l2_svc_fun(const problem *prob, double Cp, double Cn)
 	D = new double[l];
 	C = new double[l];
 	I = new int[l];
+	this->nr_block = nr_block;
+	sums = new double[(size_t)(nr_block-1)*prob->n];
 
 	for (i=0; i<l; i++)
 	{
@@ -251,6 +497,7 @@ l2r_l2_svc_fun::~l2r_l2_svc_fun()
 	delete[] D;
 	delete[] C;
 	delete[] I;
+	delete[] sums;
 }
 
 double l2r_l2_svc_fun::fun(double *w)
@@ -322,56 +569,17 @@ void l2r_l2_svc_fun::Hv(double *s, double *Hs)
 
 void l2r_l2_svc_fun::Xv(double *v, double *Xv)
 {
-	int i;
-	int l=prob->l;
-	feature_node **x=prob->x;
-
-	for(i=0;i<l;i++)
-	{
-		feature_node *s=x[i];
-		Xv[i]=0;
-		while(s->index!=-1)
-		{
-			Xv[i]+=v[s->index-1]*s->value;
-			s++;
-		}
-	}
+	parallel_Xv(prob, NULL, prob->l, v, Xv);
 }
 
 void l2r_l2_svc_fun::subXv(double *v, double *Xv)
 {
-	int i;
-	feature_node **x=prob->x;
-
-	for(i=0;i<sizeI;i++)
-	{
-		feature_node *s=x[I[i]];
-		Xv[i]=0;
-		while(s->index!=-1)
-		{
-			Xv[i]+=v[s->index-1]*s->value;
-			s++;
-		}
-	}
+	parallel_Xv(prob, I, sizeI, v, Xv);
 }
 
 void l2r_l2_svc_fun::subXTv(double *v, double *XTv)
 {
-	int i;
-	int w_size=get_nr_variable();
-	feature_node **x=prob->x;
-
-	for(i=0;i<w_size;i++)
-		XTv[i]=0;
-	for(i=0;i<sizeI;i++)
-	{
-		feature_node *s=x[I[i]];
-		while(s->index!=-1)
-		{
-			XTv[s->index-1]+=v[i]*s->value;
-			s++;
-		}
-	}
+	parallel_XTv(prob, I, sizeI, v, XTv, nr_block, sums);
 }
 
 // A coordinate descent algorithm for 
@@ -678,6 +886,370 @@ void Solver_MCSVM_CS::Solve(double *w)
 	delete [] active_size_i;
 }
 
+// rand() is shared by the threads, so each block draws from its own
+// generator (30 bits, blocks may be larger than RAND_MAX)
+static int block_rand(unsigned int *seed)
+{
+	unsigned int r;
+	*seed = *seed*1103515245u + 12345u;
+	r = (*seed>>16)&0x7fff;
+	*seed = *seed*1103515245u + 12345u;
+	return (int)((r<<15) | ((*seed>>16)&0x7fff));
+}
+
+// work of a round of a block, in multiples of the merge of its change to w
+#define SVC_ROUND_WORK 8
+// least rounds in a pass over the active instances of a block
+#define SVC_ROUNDS 16
+
+// One block of the parallel solver: a fixed part of the instances, the
+// active ones first, and its own change to w in the current round
+struct svc_block
+{
+	int *index;
+	int size;
+	int active_size;
+	int next;		// first active instance of the next round
+	unsigned int seed;
+	double *dw;
+	int *changed;		// instances whose alpha changed in the round
+	double *alpha_old;
+	int nr_changed;
+	double PGmax, PGmin;	// over the epoch
+	double dot, quad;	// alpha terms of the line search of the round
+};
+
+#undef GETI
+#define GETI(i) (y[i]+1)
+// To support weights for instances, use GETI(i) (i)
+
+// runs coordinate descent on the next round_size active instances of each
+// block against w plus the block's own change
+struct svc_round
+{
+	const problem *prob;
+	const double *w;
+	double *alpha;
+	const double *QD;
+	const schar *y;
+	const double *diag;
+	const double *upper_bound;
+	double PGmax_old, PGmin_old;
+	svc_block *blocks;
+	int round_size;
+
+	void operator()(int begin, int end) const
+	{
+		for(int k=begin; k<end; k++)
+			run(&blocks[k]);
+	}
+
+	void run(svc_block *b) const
+	{
+		int i, s, last;
+		double C, d, G, PG;
+
+		// the merge has added the change of the last round to w; a sparse
+		// change is cleared where the instances touched it
+		if(b->nr_changed > 0)
+		{
+			if(prob->dense)
+				memset(b->dw, 0, sizeof(double)*prob->n);
+			else
+				for(s=0; s<b->nr_changed; s++)
+					for(feature_node *xi=prob->x[b->changed[s]]; xi->index!=-1; xi++)
+						b->dw[xi->index-1] = 0;
+		}
+		b->nr_changed = 0;
+		b->dot = 0;
+		b->quad = 0;
+		if(b->next >= b->active_size)
+			return;
+
+		last = min(b->next+round_size, b->active_size);
+		for(s=b->next; s<last; s++)
+		{
+			i = b->index[s];
+			G = instance_dot2(prob, i, w, b->dw)*y[i]-1;
+
+			C = upper_bound[GETI(i)];
+			G += alpha[i]*diag[GETI(i)];
+
+			PG = 0;
+			if (alpha[i] == 0)
+			{
+				if (G > PGmax_old)
+				{
+					b->active_size--;
+					swap(b->index[s], b->index[b->active_size]);
+					last = min(last, b->active_size);
+					s--;
+					continue;
+				}
+				else if (G < 0)
+					PG = G;
+			}
+			else if (alpha[i] == C)
+			{
+				if (G < PGmin_old)
+				{
+					b->active_size--;
+					swap(b->index[s], b->index[b->active_size]);
+					last = min(last, b->active_size);
+					s--;
+					continue;
+				}
+				else if (G > 0)
+					PG = G;
+			}
+			else
+				PG = G;
+
+			b->PGmax = max(b->PGmax, PG);
+			b->PGmin = min(b->PGmin, PG);
+
+			if(fabs(PG) > 1.0e-12)
+			{
+				double alpha_new = min(max(alpha[i] - G/QD[i], 0.0), C);
+				d = alpha_new - alpha[i];
+				b->dot += d*(alpha[i]*diag[GETI(i)] - 1);
+				b->quad += d*d*diag[GETI(i)];
+				b->changed[b->nr_changed] = i;
+				b->alpha_old[b->nr_changed] = alpha[i];
+				b->nr_changed++;
+				alpha[i] = alpha_new;
+				instance_axpy(prob, i, d*y[i], b->dw);
+			}
+		}
+		b->next = last;
+	}
+};
+
+// dw = sum of the changes of the blocks to w, and the w terms of the line
+// search, over fixed slices of the features so that the sums do not
+// depend on the threads
+struct svc_merge
+{
+	const double *w;
+	int w_size;
+	const svc_block *blocks;
+	int nr_block;
+	double *dw;
+	double *dot;
+	double *quad;
+
+	void operator()(int begin, int end) const
+	{
+		int chunk = (w_size+nr_block-1)/nr_block;
+		for(int s=begin; s<end; s++)
+		{
+			int j, k;
+			dot[s] = 0;
+			quad[s] = 0;
+			for(j=s*chunk; j<min((s+1)*chunk, w_size); j++)
+			{
+				dw[j] = 0;
+				for(k=0; k<nr_block; k++)
+					if(blocks[k].nr_changed > 0)
+						dw[j] += blocks[k].dw[j];
+				dot[s] += w[j]*dw[j];
+				quad[s] += dw[j]*dw[j];
+			}
+		}
+	}
+};
+
+// A parallel variant of the coordinate descent below. The instances are
+// split into nr_block fixed blocks. In each round every block updates its
+// next round_size active instances against w plus its own change to w,
+// then the changes of all blocks are added with the step in [0, 1] that
+// minimizes the dual objective along them, so the objective never increases
+// however correlated the blocks are. A round does about SVC_ROUND_WORK
+// times the work of the merge that follows it, but covers at most
+// 1/SVC_ROUNDS of the active instances, as blocks that change all their
+// instances at once keep undoing each other. A block only touches its
+// own alpha and change to w, so the result depends on nr_block and the
+// rand() seed but not on the threads that run the blocks.
+//
+// Returns the number of iterations; the serial solver then checks the
+// stopping condition with the exact w.
+
+static int solve_l2r_l1l2_svc_blocks(
+	const problem *prob, double *w, double eps, double *alpha,
+	const double *QD, const schar *y, const double *diag,
+	const double *upper_bound, int nr_block, int max_iter)
+{
+	int l = prob->l;
+	int w_size = prob->n;
+	int i, k, s, iter = 0;
+	int block_size = (l+nr_block-1)/nr_block;
+	double nnz = w_size;
+	if(!prob->dense)
+	{
+		nnz = 0;
+		for(i=0; i<l; i++)
+			for(feature_node *xi=prob->x[i]; xi->index!=-1; xi++)
+				nnz++;
+		nnz = max(nnz/l, 1.0);
+	}
+	int round_size = (int)min((double)block_size, max(1.0, SVC_ROUND_WORK*w_size/nnz));
+	int *index = new int[l];
+	int *changed = new int[nr_block*round_size];
+	double *alpha_old = new double[nr_block*round_size];
+	double *block_dw = new double[(size_t)nr_block*w_size];
+	double *dw = new double[w_size];
+	double *dot = new double[nr_block];
+	double *quad = new double[nr_block];
+	svc_block *blocks = new svc_block[nr_block];
+
+	double PGmax_old = INF;
+	double PGmin_old = -INF;
+	double PGmax_new, PGmin_new;
+
+	for(i=0; i<l; i++)
+		index[i] = i;
+	memset(block_dw, 0, sizeof(double)*nr_block*w_size);
+	for(i=0; i<l; i++)
+	{
+		int j = i+rand()%(l-i);
+		swap(index[i], index[j]);
+	}
+	for(k=0; k<nr_block; k++)
+	{
+		int start = k*(l/nr_block) + min(k, l%nr_block);
+		blocks[k].index = index + start;
+		blocks[k].size = l/nr_block + (k < l%nr_block ? 1 : 0);
+		blocks[k].active_size = blocks[k].size;
+		blocks[k].seed = (unsigned int)rand();
+		blocks[k].dw = block_dw + (size_t)k*w_size;
+		blocks[k].nr_changed = 0;
+		blocks[k].changed = changed + k*round_size;
+		blocks[k].alpha_old = alpha_old + k*round_size;
+	}
+
+	svc_round round;
+	round.prob = prob;
+	round.w = w;
+	round.alpha = alpha;
+	round.QD = QD;
+	round.y = y;
+	round.diag = diag;
+	round.upper_bound = upper_bound;
+	round.blocks = blocks;
+
+	svc_merge merge;
+	merge.w = w;
+	merge.w_size = w_size;
+	merge.blocks = blocks;
+	merge.nr_block = nr_block;
+	merge.dw = dw;
+	merge.dot = dot;
+	merge.quad = quad;
+
+	while (iter < max_iter)
+	{
+		int max_active = 0;
+		for(k=0; k<nr_block; k++)
+		{
+			svc_block *b = &blocks[k];
+			max_active = max(max_active, b->active_size);
+			for (s=0; s<b->active_size; s++)
+			{
+				int j = s+block_rand(&b->seed)%(b->active_size-s);
+				swap(b->index[s], b->index[j]);
+			}
+			b->next = 0;
+			b->PGmax = -INF;
+			b->PGmin = INF;
+		}
+		round.round_size = max(1, min(round_size, max_active/SVC_ROUNDS));
+		round.PGmax_old = PGmax_old;
+		round.PGmin_old = PGmin_old;
+
+		bool done = false;
+		while (!done)
+		{
+			parallel_for(nr_block, round);
+
+			int nr_changed = 0;
+			done = true;
+			for(k=0; k<nr_block; k++)
+			{
+				nr_changed += blocks[k].nr_changed;
+				if(blocks[k].next < blocks[k].active_size)
+					done = false;
+			}
+			if(nr_changed == 0)
+				continue;
+
+			parallel_for(nr_block, merge);
+
+			double num = 0, den = 0, step = 1;
+			for(k=0; k<nr_block; k++)
+			{
+				num += blocks[k].dot + dot[k];
+				den += blocks[k].quad + quad[k];
+			}
+			if(den > 0)
+				step = min(max(-num/den, 0.0), 1.0);
+
+			for(i=0; i<w_size; i++)
+				w[i] += step*dw[i];
+			for(k=0; k<nr_block; k++)
+				for(s=0; s<blocks[k].nr_changed; s++)
+				{
+					i = blocks[k].changed[s];
+					alpha[i] = blocks[k].alpha_old[s] + step*(alpha[i] - blocks[k].alpha_old[s]);
+				}
+		}
+
+		PGmax_new = -INF;
+		PGmin_new = INF;
+		int active_size = 0;
+		for(k=0; k<nr_block; k++)
+		{
+			PGmax_new = max(PGmax_new, blocks[k].PGmax);
+			PGmin_new = min(PGmin_new, blocks[k].PGmin);
+			active_size += blocks[k].active_size;
+		}
+
+		iter++;
+		if(iter % 10 == 0)
+			info(".");
+
+		if(PGmax_new - PGmin_new <= eps)
+		{
+			if(active_size == l)
+				break;
+			else
+			{
+				for(k=0; k<nr_block; k++)
+					blocks[k].active_size = blocks[k].size;
+				info("*");
+				PGmax_old = INF;
+				PGmin_old = -INF;
+				continue;
+			}
+		}
+		PGmax_old = PGmax_new;
+		PGmin_old = PGmin_new;
+		if (PGmax_old <= 0)
+			PGmax_old = INF;
+		if (PGmin_old >= 0)
+			PGmin_old = -INF;
+	}
+
+	delete [] index;
+	delete [] changed;
+	delete [] alpha_old;
+	delete [] block_dw;
+	delete [] dw;
+	delete [] dot;
+	delete [] quad;
+	delete [] blocks;
+	return iter;
+}
+
 // A coordinate descent algorithm for 
 // L1-loss and L2-loss SVM dual problems
 //
@@ -704,13 +1276,9 @@ void Solver_MCSVM_CS::Solve(double *w)
 // 
 // See Algorithm 3 of Hsieh et al., ICML 2008
 
-#undef GETI
-#define GETI(i) (y[i]+1)
-// To support weights for instances, use GETI(i) (i)
-
 static void solve_l2r_l1l2_svc(
 	const problem *prob, double *w, double eps, 
-	double Cp, double Cn, int solver_type)
+	double Cp, double Cn, int solver_type, int nr_block)
 {
 	int l = prob->l;
 	int w_size = prob->n;
@@ -754,16 +1322,20 @@ static void solve_l2r_l1l2_svc(
 			y[i] = -1;
 		}
 		QD[i] = diag[GETI(i)];
-
-		feature_node *xi = prob->x[i];
-		while (xi->index != -1)
-		{
-			QD[i] += (xi->value)*(xi->value);
-			xi++;
-		}
 		index[i] = i;
 	}
 
+	instance_norms norms;
+	norms.prob = prob;
+	norms.QD = QD;
+	parallel_for(l, norms, 64);
+
+	// the block phase gets at most half of the iterations, so the serial
+	// pass below always runs and checks the stopping condition
+	if(nr_block > 1)
+		iter = solve_l2r_l1l2_svc_blocks(prob, w, eps, alpha, QD, y, diag,
+			upper_bound, min(nr_block, l), max_iter/2);
+
 	while (iter < max_iter)
 	{
 		PGmax_new = -INF;
@@ -778,16 +1350,9 @@ static void solve_l2r_l1l2_svc(
 		for (s=0; s<active_size; s++)
 		{
 			i = index[s];
-			G = 0;
 			schar yi = y[i];
 
-			feature_node *xi = prob->x[i];
-			while(xi->index!= -1)
-			{
-				G += w[xi->index-1]*(xi->value);
-				xi++;
-			}
-			G = G*yi-1;
+			G = instance_dot(prob, i, w)*yi-1;
 
 			C = upper_bound[GETI(i)];
 			G += alpha[i]*diag[GETI(i)];
@@ -828,12 +1393,7 @@ static void solve_l2r_l1l2_svc(
 				double alpha_old = alpha[i];
 				alpha[i] = min(max(alpha[i] - G/QD[i], 0.0), C);
 				d = (alpha[i] - alpha_old)*yi;
-				xi = prob->x[i];
-				while (xi->index != -1)
-				{
-					w[xi->index-1] += d*xi->value;
-					xi++;
-				}
+				instance_axpy(prob, i, d, w);
 			}
 		}
 
@@ -1720,6 +2280,7 @@ static void transpose(const problem *prob, feature_node **x_space_ret, problem *
 	prob_col->n = n;
 	prob_col->y = new int[l];
 	prob_col->x = new feature_node*[n];
+	prob_col->dense = NULL;
 
 	for(i=0; i<l; i++)
 		prob_col->y[i] = prob->y[i];
@@ -1837,7 +2398,7 @@ static void train_one(const problem *prob, const parameter *param, double *w, do
 	{
 		case L2R_LR:
 		{
-			fun_obj=new l2r_lr_fun(prob, Cp, Cn);
+			fun_obj=new l2r_lr_fun(prob, Cp, Cn, param->nr_block);
 			TRON tron_obj(fun_obj, eps*min(pos,neg)/prob->l);
 			tron_obj.set_print_string(liblinear_print_string);
 			tron_obj.tron(w);
@@ -1846,7 +2407,7 @@ static void train_one(const problem *prob, const parameter *param, double *w, do
 		}
 		case L2R_L2LOSS_SVC:
 		{
-			fun_obj=new l2r_l2_svc_fun(prob, Cp, Cn);
+			fun_obj=new l2r_l2_svc_fun(prob, Cp, Cn, param->nr_block);
 			TRON tron_obj(fun_obj, eps*min(pos,neg)/prob->l);
 			tron_obj.set_print_string(liblinear_print_string);
 			tron_obj.tron(w);
@@ -1854,10 +2415,10 @@ static void train_one(const problem *prob, const parameter *param, double *w, do
 			break;
 		}
 		case L2R_L2LOSS_SVC_DUAL:
-			solve_l2r_l1l2_svc(prob, w, eps, Cp, Cn, L2R_L2LOSS_SVC_DUAL);
+			solve_l2r_l1l2_svc(prob, w, eps, Cp, Cn, L2R_L2LOSS_SVC_DUAL, param->nr_block);
 			break;
 		case L2R_L1LOSS_SVC_DUAL:
-			solve_l2r_l1l2_svc(prob, w, eps, Cp, Cn, L2R_L1LOSS_SVC_DUAL);
+			solve_l2r_l1l2_svc(prob, w, eps, Cp, Cn, L2R_L1LOSS_SVC_DUAL, param->nr_block);
 			break;
 		case L1R_L2LOSS_SVC:
 		{
@@ -1900,6 +2461,7 @@ model* train(const problem *prob, const parameter *param)
 	int n = prob->n;
 	int w_size = prob->n;
 	model *model_ = Malloc(model,1);
+	model_->mapped = NULL;
 
 	if(prob->bias>=0)
 		model_->nr_feature=n-1;
@@ -1938,19 +2500,31 @@ model* train(const problem *prob, const parameter *param)
 	}
 
 	// constructing the subproblem
-	feature_node **x = Malloc(feature_node *,l);
-	for(i=0;i<l;i++)
-		x[i] = prob->x[perm[i]];
-
+	feature_node **x = NULL;
 	int k;
 	problem sub_prob;
 	sub_prob.l = l;
 	sub_prob.n = n;
-	sub_prob.x = Malloc(feature_node *,sub_prob.l);
+	sub_prob.x = NULL;
+	sub_prob.dense = NULL;
 	sub_prob.y = Malloc(int,sub_prob.l);
 
-	for(k=0; k<sub_prob.l; k++)
-		sub_prob.x[k] = x[k];
+	if(prob->dense)
+	{
+		sub_prob.dense = Malloc(float *,sub_prob.l);
+		for(k=0; k<sub_prob.l; k++)
+			sub_prob.dense[k] = prob->dense[perm[k]];
+	}
+	else
+	{
+		x = Malloc(feature_node *,l);
+		for(i=0;i<l;i++)
+			x[i] = prob->x[perm[i]];
+
+		sub_prob.x = Malloc(feature_node *,sub_prob.l);
+		for(k=0; k<sub_prob.l; k++)
+			sub_prob.x[k] = x[k];
+	}
 
 	// multi-class svm by Crammer and Singer
 	if(param->solver_type == MCSVM_CS)
@@ -2010,6 +2584,7 @@ model* train(const problem *prob, const parameter *param)
 	free(count);
 	free(perm);
 	free(sub_prob.x);
+	free(sub_prob.dense);
 	free(sub_prob.y);
 	free(weighted_C);
 	return model_;
@@ -2041,33 +2616,57 @@ void cross_validation(const problem *prob, const parameter *param, int nr_fold,
 		subprob.bias = prob->bias;
 		subprob.n = prob->n;
 		subprob.l = l-(end-begin);
-		subprob.x = Malloc(struct feature_node*,subprob.l);
+		subprob.x = prob->dense ? NULL : Malloc(struct feature_node*,subprob.l);
+		subprob.dense = prob->dense ? Malloc(float*,subprob.l) : NULL;
 		subprob.y = Malloc(int,subprob.l);
 
 		k=0;
-		for(j=0;j<begin;j++)
+		for(j=0;j<l;j++)
 		{
-			subprob.x[k] = prob->x[perm[j]];
-			subprob.y[k] = prob->y[perm[j]];
-			++k;
-		}
-		for(j=end;j<l;j++)
-		{
-			subprob.x[k] = prob->x[perm[j]];
+			if(j>=begin && j<end)
+				continue;
+			if(prob->dense)
+				subprob.dense[k] = prob->dense[perm[j]];
+			else
+				subprob.x[k] = prob->x[perm[j]];
 			subprob.y[k] = prob->y[perm[j]];
 			++k;
 		}
 		struct model *submodel = train(&subprob,param);
+		double *dec_values = Malloc(double, submodel->nr_class);
 		for(j=begin;j<end;j++)
-			target[perm[j]] = predict(submodel,prob->x[perm[j]]);
+			if(prob->dense)
+				target[perm[j]] = predict_values_dense(submodel,prob->dense[perm[j]],dec_values);
+			else
+				target[perm[j]] = predict(submodel,prob->x[perm[j]]);
+		free(dec_values);
 		free_and_destroy_model(&submodel);
 		free(subprob.x);
+		free(subprob.dense);
 		free(subprob.y);
 	}
 	free(fold_start);
 	free(perm);
 }
 
+static int decision_label(const struct model *model_, const double *dec_values)
+{
+	int i;
+	int nr_class=model_->nr_class;
+	if(nr_class==2)
+		return (dec_values[0]>0)?model_->label[0]:model_->label[1];
+	else
+	{
+		int dec_max_idx = 0;
+		for(i=1;i<nr_class;i++)
+		{
+			if(dec_values[i] > dec_values[dec_max_idx])
+				dec_max_idx = i;
+		}
+		return model_->label[dec_max_idx];
+	}
+}
+
 int predict_values(const struct model *model_, const struct feature_node *x, double *dec_values)
 {
 	int idx;
@@ -2096,18 +2695,38 @@ int predict_values(const struct model *model_, const struct feature_node *x, dou
 				dec_values[i] += w[(idx-1)*nr_w+i]*lx->value;
 	}
 
-	if(nr_class==2)
-		return (dec_values[0]>0)?model_->label[0]:model_->label[1];
+	return decision_label(model_, dec_values);
+}
+
+// x holds nr_feature values, plus the bias term if the model has one
+int predict_values_dense(const struct model *model_, const float *x, double *dec_values)
+{
+	int n;
+	if(model_->bias>=0)
+		n=model_->nr_feature+1;
+	else
+		n=model_->nr_feature;
+	double *w=model_->w;
+	int nr_class=model_->nr_class;
+	int i, j;
+	int nr_w;
+	if(nr_class==2 && model_->param.solver_type != MCSVM_CS)
+		nr_w = 1;
+	else
+		nr_w = nr_class;
+
+	if(nr_w == 1)
+		dec_values[0] = dense_dot(x, w, n);
 	else
 	{
-		int dec_max_idx = 0;
-		for(i=1;i<nr_class;i++)
-		{
-			if(dec_values[i] > dec_values[dec_max_idx])
-				dec_max_idx = i;
-		}
-		return model_->label[dec_max_idx];
+		for(i=0;i<nr_w;i++)
+			dec_values[i] = 0;
+		for(j=0;j<n;j++)
+			for(i=0;i<nr_w;i++)
+				dec_values[i] += w[j*nr_w+i]*x[j];
 	}
+
+	return decision_label(model_, dec_values);
 }
 
 int predict(const model *model_, const feature_node *x)
@@ -2158,6 +2777,41 @@ static const char *solver_type_table[]=
 	"L1R_L2LOSS_SVC", "L1R_LR", "L2R_LR_DUAL", NULL
 };
 
+// Models are written to NAME.tmp, which then replaces the model file. A
+// loaded binary model maps its file, so truncating that file in place
+// would make reads of the mapped weights fault.
+static FILE *open_replacement(const char *file_name, const char *mode, char **tmp_file_name)
+{
+	*tmp_file_name = Malloc(char, strlen(file_name)+5);
+	sprintf(*tmp_file_name, "%s.tmp", file_name);
+	FILE *fp = fopen(*tmp_file_name, mode);
+	if(fp==NULL)
+	{
+		free(*tmp_file_name);
+		*tmp_file_name = NULL;
+	}
+	return fp;
+}
+
+// closes fp and moves its file over file_name; -1 on failure
+static int replace_file(FILE *fp, char *tmp_file_name, const char *file_name)
+{
+	int error = ferror(fp) != 0;
+	if(fclose(fp) != 0)
+		error = 1;
+#ifdef _WIN32
+	if(!error)
+		remove(file_name);
+#endif
+	if(error || rename(tmp_file_name, file_name) != 0)
+	{
+		remove(tmp_file_name);
+		error = 1;
+	}
+	free(tmp_file_name);
+	return error ? -1 : 0;
+}
+
 int save_model(const char *model_file_name, const struct model *model_)
 {
 	int i;
@@ -2170,7 +2824,8 @@ int save_model(const char *model_file_name, const struct model *model_)
 	else
 		n=nr_feature;
 	int w_size = n;
-	FILE *fp = fopen(model_file_name,"w");
+	char *tmp_file_name;
+	FILE *fp = open_replacement(model_file_name, "w", &tmp_file_name);
 	if(fp==NULL) return -1;
 
 	int nr_w;
@@ -2199,8 +2854,219 @@ int save_model(const char *model_file_name, const struct model *model_)
 		fprintf(fp, "\n");
 	}
 
-	if (ferror(fp) != 0 || fclose(fp) != 0) return -1;
-	else return 0;
+	return replace_file(fp, tmp_file_name, model_file_name);
+}
+
+// A binary model is a header, the labels and the weights, each part at a
+// multiple of BINARY_ALIGN bytes. float64 weights are used in place from a
+// private mapping of the file; float32 weights are widened into w. The
+// checksum covers the file with the checksum field set to 0.
+
+#define BINARY_MAGIC "LLMODEL"
+#define BINARY_VERSION 1
+#define BINARY_BYTE_ORDER 0x01020304
+#define BINARY_ALIGN 64
+
+struct binary_header
+{
+	char magic[8];
+	int version;
+	int byte_order;
+	int solver_type;
+	int nr_class;
+	int nr_feature;
+	int weight_type;
+	int label_offset;
+	int w_offset;
+	unsigned int checksum;
+	int reserved;
+	double bias;
+};
+
+static int binary_align(int offset)
+{
+	return (offset+BINARY_ALIGN-1)/BINARY_ALIGN*BINARY_ALIGN;
+}
+
+// FNV-1a
+static unsigned int binary_checksum(const void *data, size_t size, unsigned int h)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for(size_t i=0; i<size; i++)
+	{
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static unsigned int binary_file_checksum(const binary_header *header, const void *body, size_t body_size)
+{
+	binary_header h = *header;
+	h.checksum = 0;
+	return binary_checksum(body, body_size, binary_checksum(&h, sizeof(h), 2166136261u));
+}
+
+// size of the file the header describes
+static size_t binary_size(const binary_header *header)
+{
+	int w_size = header->bias>=0 ? header->nr_feature+1 : header->nr_feature;
+	int nr_w = (header->nr_class==2 && header->solver_type != MCSVM_CS) ? 1 : header->nr_class;
+	size_t size = header->weight_type == BINARY_FLOAT32 ? sizeof(float) : sizeof(double);
+	return header->w_offset + (size_t)w_size*nr_w*size;
+}
+
+static void *map_file(const char *file_name, size_t *size)
+{
+#ifdef _WIN32
+	FILE *fp = fopen(file_name,"rb");
+	if(fp == NULL)
+		return NULL;
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	rewind(fp);
+	void *data = malloc(*size);
+	if(data != NULL && fread(data, 1, *size, fp) != *size)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	return data;
+#else
+	struct stat st;
+	int fd = open(file_name, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+	// private and writable, so a caller may still change w
+	void *data = mmap(NULL, *size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return data == MAP_FAILED ? NULL : data;
+#endif
+}
+
+static void unmap_file(void *data, size_t size)
+{
+#ifdef _WIN32
+	(void)size;
+	free(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+static model *load_model_binary(const char *model_file_name)
+{
+	size_t size;
+	void *data = map_file(model_file_name, &size);
+	if(data == NULL)
+		return NULL;
+
+	binary_header header;
+	int nr_solver = 0;
+	while(solver_type_table[nr_solver])
+		nr_solver++;
+	if(size < sizeof(header))
+	{
+		unmap_file(data, size);
+		return NULL;
+	}
+	memcpy(&header, data, sizeof(header));
+	if(header.version != BINARY_VERSION || header.byte_order != BINARY_BYTE_ORDER
+		|| header.solver_type < 0 || header.solver_type >= nr_solver
+		|| header.nr_class < 1 || (size_t)header.nr_class > size
+		|| header.nr_feature < 0 || (size_t)header.nr_feature > size
+		|| (header.weight_type != BINARY_FLOAT64 && header.weight_type != BINARY_FLOAT32)
+		|| header.label_offset != binary_align(sizeof(header))
+		|| header.w_offset != binary_align(header.label_offset + header.nr_class*sizeof(int))
+		|| binary_size(&header) != size)
+	{
+		fprintf(stderr,"unsupported binary model file.\n");
+		unmap_file(data, size);
+		return NULL;
+	}
+	if(binary_file_checksum(&header, (char *)data+sizeof(header), size-sizeof(header)) != header.checksum)
+	{
+		fprintf(stderr,"checksum mismatch in model file.\n");
+		unmap_file(data, size);
+		return NULL;
+	}
+
+	model *model_ = Malloc(model,1);
+	model_->param.solver_type = header.solver_type;
+	model_->nr_class = header.nr_class;
+	model_->nr_feature = header.nr_feature;
+	model_->bias = header.bias;
+	if(header.weight_type == BINARY_FLOAT64)
+	{
+		model_->label = (int *)((char *)data+header.label_offset);
+		model_->w = (double *)((char *)data+header.w_offset);
+		model_->mapped = data;
+		return model_;
+	}
+
+	size_t w_count = (size - header.w_offset)/sizeof(float);
+	const float *w = (const float *)((char *)data+header.w_offset);
+	model_->label = Malloc(int,header.nr_class);
+	memcpy(model_->label, (char *)data+header.label_offset, header.nr_class*sizeof(int));
+	model_->w = Malloc(double,w_count);
+	for(size_t i=0; i<w_count; i++)
+		model_->w[i] = w[i];
+	model_->mapped = NULL;
+	unmap_file(data, size);
+	return model_;
+}
+
+int save_model_binary(const char *model_file_name, const struct model *model_, int weight_type)
+{
+	int i;
+	binary_header header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+	header.version = BINARY_VERSION;
+	header.byte_order = BINARY_BYTE_ORDER;
+	header.solver_type = model_->param.solver_type;
+	header.nr_class = model_->nr_class;
+	header.nr_feature = model_->nr_feature;
+	header.weight_type = weight_type;
+	header.label_offset = binary_align(sizeof(header));
+	header.w_offset = binary_align(header.label_offset + model_->nr_class*sizeof(int));
+	header.bias = model_->bias;
+
+	size_t size = binary_size(&header);
+	size_t w_count = (size - header.w_offset)/(weight_type == BINARY_FLOAT32 ? sizeof(float) : sizeof(double));
+	char *data = (char *)calloc(size, 1);
+	if(data == NULL)
+		return -1;
+	memcpy(data+header.label_offset, model_->label, model_->nr_class*sizeof(int));
+	if(weight_type == BINARY_FLOAT32)
+	{
+		float *w = (float *)(data+header.w_offset);
+		for(i=0; i<(int)w_count; i++)
+			w[i] = (float)model_->w[i];
+	}
+	else
+		memcpy(data+header.w_offset, model_->w, w_count*sizeof(double));
+	header.checksum = binary_file_checksum(&header, data+sizeof(header), size-sizeof(header));
+	memcpy(data, &header, sizeof(header));
+
+	char *tmp_file_name;
+	FILE *fp = open_replacement(model_file_name, "wb", &tmp_file_name);
+	if(fp==NULL)
+	{
+		free(data);
+		return -1;
+	}
+	fwrite(data, 1, size, fp);
+	free(data);
+	return replace_file(fp, tmp_file_name, model_file_name);
 }
 
 struct model *load_model(const char *model_file_name)
@@ -2208,6 +3074,14 @@ struct model *load_model(const char *model_file_name)
 	FILE *fp = fopen(model_file_name,"r");
 	if(fp==NULL) return NULL;
 
+	char magic[sizeof(BINARY_MAGIC)];
+	if(fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, BINARY_MAGIC, sizeof(magic)) == 0)
+	{
+		fclose(fp);
+		return load_model_binary(model_file_name);
+	}
+	rewind(fp);
+
 	int i;
 	int nr_feature;
 	int n;
@@ -2217,6 +3091,7 @@ struct model *load_model(const char *model_file_name)
 	parameter& param = model_->param;
 
 	model_->label = NULL;
+	model_->mapped = NULL;
 
 	char cmd[81];
 	while(1)
@@ -2320,6 +3195,11 @@ void get_labels(const model *model_, int* label)
 
 void free_model_content(struct model *model_ptr)
 {
+	if(model_ptr->mapped != NULL)
+	{
+		unmap_file(model_ptr->mapped, binary_size((binary_header *)model_ptr->mapped));
+		return;
+	}
 	if(model_ptr->w != NULL)
 		free(model_ptr->w);
 	if(model_ptr->label != NULL)
@@ -2352,6 +3232,9 @@ const char *check_parameter(const problem *prob, const parameter *param)
 	if(param->C <= 0)
 		return "C <= 0";
 
+	if(param->nr_block < 1)
+		return "nr_block < 1";
+
 	if(param->solver_type != L2R_LR
 		&& param->solver_type != L2R_L2LOSS_SVC_DUAL
 		&& param->solver_type != L2R_L2LOSS_SVC
@@ -2362,6 +3245,13 @@ const char *check_parameter(const problem *prob, const parameter *param)
 		&& param->solver_type != L2R_LR_DUAL)
 		return "unknown solver type";
 
+	if(prob->dense != NULL
+		&& param->solver_type != L2R_LR
+		&& param->solver_type != L2R_L2LOSS_SVC_DUAL
+		&& param->solver_type != L2R_L2LOSS_SVC
+		&& param->solver_type != L2R_L1LOSS_SVC_DUAL)
+		return "solver does not support dense problems";
+
 	return NULL;
 }
 
@@ -2380,3 +3270,11 @@ void set_print_string_function(void (*print_func)(const char*))
 		liblinear_print_string = print_func;
 }
 
+void set_parallel_function(void (*parallel_func)(int n, int grain, void (*body)(int begin, int end, void *data), void *data))
+{
+	if (parallel_func == NULL)
+		liblinear_parallel = &parallel_serial;
+	else
+		liblinear_parallel = parallel_func;
+}
+
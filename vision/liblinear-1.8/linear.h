@@ -17,6 +17,7 @@ struct problem
 	int *y;
 	struct feature_node **x;
 	double bias;            /* < 0 if no bias term */  
+	float **dense;          /* if not NULL, instance i is the n values at dense[i] and x is not used */
 };
 
 enum { L2R_LR, L2R_L2LOSS_SVC_DUAL, L2R_L2LOSS_SVC, L2R_L1LOSS_SVC_DUAL, MCSVM_CS, L1R_L2LOSS_SVC, L1R_LR, L2R_LR_DUAL }; /* solver_type */
@@ -31,6 +32,7 @@ struct parameter
 	int nr_weight;
 	int *weight_label;
 	double* weight;
+	int nr_block;		/* instance blocks of the parallel solvers, 1 for the serial order; independent of the threads */
 };
 
 struct model
@@ -41,16 +43,21 @@ struct model
 	double *w;
 	int *label;		/* label of each class */
 	double bias;
+	void *mapped;		/* binary model file that w and label point into, or NULL */
 };
 
 struct model* train(const struct problem *prob, const struct parameter *param);
 void cross_validation(const struct problem *prob, const struct parameter *param, int nr_fold, int *target);
 
 int predict_values(const struct model *model_, const struct feature_node *x, double* dec_values);
+int predict_values_dense(const struct model *model_, const float *x, double* dec_values);
 int predict(const struct model *model_, const struct feature_node *x);
 int predict_probability(const struct model *model_, const struct feature_node *x, double* prob_estimates);
 
+enum { BINARY_FLOAT64, BINARY_FLOAT32 }; /* weight_type of binary models */
+
 int save_model(const char *model_file_name, const struct model *model_);
+int save_model_binary(const char *model_file_name, const struct model *model_, int weight_type);
 struct model *load_model(const char *model_file_name);
 
 int get_nr_feature(const struct model *model_);
@@ -64,6 +71,10 @@ void destroy_param(struct parameter *param);
 const char *check_parameter(const struct problem *prob, const struct parameter *param);
 int check_probability_model(const struct model *model);
 void set_print_string_function(void (*print_func) (const char*));
+/* runs body over ranges that cover [0, n), each of at least grain items, and
+   returns when all have finished; the ranges may run concurrently. NULL
+   restores the serial default. */
+void set_parallel_function(void (*parallel_func)(int n, int grain, void (*body)(int begin, int end, void *data), void *data));
 
 #ifdef __cplusplus
 }
@@ -2,204 +2,111 @@
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
-#include <ctime>
 
 #include <QFile>
+#include <QFileInfo>
 #include <QDir>
 #include <QTextStream>
+#include <QTime>
 
 #include <QDebug>
 
 #include "logic.h"
+#include "detector.h"
+#include "parallel.h"
+#include "server.h"
 #include "liblinear-1.8/linear.h"
 
-inline double Logic::getBrightness(QRgb p)
-{
-    return qRed(p) * RED_INTENSE +
-           qGreen(p) * GREEN_INTENSE +
-           qBlue(p) * BLUE_INTENSE;
-}
-
-inline int Logic::check(int x, int n)
-{
-    if (x >= n)
-        return n - 1;
-    if (x < 0)
-        return 0;
-    return x;
-}
-
-inline int Logic::checkBound(int x)
-{
-    if (x > 255)
-        return 255;
-    if (x < 0)
-        return 0;
-    return x;
-}
-
-void Logic::Gauss(QImage& image)
-{
-    const int size = 5;
-    int x, y, k, l, n, m;
-    double rsum, gsum, bsum;
-    QRgb p;
-
-    double gauss[size] = { 0.05448868454964295172,
-                           0.24420134200323337370,
-                           0.40261994689424751570,
-                           0.24420134200323337370,
-                           0.05448868454964295172
-                         };
-
-    QImage original(image);
-
-    int w = original.width();
-    int h = original.height();
-
-    QRgb *line;
-
-    for (x = 0; x < w; x++) {
-        for (y = 0; y < h; y++) {
-            rsum = gsum = bsum = 0.0;
-            k = 0;
-            m = check(y - (k - size / 2), h);
-            line = (QRgb*)original.scanLine(m);
-            for (l = 0; l < size; l++) {
-                n = check(x - (l - size / 2), w);
-                p = line[n];
-                rsum += gauss[l] * qRed(p);
-                gsum += gauss[l] * qGreen(p);
-                bsum += gauss[l] * qBlue(p);
-            }
-            line = (QRgb*)image.scanLine(y);
-            line[x] = qRgb(checkBound(rsum), checkBound(gsum), checkBound(bsum));
-        }
-    }
-
-    original = image;
-
-    for (x = 0; x < w; x++) {
-        for (y = 0; y < h; y++) {
-            rsum = gsum = bsum = 0.0;
-            l = 0;
-            n = check(x - (l - size / 2), w);
-            for (k = 0; k < size; k++) {
-                m = check(y - (k - size / 2), h);
-                line = (QRgb*)original.scanLine(m);
-                p = line[n];
-                rsum += gauss[k] * qRed(p);
-                gsum += gauss[k] * qGreen(p);
-                bsum += gauss[k] * qBlue(p);
-            }
-            line = (QRgb*)image.scanLine(y);
-            line[x] = qRgb(checkBound(rsum), checkBound(gsum), checkBound(bsum));
-        }
-    }
-}
-
-int** Logic::calculateHOG(QImage& image)
-{
-    Gauss(image);
-
-    double gradX, gradY;
-    double angle;
-    double coef = HOG_SIZE / (2 * PI);
-    int height = image.height();
-    int width = image.width();
-    int **hog = 0;
-    int i, j;
-
-    hog = new int*[width];
-    for (i = 0; i < width; i++) {
-        hog[i] = new int[height];
-        for (j = 0; j < height; j++) {
-            gradX = getBrightness(image.pixel(check(i + 1, width), check(j, height))) - getBrightness(image.pixel(check(i - 1, width), check(j, height)));
-            gradY = getBrightness(image.pixel(check(i, width), check(j + 1, height))) - getBrightness(image.pixel(check(i, width), check(j - 1, height)));
-            gradX /= 2.;
-            gradY /= 2.;
-            angle = atan2(gradY, gradX) + PI;
-            if (angle > 2 * PI) {
-                angle -= EPS;
+const double gauss[GAUSS_SIZE] = { 0.05448868454964295172,
+                                          0.24420134200323337370,
+                                          0.40261994689424751570,
+                                          0.24420134200323337370,
+                                          0.05448868454964295172
+                                        };
+
+// The horizontal pass reads two rows down and the vertical pass two
+// columns right, which shifts the result by (-2, -2).
+struct GaussRows {
+    const QImage *source;
+    uchar *bits;
+    int bytesPerLine;
+    bool vertical;
+
+    void operator()(int begin, int end) const
+    {
+        int w = source->width();
+        int h = source->height();
+        const QRgb *rows[GAUSS_SIZE];
+        QVector<QRgb> column(w);
+        QRgb *line;
+        int x, y, k;
+
+        for (y = begin; y < end; y++) {
+            line = (QRgb*)(bits + y * bytesPerLine);
+            if (!vertical) {
+                rows[0] = (const QRgb*)source->constScanLine(check(y + GAUSS_SIZE / 2, 0, h));
+                convolveRow(rows, 1, gauss, GAUSS_SIZE, 0, w, line, 0, w);
+                continue;
             }
-            int k = (int)(angle * coef);
-            assert(k >= 0 && k < HOG_SIZE);
-            hog[i][j] = k;
+            for (k = 0; k < GAUSS_SIZE; k++)
+                rows[k] = (const QRgb*)source->constScanLine(check(y - (k - GAUSS_SIZE / 2), 0, h));
+            convolveRow(rows, GAUSS_SIZE, gauss, 1, 0, w, column.data(), 0, w);
+            for (x = 0; x < w; x++)
+                line[x] = column[check(x + GAUSS_SIZE / 2, 0, w)];
         }
     }
+};
 
-    return hog;
-}
-
-void Logic::addUnitHOG(int **hog, QVector<int>& hist, int x0, int y0, int x1, int y1)
+void Logic::Gauss(QImage& image)
 {
-    int h[HOG_SIZE];
-    int i, j;
-
-    assert(hog);
-
-    for (i = 0; i < HOG_SIZE; i++) {
-        h[i] = 0;
-    }
+    if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+        image = image.convertToFormat(QImage::Format_RGB32);
 
-    for (i = x0; i < x1; i++) {
-        for (j = y0; j < y1; j++) {
-            h[hog[i][j]]++;
-        }
-    }
+    QImage original(image);
+    GaussRows rows;
+    rows.source = &original;
+    // bits() detaches, so take the pointer once before going parallel
+    rows.bits = image.bits();
+    rows.bytesPerLine = image.bytesPerLine();
+    rows.vertical = false;
+    parallelFor(0, image.height(), rows, 8);
 
-    for (i = 0; i < HOG_SIZE; i++) {
-        hist.push_back(h[i]);
-    }
+    original = image;
+    rows.bits = image.bits();
+    rows.vertical = true;
+    parallelFor(0, image.height(), rows, 8);
 }
 
-QVector<int> Logic::getHOG(int **hog, int x0, int x1, int y0, int y1)
-{
-    QVector<int> hist;
+// liblinear's parallel loops, run on the scheduler
+struct LinearRanges {
+    void (*body)(int, int, void*);
+    void *data;
 
-    for (int i = x0; i < x1; i += X_SIZE) {
-        for (int j = y0; j < y1; j += Y_SIZE) {
-            addUnitHOG(hog, hist, i, j, check(i + X_SIZE, x1), check(j + Y_SIZE, y1));
-        }
+    void operator()(int begin, int end) const
+    {
+        body(begin, end, data);
     }
+};
 
-    return nonlinear(hist);
-}
-
-QVector<int> Logic::nonlinear(QVector<int>& x)
+static void linearParallel(int n, int grain, void (*body)(int, int, void*), void *data)
 {
-    QVector<int> res = x; //FIXME
-    double k, v, l, z;
-    int i, j;
-    for (i = 0; i < x.size(); i++) {
-        z = x[i];
-        for (j = -APPROX_ORDER; j <= APPROX_ORDER; j++) {
-            if (z == 0) {
-                res.push_back(0);
-                res.push_back(0);
-                continue;
-            }
-            l = j * APPROX_STEP;
-            k = 1 / cosh(PI * l);
-            v = sqrt(z * k);
-            res.push_back(cos(-l * log(z)) * v * 10);
-            res.push_back(sin(-l * log(z)) * v * 10);
-        }
-    }
-    return res;
+    LinearRanges ranges;
+    ranges.body = body;
+    ranges.data = data;
+    parallelFor(0, n, ranges, grain);
 }
 
 bool operator<(const Descr& a,const Descr& b) {
     return a.num < b.num;
 }
 
-void Logic::bootStrap(const QString& descrFileName, const QString& dirName, const QString& coefFileName)
+void Logic::bootStrap(const QString& descrFileName, const QString& dirName, const QString& coefFileName, int solver)
 {
-    learn(descrFileName, dirName, coefFileName);
+    learn(descrFileName, dirName, coefFileName, solver);
     QVector<Descr> res = classify("", dirName, coefFileName);
     QVector<Descr> ans = inputDescr(descrFileName);
     QVector<Descr> fp = eval(ans, res);
-    learn(descrFileName, dirName, coefFileName, fp);
+    learn(descrFileName, dirName, coefFileName, solver, fp);
 }
 
 void Logic::outputDescr(const QString& fileName, QVector<Descr>& description)
@@ -242,7 +149,7 @@ QVector<Descr> Logic::inputDescr(const QString& fileName)
     return description;
 }
 
-void Logic::learn(const QString& descrFileName, const QString& dirName, const QString& coefFileName, const QVector<Descr>& fp)
+void Logic::learn(const QString& descrFileName, const QString& dirName, const QString& coefFileName, int solver, const QVector<Descr>& fp)
 {
     QDir dir(dirName);
     QImage image;
@@ -252,7 +159,8 @@ void Logic::learn(const QString& descrFileName, const QString& dirName, const QS
         return;
     }
 
-    int t = clock();
+    QTime t;
+    t.start();
 
     dir.setFilter(QDir::Files | QDir::Readable);
     QStringList list = dir.entryList();
@@ -265,7 +173,7 @@ void Logic::learn(const QString& descrFileName, const QString& dirName, const QS
     int i, j, j1, j2;
     int w;
 
-    int **hog;
+    Detector detector;
 
     QVector<QVector<int> > trainFeatures;
     QVector<int> trainLabels;
@@ -285,10 +193,9 @@ void Logic::learn(const QString& descrFileName, const QString& dirName, const QS
         curName = list.at(i);
 
         image = QImage(dir.absoluteFilePath(curName));
-        if (image.isNull()) {
+        if (image.isNull() || !detector.setImage(image)) {
             continue;
         }
-        hog = calculateHOG(image);
 
         j1 = -1;
         j2 = 0;
@@ -308,21 +215,21 @@ void Logic::learn(const QString& descrFileName, const QString& dirName, const QS
         if (j1 != -1) {
             for (j = j1; j < j2; j++) {
                 if (!flagF) {
-                    trainFeatures.push_front(getHOG(hog, description[j].x0, description[j].x1, 0, image.height()));
+                    trainFeatures.push_front(detector.features(description[j].x0, description[j].x1, 0, image.height()));
                     trainLabels.push_front(1);
                     flagF = true;
                     continue;
                 }
-                trainFeatures.push_back(getHOG(hog, description[j].x0, description[j].x1, 0, image.height()));
+                trainFeatures.push_back(detector.features(description[j].x0, description[j].x1, 0, image.height()));
                 trainLabels.push_back(1);
             }
             w = image.width();
             bool f1 = false;
             if (description[j1].x0 + 2 * HUMAN_WIDTH + 1 < w) {
-                trainFeatures.push_back(getHOG(hog, description[j1].x0 + HUMAN_WIDTH + 1, description[j1].x0 + 2 * HUMAN_WIDTH + 1, 0, image.height()));
+                trainFeatures.push_back(detector.features(description[j1].x0 + HUMAN_WIDTH + 1, description[j1].x0 + 2 * HUMAN_WIDTH + 1, 0, image.height()));
                 f1 = true;
             } else if (description[j1].x0 - HUMAN_WIDTH - 1 >= 0) {
-                trainFeatures.push_back(getHOG(hog, description[j1].x0 - HUMAN_WIDTH - 1, description[j1].x0 - 1, 0, image.height()));
+                trainFeatures.push_back(detector.features(description[j1].x0 - HUMAN_WIDTH - 1, description[j1].x0 - 1, 0, image.height()));
                 f1 = true;
             }
             if (f1)
@@ -346,14 +253,12 @@ void Logic::learn(const QString& descrFileName, const QString& dirName, const QS
             }
             if (j1 != -1) {
                 for (j = j1; j < j2; j++) {
-                    trainFeatures.push_back(getHOG(hog, fp[j].x0, fp[j].x1, 0, image.height()));
+                    trainFeatures.push_back(detector.features(fp[j].x0, fp[j].x1, 0, image.height()));
                     trainLabels.push_back(-1);
                 }
             }
         }
 
-        delete [] hog;
-
         printf("#");
         fflush(stdout);
     }
@@ -364,128 +269,126 @@ void Logic::learn(const QString& descrFileName, const QString& dirName, const QS
     prob.bias = 0;
     prob.n = NUM_FEATURES + 1;
 
+    // HOG features are dense, so the rows go to one aligned block of floats;
+    // the bias column stays 0 as before
+    int stride = (prob.n + 3) / 4 * 4;
+    float *rows = (float*)qMallocAligned(size_t(prob.l) * stride * sizeof(float), 16);
+    if (!rows) {
+        qWarning("Cannot allocate training data");
+        return;
+    }
+
     prob.y = new int [prob.l];
-    prob.x = new struct feature_node * [prob.l];
+    prob.x = NULL;
+    prob.dense = new float * [prob.l];
 
     for (i = 0; i < trainLabels.size(); i++) {
-        prob.x[i] = new struct feature_node [NUM_FEATURES + 1];
-        prob.x[i][NUM_FEATURES].index = -1;
+        prob.dense[i] = rows + size_t(i) * stride;
         for (j = 0; j < NUM_FEATURES; j++) {
-            prob.x[i][j].index = 1 + j;
-            prob.x[i][j].value = trainFeatures[i][j];
+            prob.dense[i][j] = trainFeatures[i][j];
+        }
+        for (; j < stride; j++) {
+            prob.dense[i][j] = 0;
         }
         prob.y[i] = trainLabels[i];
+        trainFeatures[i] = QVector<int>();
     }
 
     struct parameter param;
-    param.solver_type = L2R_L2LOSS_SVC_DUAL;
+    param.solver_type = solver;
     param.C = 1;
     param.eps = 1e-4;
     param.nr_weight = 0;
     param.weight_label = NULL;
     param.weight = NULL;
+    param.nr_block = LEARN_BLOCKS;
+
+    const char *error = check_parameter(&prob, &param);
+    if (error) {
+        qWarning("Cannot train: %s", error);
+        delete [] prob.y;
+        delete [] prob.dense;
+        qFreeAligned(rows);
+        return;
+    }
 
     printf("1\n");
 
+    set_parallel_function(linearParallel);
     struct model *model = train(&prob, &param);
 
     printf("1\n");
 
-    if (save_model(coefFileName.toAscii(), model)) {
+    if (save_model_binary(coefFileName.toAscii(), model, BINARY_FLOAT64)) {
         qWarning("Cannot save model to file");
     }
 
-    printf("learning time: %lfs\n", double(clock() - t) / CLOCKS_PER_SEC);
+    printf("learning time: %lfs\n", t.elapsed() / 1000.);
 
     free_and_destroy_model(&model);
     destroy_param(&param);
     delete [] prob.y;
-    for (i = 0; i < prob.l; i++) {
-        delete [] prob.x[i];
-    }
-    delete [] prob.x;
+    delete [] prob.dense;
+    qFreeAligned(rows);
 }
 
-QVector<QRect> Logic::detect(QImage& image, struct model *model)
+bool Logic::convertModel(const QString& inFileName, const QString& outFileName, const QString& format)
 {
-    int i, j;
-    int width = image.width();
-    QVector<int> features;
-    QVector<double> prob;
-    QVector<int> pos;
-    QVector<QRect> answer;
-    double p;
-
-    struct feature_node *x = new struct feature_node [NUM_FEATURES + 1];
-    x[NUM_FEATURES].index = -1;
-
-    int **hog = calculateHOG(image);
-
-    for (i = 0; i < width - HUMAN_WIDTH; i += STEP) {
-        features = getHOG(hog, i, i + HUMAN_WIDTH, 0, image.height());
-        for (j = 0; j < NUM_FEATURES; j++) {
-            x[j].index = j + 1;
-            x[j].value = features[j];
-        }
-        predict_values(model, x, &p);
-
-        if (p > THRESHOLD) {
-            prob.push_back(p);
-            pos.push_back(i);
-        }
+    struct model *model;
+    int error;
 
-        features.clear();
+    if (format != "text" && format != "binary" && format != "binary32") {
+        qWarning("Unknown model format");
+        return false;
     }
 
-    delete [] hog;
+    // binary models are mapped, so their file must not be rewritten while loaded
+    if (QFileInfo(outFileName).exists() &&
+        QFileInfo(inFileName).canonicalFilePath() == QFileInfo(outFileName).canonicalFilePath()) {
+        qWarning("Cannot convert a model file into itself");
+        return false;
+    }
 
-    supressNonMax(answer, prob, pos);
+    if ((model = load_model(inFileName.toAscii())) == 0) {
+        qWarning("Cannot load model from file");
+        return false;
+    }
 
-    delete [] x;
+    if (format == "text") {
+        error = save_model(outFileName.toAscii(), model);
+    } else {
+        error = save_model_binary(outFileName.toAscii(), model, format == "binary" ? BINARY_FLOAT64 : BINARY_FLOAT32);
+    }
+    free_and_destroy_model(&model);
 
-    return answer;
+    if (error) {
+        qWarning("Cannot save model to file");
+        return false;
+    }
+    return true;
 }
 
-void Logic::supressNonMax(QVector<QRect>& answer, QVector<double>& prob, QVector<int> pos)
+bool Logic::serve(const QString& coefFileName, const QString& socketName)
 {
-    double cur_max;
-    int i_max;
-    int sz;
-    sz = prob.size();
-
-    bool f;
-    int i;
-
-    double thrs = THRESHOLD;
-    while (true) {
-        cur_max = 0;
-        for (i = 0; i < prob.size(); i++) {
-            if (prob[i] > cur_max) {
-                cur_max = prob[i];
-                i_max = i;
-            }
-        }
-        if (cur_max < thrs) {
-            break;
-        }
-        answer.push_back(QRect(pos[i_max], 0, HUMAN_WIDTH, HUMAN_HEIGHT));
-
-        i = 1;
-        f = true;
-        while (f) {
-            f = false;
-            if (i_max - i >= 0 && pos[i_max] - pos[i_max - i] < HUMAN_WIDTH) {
-                prob[i_max - i] = 0;
-                f = true;
-            }
-            if (i_max + i < sz && pos[i_max + i] - pos[i_max] < HUMAN_WIDTH) {
-                prob[i_max + i] = 0;
-                f = true;
-            }
-            i++;
+    struct model *model;
+    bool ok = true;
+
+    if ((model = load_model(coefFileName.toAscii())) == 0) {
+        qWarning("Cannot load model from file");
+        return false;
+    }
+
+    {
+        Server server(model);
+        if (socketName.isEmpty()) {
+            server.serve(stdin, stdout);
+        } else {
+            ok = server.listen(socketName);
         }
-        prob[i_max] = 0;
     }
+
+    free_and_destroy_model(&model);
+    return ok;
 }
 
 QVector<QRect> Logic::detectOne(const QString& imageFileName, const QString& coefFileName, bool *ok)
@@ -505,9 +408,11 @@ QVector<QRect> Logic::detectOne(const QString& imageFileName, const QString& coe
         return QVector<QRect>();
     }
 
-    int t = clock();
-    QVector<QRect> result = detect(image, model);
-    printf("detection time: %lfs\n", double(clock() - t) / CLOCKS_PER_SEC);
+    QTime t;
+    t.start();
+    Detector detector(model);
+    QVector<QRect> result = detector.detect(image);
+    printf("detection time: %lfs\n", t.elapsed() / 1000.);
     *ok = true;
 
     free_and_destroy_model(&model);
@@ -515,10 +420,35 @@ QVector<QRect> Logic::detectOne(const QString& imageFileName, const QString& coe
     return result;
 }
 
+// Detection on one image of a directory; runs as a scheduler task, so
+// several images are processed at once.
+class DetectTask : public Task {
+public:
+    DetectTask(const QString& fileName, DetectorPool *pool, QVector<QRect> *result)
+        : fileName(fileName), pool(pool), result(result) {}
+
+    void run()
+    {
+        QImage image(fileName);
+        if (image.isNull()) {
+            return;
+        }
+        Detector *detector = pool->acquire();
+        *result = detector->detect(image);
+        pool->release(detector);
+        printf("#");
+        fflush(stdout);
+    }
+
+private:
+    QString fileName;
+    DetectorPool *pool;
+    QVector<QRect> *result;
+};
+
 QVector<Descr> Logic::classify(const QString& descrFileName, const QString& dirName, const QString& coefFileName)
 {
     QDir dir(dirName);
-    QImage image;
     struct model *model;
 
     if (!dir.exists()) {
@@ -537,12 +467,15 @@ QVector<Descr> Logic::classify(const QString& descrFileName, const QString& dirN
     QVector<Descr> description;
 
     QString curName;
-    QVector<QRect> result;
+    QStringList files;
+    QVector<int> nums;
+    QVector<QVector<QRect> > results;
 
     int j, i, num;
     bool ok;
 
-    int t = clock();
+    QTime t;
+    t.start();
 
     Descr tmp;
 
@@ -556,29 +489,36 @@ QVector<Descr> Logic::classify(const QString& descrFileName, const QString& dirN
         if (!ok) {
             continue;
         }
-        curName = list.at(i);
-        image = QImage(dir.absoluteFilePath(curName));
-        if (image.isNull()) {
-            continue;
+        files.push_back(list.at(i));
+        nums.push_back(num);
+    }
+
+    // results must not move while the tasks write to them
+    results.resize(nums.size());
+    {
+        DetectorPool pool(model);
+        TaskGroup group;
+        for (i = 0; i < nums.size(); i++) {
+            group.spawn(new DetectTask(dir.absoluteFilePath(files[i]), &pool, &results[i]));
         }
-        result = detect(image, model);
-        for (j = 0; j < result.size(); j++) {
-            tmp.num = num;
-            tmp.y0 = result[j].y();
-            tmp.x0 = result[j].x();
-            tmp.y1 = result[j].y() + result[j].height();
-            tmp.x1 = result[j].x() + result[j].width();
+        group.wait();
+    }
+    printf("\n");
+
+    for (i = 0; i < nums.size(); i++) {
+        for (j = 0; j < results[i].size(); j++) {
+            tmp.num = nums[i];
+            tmp.y0 = results[i][j].y();
+            tmp.x0 = results[i][j].x();
+            tmp.y1 = results[i][j].y() + results[i][j].height();
+            tmp.x1 = results[i][j].x() + results[i][j].width();
             description.push_back(tmp);
         }
-        //printf("Processing %d.png\n", num);
-        printf("#");
-        fflush(stdout);
     }
-    printf("\n");
 
     outputDescr(descrFileName, description);
 
-    printf("classifieing time %lfs\n", double(clock() - t) / CLOCKS_PER_SEC);
+    printf("classifieing time %lfs\n", t.elapsed() / 1000.);
 
     free_and_destroy_model(&model);
 
@@ -4,9 +4,7 @@
 #include <QImage>
 #include <QVector>
 
-const double RED_INTENSE = 0.2125;
-const double GREEN_INTENSE = 0.7154;
-const double BLUE_INTENSE = 0.0721;
+#include "imagekernels.h"
 
 const double PI = 3.1415926535897;
 
@@ -24,12 +22,25 @@ const int APPROX_ORDER = 1;
 
 const double EPS = 1e-8;
 
+const int GAUSS_SIZE = 5;
+extern const double gauss[GAUSS_SIZE];
+
+// cos and sin terms of the nonlinear map of one histogram entry
+const int NONLINEAR_TERMS = 2 * (2 * APPROX_ORDER + 1);
+// features of one cell: its histogram followed by its nonlinear map
+const int CELL_FEATURES = HOG_SIZE * (1 + NONLINEAR_TERMS);
+
 const int HUMAN_WIDTH = 80;
 const int HUMAN_HEIGHT = 200;
 
 //const int NUM_FEATURES = (HUMAN_HEIGHT / Y_SIZE) * (HUMAN_WIDTH / X_SIZE) * HOG_SIZE;
 const int NUM_FEATURES = 16128;
 
+// Instance blocks of the parallel solvers. The model depends on this, not
+// on the number of threads, so it is fixed rather than taken from the
+// machine.
+const int LEARN_BLOCKS = 8;
+
 struct Descr {
     int num;
     int x0, y0;
@@ -37,22 +48,15 @@ struct Descr {
 };
 
 class Logic {
-    static double getBrightness(QRgb p);
-    static QVector<int> getHOG(int **hog, int x0, int x1, int y0, int y1);
-    static void addUnitHOG(int **hog, QVector<int>& hist, int x0, int y0, int x1, int y1);
-    static int check(int x, int n);
-    static QVector<QRect> detect(QImage& image, struct model *model);
-    static int** calculateHOG(QImage& image);
     static void outputDescr(const QString& fileName, QVector<Descr>& description);
     static QVector<Descr> inputDescr(const QString& fileName);
     static QVector<Descr> eval(const QVector<Descr>& ans, const QVector<Descr>& res);
-    static int checkBound(int x);
-    static QVector<int> nonlinear(QVector<int>& x);
-    static void supressNonMax(QVector<QRect>& answer, QVector<double>& prob, QVector<int> pos);
 
 public:
-    static void bootStrap(const QString& descrFileName, const QString& dirName, const QString& coefFileName);
-    static void learn(const QString& descrFileName, const QString& dirName, const QString& coefFileName, const QVector<Descr>& fp = QVector<Descr>());
+    static void bootStrap(const QString& descrFileName, const QString& dirName, const QString& coefFileName, int solver);
+    static void learn(const QString& descrFileName, const QString& dirName, const QString& coefFileName, int solver, const QVector<Descr>& fp = QVector<Descr>());
+    static bool convertModel(const QString& inFileName, const QString& outFileName, const QString& format);
+    static bool serve(const QString& coefFileName, const QString& socketName = QString());
     static QVector<QRect> detectOne(const QString& imageFileName, const QString& coefFileName, bool *ok);
     static QVector<Descr> classify(const QString& descrFileName, const QString& dirName, const QString& coefFileName);
     static QVector<Descr> evaluate(const QString& ansFileName, const QString& resFileName);
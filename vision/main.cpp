@@ -1,13 +1,37 @@
 #include <QApplication>
 
 #include <stdio.h>
+#include <string.h>
 
 #include "logic.h"
 #include "main_window.h"
+#include "liblinear-1.8/linear.h"
+
+struct Solver {
+    const char *name;
+    int type;
+};
+
+static const Solver solvers[] = {
+    { "L2R_L2LOSS_SVC_DUAL", L2R_L2LOSS_SVC_DUAL },
+    { "L2R_L1LOSS_SVC_DUAL", L2R_L1LOSS_SVC_DUAL },
+    { "L2R_L2LOSS_SVC", L2R_L2LOSS_SVC },
+    { "L2R_LR", L2R_LR }
+};
+
+static int solverType(const QString& name)
+{
+    for (unsigned i = 0; i < sizeof(solvers) / sizeof(solvers[0]); i++) {
+        if (name == solvers[i].name)
+            return solvers[i].type;
+    }
+    return -1;
+}
 
 int main(int argc, char *argv[])
 {
-    QApplication app(argc, argv);
+    // the server runs without a display
+    QApplication app(argc, argv, argc < 2 || strcmp(argv[1], "--serve") != 0);
     QStringList args = app.arguments();
 
     if (args.size() == 1) {
@@ -18,8 +42,11 @@ int main(int argc, char *argv[])
     if (args.at(1) == "--help") {
         printf( "Usage: vision OPTION [FILE] ...\n"
                 "Available options:\n"
-                "--learn [-b] DIR FILE1 FILE2   learn SVM, where:\n"
+                "--learn [-b] [--solver NAME] DIR FILE1 FILE2   learn SVM, where:\n"
                 "                               -b    - specify this if you want to use bootstrapping\n"
+                "                               NAME  - L2R_L2LOSS_SVC_DUAL (default), L2R_L1LOSS_SVC_DUAL,\n"
+                "                                       or the primal L2R_L2LOSS_SVC and L2R_LR, which\n"
+                "                                       suit very large training sets\n"
                 "                               DIR   - directory with training data\n"
                 "                               FILE1 - human description file\n"
                 "                               FILE2 - where to save SVM model\n"
@@ -30,6 +57,17 @@ int main(int argc, char *argv[])
                 "--detect FILE1 FILE2         detect human on image, where:\n"
                 "                               FILE1 - image file\n"
                 "                               FILE2 - SVM model file\n"
+                "--convert FORMAT FILE1 FILE2 convert SVM model, where:\n"
+                "                               FORMAT - text, binary or binary32 (float weights)\n"
+                "                               FILE1  - SVM model file\n"
+                "                               FILE2  - where to save converted model\n"
+                "--serve FILE [SOCKET]        detect humans on images until the input ends, where:\n"
+                "                               FILE   - SVM model file\n"
+                "                               SOCKET - Unix domain socket to serve instead of\n"
+                "                                        stdin until SIGINT or SIGTERM, for the\n"
+                "                                        owner only; each line is an image path or\n"
+                "                                        \"bytes N\" followed by N bytes of an image,\n"
+                "                                        answered by a JSON line\n"
                 "--evaluate FILE1 FILE2       evaluate classifier, where:\n"
                 "                               FILE1 - answer file\n"
                 "                               FILE2 - result file (output of SVM)\n"
@@ -37,23 +75,34 @@ int main(int argc, char *argv[])
               );
         return 0;
     } else if (args.at(1) == "--learn") {
+        bool bootStrap = false;
+        int solver = L2R_L2LOSS_SVC_DUAL;
         int i;
-        if (args.size() > 6 || args.size() < 5) {
+        for (i = 2; i < args.size() - 3; i++) {
+            if (args.at(i) == "-b") {
+                bootStrap = true;
+            } else if (args.at(i) == "--solver" && i + 1 < args.size() - 3) {
+                solver = solverType(args.at(++i));
+                if (solver < 0) {
+                    printf("Unknown solver %s\n", qPrintable(args.at(i)));
+                    return 0;
+                }
+            } else {
+                printf("Wrong parameters\n");
+                return 0;
+            }
+        }
+        if (args.size() - i != 3) {
             printf("Wrong parameters\n");
             return 0;
         }
-        if (args.size() == 6) {
-            i = 1;
-        } else {
-            i = 0;
-        }
-        QString dirName = args.at(i + 2);
-        QString descrFileName = args.at(i + 3);
-        QString coefFileName = args.at(i + 4);
-        if (i) {
-            Logic::bootStrap(descrFileName, dirName, coefFileName);
+        QString dirName = args.at(i);
+        QString descrFileName = args.at(i + 1);
+        QString coefFileName = args.at(i + 2);
+        if (bootStrap) {
+            Logic::bootStrap(descrFileName, dirName, coefFileName, solver);
         } else {
-            Logic::learn(descrFileName, dirName, coefFileName);
+            Logic::learn(descrFileName, dirName, coefFileName, solver);
         }
     } else if (args.at(1) == "--classify") {
         if (args.size() != 5) {
@@ -87,6 +136,18 @@ int main(int argc, char *argv[])
         }
 
         return app.exec();
+    } else if (args.at(1) == "--convert") {
+        if (args.size() != 5) {
+            printf("Wrong parameters\n");
+            return 0;
+        }
+        Logic::convertModel(args.at(3), args.at(4), args.at(2));
+    } else if (args.at(1) == "--serve") {
+        if (args.size() != 3 && args.size() != 4) {
+            printf("Wrong parameters\n");
+            return 0;
+        }
+        Logic::serve(args.at(2), args.size() == 4 ? args.at(3) : QString());
     } else if (args.at(1) == "--evaluate") {
         if (args.size() != 4) {
             printf("Wrong parameters\n");
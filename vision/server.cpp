@@ -0,0 +1,357 @@
+#include <cerrno>
+#include <cstring>
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QFile>
+#include <QImage>
+#include <QImageReader>
+#include <QList>
+#include <QMutex>
+#include <QThread>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "server.h"
+#include "scheduler.h"
+
+// largest encoded image a request may send
+const int MAX_REQUEST_BYTES = 256 << 20;
+
+// Answers of one stream. Tasks finish in any order, so each line is
+// written whole.
+class Output {
+public:
+    explicit Output(FILE *file) : file(file) {}
+
+    void write(const QByteArray& line)
+    {
+        QMutexLocker locker(&mutex);
+        fwrite(line.constData(), 1, line.size(), file);
+        fflush(file);
+    }
+
+private:
+    FILE *file;
+    QMutex mutex;
+};
+
+static QByteArray jsonString(const QString& s)
+{
+    QByteArray utf8 = s.toUtf8();
+    QByteArray result = "\"";
+    char escape[8];
+
+    for (int i = 0; i < utf8.size(); i++) {
+        char c = utf8.at(i);
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (uchar(c) < 0x20) {
+            sprintf(escape, "\\u%04x", c);
+            result += escape;
+        } else {
+            result += c;
+        }
+    }
+    return result + '"';
+}
+
+static QByteArray error(int id, const char *message)
+{
+    return "{\"id\":" + QByteArray::number(id) + ",\"error\":\"" + message + "\"}\n";
+}
+
+class ServeTask : public Task {
+public:
+    ServeTask(int id, const QString& fileName, const QByteArray& data, DetectorPool *pool, Output *output)
+        : id(id), fileName(fileName), data(data), pool(pool), output(output) {}
+
+    void run()
+    {
+        QBuffer buffer(&data);
+        QImageReader reader;
+        QByteArray line = "{\"id\":" + QByteArray::number(id);
+        QImage image;
+        int i;
+
+        if (fileName.isNull())
+            reader.setDevice(&buffer);
+        else
+            reader.setFileName(fileName);
+        // a size the header gives is checked before the pixels are decoded
+        if (!reader.size().isValid() || Detector::accepts(reader.size()))
+            image = reader.read();
+
+        // the task lives until its group is waited for, the image bytes do not
+        data = QByteArray();
+        if (!fileName.isNull())
+            line += ",\"image\":" + jsonString(fileName);
+        if (!Detector::accepts(image.isNull() ? reader.size() : image.size())) {
+            output->write(line + ",\"error\":\"image too large\"}\n");
+            return;
+        }
+        if (image.isNull()) {
+            output->write(line + ",\"error\":\"cannot read image\"}\n");
+            return;
+        }
+
+        Detector *detector = pool->acquire();
+        QVector<QRect> result = detector->detect(image);
+        pool->release(detector);
+
+        line += ",\"detections\":[";
+        for (i = 0; i < result.size(); i++) {
+            if (i)
+                line += ',';
+            line += "{\"x\":" + QByteArray::number(result[i].x()) +
+                    ",\"y\":" + QByteArray::number(result[i].y()) +
+                    ",\"width\":" + QByteArray::number(result[i].width()) +
+                    ",\"height\":" + QByteArray::number(result[i].height()) + "}";
+        }
+        output->write(line + "]}\n");
+    }
+
+private:
+    int id;
+    QString fileName;
+    QByteArray data;
+    DetectorPool *pool;
+    Output *output;
+};
+
+// reads a line without its line break; false at the end of the stream
+static bool readLine(FILE *in, QByteArray& line)
+{
+    char buffer[1024];
+
+    line.clear();
+    while (fgets(buffer, sizeof(buffer), in)) {
+        line += buffer;
+        if (line.endsWith('\n')) {
+            line.chop(1);
+            if (line.endsWith('\r'))
+                line.chop(1);
+            return true;
+        }
+    }
+    return !line.isEmpty();
+}
+
+Server::Server(const struct model *model) : pool(model)
+{
+}
+
+void Server::serve(FILE *in, FILE *out)
+{
+    Output output(out);
+    QByteArray line;
+    int id = 0;
+
+    // A group deletes its tasks only when it is waited for, so two groups
+    // take turns: when one holds batch tasks, the other one is waited for,
+    // which by then has mostly finished. This also bounds the requests in
+    // flight. Without workers the tasks would only run inside wait, so they
+    // run right away instead.
+    TaskGroup groups[2];
+    int batch = 2 * Scheduler::threadCount();
+    int current = 0;
+    int count = 0;
+
+    while (readLine(in, line)) {
+        QString fileName;
+        QByteArray data;
+
+        if (line.isEmpty())
+            continue;
+        id++;
+
+        if (line.startsWith("bytes ")) {
+            bool ok;
+            int size = line.mid(6).toInt(&ok);
+            if (!ok || size <= 0 || size > MAX_REQUEST_BYTES) {
+                output.write(error(id, "bad request"));
+                continue;
+            }
+            data.resize(size);
+            if (fread(data.data(), 1, size, in) != size_t(size))
+                break;
+        } else {
+            fileName = QString::fromUtf8(line);
+        }
+
+        ServeTask *task = new ServeTask(id, fileName, data, &pool, &output);
+        if (Scheduler::threadCount() == 1) {
+            task->run();
+            delete task;
+            continue;
+        }
+        groups[current].spawn(task);
+        if (++count == batch) {
+            current ^= 1;
+            groups[current].wait();
+            count = 0;
+        }
+    }
+
+    groups[0].wait();
+    groups[1].wait();
+}
+
+#ifdef Q_OS_UNIX
+// serves one client of the socket on its own thread; the socket stays open
+// until the connection is deleted, so stop() never hits a reused descriptor
+class Connection : public QThread {
+public:
+    Connection(Server *server, int fd) : server(server), fd(fd) {}
+    ~Connection() { close(fd); }
+
+    // ends the requests of the client; the ones read already are answered
+    void stop() { shutdown(fd, SHUT_RD); }
+
+protected:
+    void run()
+    {
+        int inFd = dup(fd);
+        int outFd = dup(fd);
+        FILE *in = inFd >= 0 ? fdopen(inFd, "r") : 0;
+        FILE *out = outFd >= 0 ? fdopen(outFd, "w") : 0;
+
+        if (in && out)
+            server->serve(in, out);
+
+        if (out)
+            fclose(out);
+        else if (outFd >= 0)
+            close(outFd);
+        if (in)
+            fclose(in);
+        else if (inFd >= 0)
+            close(inFd);
+    }
+
+private:
+    Server *server;
+    int fd;
+};
+
+// written to by the SIGINT and SIGTERM handler, so that the signal wakes
+// the accepting thread whichever thread it is delivered to
+static int stopPipe[2];
+
+static void requestStop(int)
+{
+    char c = 0;
+    if (write(stopPipe[1], &c, 1) < 0) {
+        // the pipe is full, so a stop is pending already
+    }
+}
+#endif
+
+bool Server::listen(const QString& path)
+{
+#ifdef Q_OS_UNIX
+    QByteArray name = QFile::encodeName(path);
+    QList<Connection*> connections;
+    struct sockaddr_un address;
+    struct sigaction stop, oldInt, oldTerm;
+    struct pollfd fds[2];
+    struct stat st;
+    int fd, client, i;
+    bool ok = true;
+
+    if (name.size() >= int(sizeof(address.sun_path))) {
+        qWarning("Socket path is too long");
+        return false;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, name.constData());
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        qWarning("Cannot create socket");
+        return false;
+    }
+    // a socket left behind by an earlier server would make bind fail
+    if (stat(name.constData(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(name.constData());
+    // clients can connect only once the socket listens, so none gets in
+    // before the owner alone may use it
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0
+            || chmod(name.constData(), 0600) != 0 || ::listen(fd, 16) != 0) {
+        qWarning("Cannot listen on socket");
+        close(fd);
+        return false;
+    }
+    if (pipe(stopPipe) != 0) {
+        qWarning("Cannot create pipe");
+        close(fd);
+        unlink(name.constData());
+        return false;
+    }
+    fcntl(stopPipe[1], F_SETFL, O_NONBLOCK);
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = requestStop;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, &oldInt);
+    sigaction(SIGTERM, &stop, &oldTerm);
+    // a client that goes away must not end the service
+    signal(SIGPIPE, SIG_IGN);
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stopPipe[0];
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            qWarning("Cannot wait for connections");
+            ok = false;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        client = accept(fd, 0, 0);
+        for (i = connections.size() - 1; i >= 0; i--) {
+            if (connections[i]->isFinished())
+                delete connections.takeAt(i);
+        }
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            qWarning("Cannot accept connection");
+            ok = false;
+            break;
+        }
+        connections.append(new Connection(this, client));
+        connections.last()->start();
+    }
+
+    sigaction(SIGINT, &oldInt, 0);
+    sigaction(SIGTERM, &oldTerm, 0);
+    close(fd);
+    unlink(name.constData());
+    for (i = 0; i < connections.size(); i++)
+        connections[i]->stop();
+    for (i = 0; i < connections.size(); i++) {
+        connections[i]->wait();
+        delete connections[i];
+    }
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    return ok;
+#else
+    Q_UNUSED(path);
+    qWarning("Unix domain sockets are not supported on this system");
+    return false;
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <QString>
+
+#include <cstdio>
+
+#include "detector.h"
+
+// Answers detection requests with one model for the whole session. A
+// request is a line holding an image path, or "bytes N" followed by the N
+// bytes of an encoded image. Requests run concurrently on the scheduler and
+// each gets one JSON line back, in the order they finish:
+//   {"id":1,"image":"a.png","detections":[{"x":0,"y":0,"width":80,"height":180}]}
+// where id counts the requests of the stream from 1.
+class Server {
+public:
+    explicit Server(const struct model *model);
+
+    // serves the requests of in, answering on out, until in ends
+    void serve(FILE *in, FILE *out);
+    // serves every client that connects to the Unix domain socket at path
+    // until SIGINT or SIGTERM, then answers the requests read so far and
+    // removes the socket. Only the owner may connect. Returns false if the
+    // socket cannot be set up or stops accepting connections.
+    bool listen(const QString& path);
+
+private:
+    Server(const Server&);
+    Server& operator=(const Server&);
+
+    DetectorPool pool;
+};
+
+#endif // SERVER_H
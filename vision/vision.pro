@@ -9,7 +9,9 @@ SOURCES += \
     liblinear-1.8/blas/ddot.c \
     liblinear-1.8/blas/dnrm2.c \
     liblinear-1.8/blas/dscal.c \
-    logic.cpp
+    detector.cpp \
+    logic.cpp \
+    server.cpp
 
 HEADERS += \
     main_window.h \
@@ -17,5 +19,8 @@ HEADERS += \
     liblinear-1.8/tron.h \
     liblinear-1.8/blas/blas.h \
     liblinear-1.8/blas/blasp.h \
-    logic.h
+    detector.h \
+    logic.h \
+    server.h
 
+include(../common/common.pri)